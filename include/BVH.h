@@ -0,0 +1,168 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+
+struct AABB {
+	Eigen::Vector3f min{Eigen::Vector3f::Constant(std::numeric_limits<float>::infinity())};
+	Eigen::Vector3f max{Eigen::Vector3f::Constant(-std::numeric_limits<float>::infinity())};
+
+	void grow(const Eigen::Vector3f& p) {
+		min = min.cwiseMin(p);
+		max = max.cwiseMax(p);
+	}
+	void grow(const AABB& b) {
+		min = min.cwiseMin(b.min);
+		max = max.cwiseMax(b.max);
+	}
+
+	bool valid() const { return (min.array() <= max.array()).all(); }
+	Eigen::Vector3f centroid() const { return (min + max) * 0.5f; }
+
+	float surfaceArea() const {
+		if (!valid())
+			return 0.0f;
+		Eigen::Vector3f e = max - min;
+		return 2.0f * (e.x() * e.y() + e.y() * e.z() + e.z() * e.x());
+	}
+
+	// Slab test, returns entry distance or infinity if missed (or further than tMax)
+	float intersect(const Eigen::Vector3f& origin, const Eigen::Vector3f& invDir, float tMax) const {
+		Eigen::Vector3f t0 = (min - origin).cwiseProduct(invDir);
+		Eigen::Vector3f t1 = (max - origin).cwiseProduct(invDir);
+		float tNear = std::max(t0.cwiseMin(t1).maxCoeff(), 0.0f);
+		float tFar = std::min(t0.cwiseMax(t1).minCoeff(), tMax);
+		return tNear <= tFar ? tNear : std::numeric_limits<float>::infinity();
+	}
+};
+
+// Children of an interior node are always stored next to each other (left, left + 1)
+struct BVHNode {
+	AABB bounds;
+	int leftOrFirst; // Left child for interior nodes, first primitive for leaves
+	int count;       // Num of primitives, 0 for interior nodes
+
+	bool isLeaf() const { return count > 0; }
+};
+
+class BVH {
+  public:
+	static constexpr int MAX_DEPTH = 60; // Keeps the traversal stack bounded, the root is depth 0
+
+	struct BuildStats {
+		int nodeCount{0};
+		int leafCount{0};
+		int maxDepth{0};
+		int maxLeafSize{0};
+		float sahCost{0.0f};
+		double buildMs{0.0};
+	};
+
+	// Builds over the bounds of each primitive, leaves reference primitives through getPrimIndices()
+	void build(const std::vector<AABB>& primBounds);
+	void clear();
+
+	// Takes over an already built tree (e.g. one read back from a scene cache) whose prims are stored in leaf order
+	void assign(std::vector<BVHNode> builtNodes, const BuildStats& builtStats);
+
+	// Sorts primitives into leaf order, after this a leaf's [first, first + count) indexes them directly
+	template <typename T>
+	void reorder(std::vector<T>& prims) const;
+
+	bool empty() const { return nodes.empty(); }
+	const std::vector<BVHNode>& getNodes() const { return nodes; }
+	const std::vector<int>& getPrimIndices() const { return primIndices; }
+	const BuildStats& getBuildStats() const { return stats; }
+
+	// Closest hit traversal. hitPrim(slot, tClosest) tests a primitive and shrinks tClosest on a hit.
+	// `slot` is the position in leaf order (see reorder()). Returns the num of nodes visited
+	template <typename HitFunc>
+	int traverse(const Eigen::Vector3f& origin, const Eigen::Vector3f& dir, float& tClosest, HitFunc&& hitPrim) const;
+
+	// Same traversal, but hitLeaf(first, count, tClosest) gets a whole leaf at once (for kernels that test several prims together)
+	template <typename LeafFunc>
+	int traverseLeaves(const Eigen::Vector3f& origin, const Eigen::Vector3f& dir, float& tClosest, LeafFunc&& hitLeaf) const;
+
+  private:
+	static constexpr int NUM_BINS = 16;
+	static constexpr int MAX_LEAF_SIZE = 8;
+
+	std::vector<BVHNode> nodes;
+	std::vector<int> primIndices;
+	BuildStats stats;
+
+	void subdivide(int nodeIndex, int depth, const std::vector<AABB>& primBounds, const std::vector<Eigen::Vector3f>& centroids);
+};
+
+template <typename T>
+void BVH::reorder(std::vector<T>& prims) const {
+	std::vector<T> sorted;
+	sorted.reserve(primIndices.size());
+	for (int prim : primIndices)
+		sorted.push_back(prims[prim]);
+	prims.swap(sorted);
+}
+
+template <typename HitFunc>
+int BVH::traverse(const Eigen::Vector3f& origin, const Eigen::Vector3f& dir, float& tClosest, HitFunc&& hitPrim) const {
+	return traverseLeaves(origin, dir, tClosest, [&](int first, int count, float& tMax) {
+		for (int i = first; i < first + count; i++) {
+			hitPrim(i, tMax);
+		}
+	});
+}
+
+template <typename LeafFunc>
+int BVH::traverseLeaves(const Eigen::Vector3f& origin, const Eigen::Vector3f& dir, float& tClosest, LeafFunc&& hitLeaf) const {
+	if (nodes.empty())
+		return 0;
+
+	const float inf = std::numeric_limits<float>::infinity();
+	Eigen::Vector3f invDir = dir.cwiseInverse();
+
+	if (nodes[0].bounds.intersect(origin, invDir, tClosest) == inf)
+		return 1;
+
+	int stack[MAX_DEPTH + 4];
+	int stackSize = 0;
+	int nodeIndex = 0;
+	int visited = 0;
+
+	while (true) {
+		const BVHNode& node = nodes[nodeIndex];
+		visited++;
+
+		if (node.isLeaf()) {
+			hitLeaf(node.leftOrFirst, node.count, tClosest);
+			if (stackSize == 0)
+				break;
+			nodeIndex = stack[--stackSize];
+			continue;
+		}
+
+		// Visit the closer child first so tClosest shrinks as early as possible
+		int nearChild = node.leftOrFirst;
+		int farChild = node.leftOrFirst + 1;
+		float tNear = nodes[nearChild].bounds.intersect(origin, invDir, tClosest);
+		float tFar = nodes[farChild].bounds.intersect(origin, invDir, tClosest);
+		if (tFar < tNear) {
+			std::swap(nearChild, farChild);
+			std::swap(tNear, tFar);
+		}
+
+		if (tNear == inf) {
+			if (stackSize == 0)
+				break;
+			nodeIndex = stack[--stackSize];
+		} else {
+			nodeIndex = nearChild;
+			if (tFar != inf)
+				stack[stackSize++] = farChild;
+		}
+	}
+
+	return visited;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "MappedFile.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Film of a progressive render as of its last finished pass: summed colors, per pixel sample counts and, for
+// adaptive renders, the luminance sums and converged flags. The sampler is counter based (Sampler.h), so the
+// sample count is all of its position a render needs to pick up where the checkpoint left off. Files are host
+// endian and only valid for builds with the same layout, like scene caches
+
+constexpr uint32_t CHECKPOINT_VERSION = 1; // Bump when the file layout changes
+
+struct CheckpointState {
+	uint64_t key{0}; // Scene, camera and sampler settings the film was rendered with (RayTracer::checkpointKey)
+	int width{0};
+	int height{0};
+	int samples{0};        // Samples every pixel has been offered, the next pass starts at this sample index
+	bool adaptive{false};  // Luminance sums and converged flags follow the film
+};
+
+// Views of the arrays, width * height entries each (3 floats per pixel for color)
+struct CheckpointArrays {
+	const float* color{nullptr};
+	const int* samples{nullptr};
+	const float* luminanceSq{nullptr}; // Adaptive only
+	const uint8_t* converged{nullptr}; // Adaptive only
+};
+
+// Written to path.tmp, flushed to disk and renamed over path, so a crash at any point leaves either the old
+// checkpoint or the new one whole. False (and path untouched) if the write failed
+bool saveCheckpoint(const std::string& path, const CheckpointState& state, const CheckpointArrays& arrays);
+
+// Maps path into file, arrays point into it. False if it's missing, from another layout, doesn't match key or is
+// malformed, with the reason on stderr unless it's just missing
+bool loadCheckpoint(const std::string& path, uint64_t key, MappedFile& file, CheckpointState& state, CheckpointArrays& arrays);
@@ -3,7 +3,9 @@
 
 class Cube : public Shape {
   public:
-	Cube(float size = 1.0f, glm::vec3 center = glm::vec3(0.0f));
+	glm::vec3 min, max; // Corners, the tracer intersects the box itself rather than its triangles
+
+	Cube(float size = 1.0f, glm::vec3 center = glm::vec3(0.0f), Material mat = Material::NORMAL);
 
 	std::vector<float> getVertices() const override;
 };
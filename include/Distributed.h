@@ -0,0 +1,56 @@
+#pragma once
+
+#include "RayTracer.h"
+#include "RenderView.h"
+#include "TileGrid.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <type_traits>
+
+// Distributed rendering over TCP. The coordinator sends every worker the job and the built scene (a scene cache
+// snapshot, SceneCache.h) once, then hands out tiles. A worker renders its tile as a region of the full view and
+// sends back the tile's summed colors and sample counts, which the coordinator adds into its film. Sampler keys
+// are the full image's, so the merged film is bit for bit the one a local render would make
+// Messages are raw host endian structs: every process has to be the same build on the same kind of machine
+
+constexpr uint32_t DISTRIBUTED_VERSION = 1; // Bump when a message layout changes
+
+// Everything a worker needs besides the scene
+struct DistributedJob {
+	RenderView view; // The full image
+	int samples{1};
+	int samplesPerPass{1}; // Set by runCoordinator to its tracer's batch size, adaptive sampling checks pixels between passes
+	int bounces{64};
+	int rouletteDepth{3};
+	uint32_t seed{0};
+	float adaptiveThreshold{0.0f};
+	int minAdaptiveSamples{32};
+	int tileSize{32};
+	TileOrder tileOrder{TileOrder::Morton};
+	uint64_t sceneKey{0};
+};
+static_assert(std::is_trivially_copyable_v<DistributedJob>, "DistributedJob is sent as raw bytes");
+
+struct CoordinatorStats {
+	int workers{0};      // Connections accepted
+	int tiles{0};        // Tiles merged
+	int redispatched{0}; // Tiles handed out again after their worker failed or timed out
+};
+
+// Listening socket, on 127.0.0.1 only when every worker runs on this machine, else on every interface (workers
+// aren't authenticated, only listen on networks you trust). port 0 picks a free one, port is set to the one bound.
+// -1 on failure
+int listenOn(int& port, bool loopbackOnly);
+
+// Serves job's tiles to whoever connects on listenFd until every tile is merged into tracer's film, which is
+// resized for the view first (the scene sent is tracer's). A worker that disconnects, or sends nothing for
+// tileTimeout seconds, is dropped and its tile goes back in the queue. onTileMerged runs on the worker's
+// connection thread. False if the scene can't be serialized, or no worker was connected for tileTimeout seconds
+// while tiles were left
+bool runCoordinator(int listenFd, const DistributedJob& job, RayTracer& tracer, double tileTimeout, CoordinatorStats& stats,
+                    const std::function<void(const Tile&)>& onTileMerged = {});
+
+// Connects to a coordinator (retrying for a few seconds while it starts) and renders tiles until told to stop
+// False if it couldn't connect, the scene didn't load or the connection dropped mid job
+bool runWorker(const std::string& host, int port);
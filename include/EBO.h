@@ -0,0 +1,18 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <cstdint>
+#include <vector>
+
+// Element (index) buffer, bound while a VAO is bound it becomes part of that VAO
+class EBO {
+  public:
+	EBO(const std::vector<uint32_t>* indices);
+	~EBO();
+	void bind();
+	void unbind();
+	GLuint id();
+
+  private:
+	GLuint m_id{};
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <cstdint>
+#include <string>
+
+// Film: turns accumulated radiance (color sum + num of samples per pixel) into 8 bit display values
+// Per pixel: average, exposure, tonemap, then sRGB encode through a lookup table. Works on contiguous pixel
+// spans, so callers split the image into tiles and develop them on any thread
+
+enum class Tonemap {
+	Clamp,    // Values past 1 just clip
+	Reinhard, // x / (1 + x) per channel
+	ACES,     // Narkowicz's fit of the ACES filmic curve
+};
+
+const char* tonemapName(Tonemap tonemap);
+bool parseTonemap(const std::string& name, Tonemap& tonemap); // False if the name isn't one of tonemapName()'s
+
+struct FilmSettings {
+	float exposure{0.0f}; // In stops, +1 doubles the brightness
+	Tonemap tonemap{Tonemap::Clamp};
+	bool srgb{true}; // Off writes the linear values straight out
+};
+
+constexpr int FILM_TILE = 1024; // Pixels developed together, their scratch stays in L1
+
+// Accumulation as the film reads it, heap or memory mapped alike
+using FilmColors = Eigen::Ref<const Eigen::Matrix<float, 3, Eigen::Dynamic>>;
+using FilmSamples = Eigen::Ref<const Eigen::Array<int, 1, Eigen::Dynamic>>;
+
+// Develop pixels [start, end), pixels without samples come out black
+// RGBA8 texels (alpha 255) into out[start, end)
+void developRGBA8(const FilmColors& color, const FilmSamples& samples, int start, int end, const FilmSettings& settings, uint32_t* out);
+// 0-255 channels into columns [start, end) of out (already sized)
+void developRGB8(const FilmColors& color, const FilmSamples& samples, int start, int end, const FilmSettings& settings, Eigen::Matrix<int, 3, Eigen::Dynamic>& out);
+// Packed RGB bytes into out[0, 3 * (end - start)), for streaming a span straight to a file
+void developRGB8Packed(const FilmColors& color, const FilmSamples& samples, int start, int end, const FilmSettings& settings, uint8_t* out);
+// Linear averages times the exposure, no tonemap or encode (HDR output), packed like developRGB8Packed
+void developLinear(const FilmColors& color, const FilmSamples& samples, int start, int end, const FilmSettings& settings, float* out);
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Writes 0-255 colors (one column per pixel, row major from the top left) as a binary PPM
+// Values are clamped. Returns false if the file couldn't be written
+bool writePPM(const std::string& path, int width, int height, const Eigen::Matrix<int, 3, Eigen::Dynamic>& colors);
+
+// Image written a span of pixels at a time, for images too big to hold in memory. Every span goes straight to its
+// place in the file, so tiles or rows can land in any order and from any thread
+// .pfm files get linear float RGB (bottom row first, as PFM wants), anything else 8 bit binary PPM
+class ImageStream {
+  public:
+	ImageStream() = default;
+	~ImageStream();
+
+	ImageStream(const ImageStream&) = delete;
+	ImageStream& operator=(const ImageStream&) = delete;
+
+	// Creates the file at its full size (header + all pixels zero). False if it can't be
+	bool open(const std::string& path, int width, int height);
+	// Pixels [x, x + count) of row y (from the top), 3 floats or 3 bytes each as isFloat() says
+	// Thread safe, false if the write failed
+	bool writeSpan(int x, int y, int count, const void* pixels);
+	bool close(); // False if any write since open() failed
+
+	bool isFloat() const { return floatPixels; }
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+
+  private:
+	int fd{-1};
+	int width{0};
+	int height{0};
+	bool floatPixels{false};
+	size_t headerSize{0};
+	std::atomic<bool> failed{false};
+};
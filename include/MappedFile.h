@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Memory map of a whole file, unmapped on destruction. Read only unless made with create()
+class MappedFile {
+  public:
+	MappedFile() = default;
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	MappedFile(MappedFile&& other) noexcept;
+	MappedFile& operator=(MappedFile&& other) noexcept;
+
+	// Returns false if the file couldn't be opened or mapped (empty files map to an empty view)
+	bool open(const std::string& path);
+	// Shared read/write map of a file (re)created at size bytes of zeros. Its disk space is reserved here (false, and
+	// no file, if the disk can't hold it) while RAM is only used by pages being touched. Scratch space: the file is
+	// unlinked once mapped, the disk space goes back when the map does
+	bool create(const std::string& path, size_t size);
+	void close();
+
+	const char* data() const { return bytes; }
+	char* writableData() const { return writable ? bytes : nullptr; } // nullptr for read only maps
+	size_t size() const { return length; }
+	bool isOpen() const { return opened; }
+
+  private:
+	char* bytes{nullptr};
+	size_t length{0};
+	bool opened{false};
+	bool writable{false};
+};
@@ -0,0 +1,19 @@
+#pragma once
+#include "Shape.h"
+#include <cstdint>
+
+// Indexed triangle mesh: vertices (xyz, relative to position) are shared, every 3 indices make a triangle
+// The viewer draws it indexed and the tracer copies the same buffers, nothing gets expanded into a soup
+class Mesh : public Shape {
+  public:
+	std::vector<uint32_t> indices;
+
+	Mesh(std::vector<float> positions, std::vector<uint32_t> indices, Material mat = Material::NORMAL);
+
+	std::vector<float> getVertices() const override; // The shared vertices, use with getIndices()
+	const std::vector<uint32_t>* getIndices() const override { return &indices; }
+
+	const std::vector<float>& getPositions() const { return vertices; }
+	int numVertices() const { return (int)(vertices.size() / 3); }
+	int numTriangles() const { return (int)(indices.size() / 3); }
+};
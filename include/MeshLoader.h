@@ -0,0 +1,28 @@
+#pragma once
+
+#include "Material.h"
+#include "Mesh.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct MeshLoadStats {
+	double seconds{0.0};
+	size_t bytes{0};
+	int vertices{0};
+	int triangles{0};
+
+	double megabytesPerSecond() const { return seconds > 0.0 ? (double)bytes / 1e6 / seconds : 0.0; }
+	double trianglesPerSecond() const { return seconds > 0.0 ? (double)triangles / seconds : 0.0; }
+};
+
+// Wavefront OBJ (positions + faces, polygons are fan triangulated) or binary PLY, picked by extension.
+// The file is memory mapped and parsed in parallel chunks straight into the final vertex/index arrays,
+// so besides the mapping nothing bigger than the finished mesh is ever allocated.
+// Returns nullptr (after printing why) if the file couldn't be loaded
+Mesh* loadMesh(const std::string& path, Material material = Material::DIFFUSE, MeshLoadStats* stats = nullptr);
+
+// The parsers on their own, over bytes already in memory. Return false on malformed input
+bool parseOBJ(const char* data, size_t size, std::vector<float>& positions, std::vector<uint32_t>& indices, std::string& error);
+bool parsePLY(const char* data, size_t size, std::vector<float>& positions, std::vector<uint32_t>& indices, std::string& error);
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "BVH.h"
+#include "Primitives.h"
+#include <vector>
+
+// Which kernel to run. Only the levels the compiler targets (-march) are actually available
+enum class SimdLevel {
+	Scalar,
+	SSE,  // 4 wide, packet done in two halves
+	AVX2, // 8 wide
+};
+
+SimdLevel bestSimdLevel();
+bool isSimdLevelSupported(SimdLevel level);
+const char* simdLevelName(SimdLevel level);
+
+// Spheres as structure of arrays so one load grabs the same component of several spheres
+struct SphereSoA {
+	std::vector<float> cx, cy, cz, radiusSq;
+
+	void clear();
+	void push(const Eigen::Vector3f& center, float radius);
+	int size() const { return (int)cx.size(); }
+};
+
+// Up to 8 rays traced together. Lanes past `count` are padding and never hit anything
+struct RayPacket {
+	static constexpr int SIZE = 8;
+
+	alignas(32) float ox[SIZE];
+	alignas(32) float oy[SIZE];
+	alignas(32) float oz[SIZE];
+	alignas(32) float dx[SIZE];
+	alignas(32) float dy[SIZE];
+	alignas(32) float dz[SIZE];
+	alignas(32) float idx[SIZE]; // 1 / direction, for the box tests
+	alignas(32) float idy[SIZE];
+	alignas(32) float idz[SIZE];
+	alignas(32) float tHit[SIZE];  // Closest hit so far
+	alignas(32) int hitIndex[SIZE]; // Sphere that produced tHit, -1 if none
+	int count{0};
+
+	void clear();
+	void add(const Eigen::Vector3f& origin, const Eigen::Vector3f& dir, float tMax);
+};
+
+// Tests every ray of the packet against spheres [first, last), only closer hits overwrite tHit/hitIndex
+void intersectSpheresPacket(SimdLevel level, RayPacket& packet, const SphereSoA& spheres, int first, int last);
+
+// True if any ray of the packet enters the box before its current tHit
+bool packetHitsBox(SimdLevel level, const RayPacket& packet, const AABB& box);
+
+// One ray against indexed triangles [first, last), 8 (AVX2) or 4 (SSE) triangles at a time with the watertight test
+// Corners are read from `positions` (xyz per vertex). A closer hit shrinks tHit and sets hitIndex
+void intersectTriangles(SimdLevel level, const WatertightRay& ray, const float* positions, const TrianglePrim* triangles, int first, int last, float& tHit, int& hitIndex);
+
+// Closest hit through a BVH whose leaves index straight into `spheres` (i.e. spheres stored in BVH order)
+// Returns num of nodes the packet visited
+int traversePacket(SimdLevel level, RayPacket& packet, const BVH& bvh, const SphereSoA& spheres);
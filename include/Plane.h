@@ -0,0 +1,12 @@
+#pragma once
+#include "Shape.h"
+
+// Infinite plane through `position`. The viewer only draws a displaySize wide patch of it
+class Plane : public Shape {
+  public:
+	glm::vec3 normal;
+
+	Plane(glm::vec3 point, glm::vec3 normal, Material mat = Material::NORMAL, float displaySize = 64.0f);
+
+	std::vector<float> getVertices() const override;
+};
@@ -0,0 +1,222 @@
+#pragma once
+
+#include "BVH.h"
+#include "Material.h"
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+// Flat, tracer-side copies of the scene shapes. Every type has its own array and its own
+// intersect/normal overloads, so the hot loop never needs RTTI or virtual calls
+
+enum class PrimType {
+	Sphere,
+	Triangle,
+	Quad,
+	Plane,
+	Box,
+};
+
+struct SpherePrim {
+	Eigen::Vector3f center;
+	float radius;
+	Material material;
+};
+
+// Indexed triangle, corners point into a vertex buffer shared by the whole scene (xyz per vertex)
+struct TrianglePrim {
+	int v0, v1, v2;
+	Material material;
+};
+
+// Parallelogram spanned by u and v from corner
+struct QuadPrim {
+	Eigen::Vector3f corner;
+	Eigen::Vector3f u;
+	Eigen::Vector3f v;
+	Eigen::Vector3f w; // n / (n . n), turns a plane point into (alpha, beta)
+	Eigen::Vector3f normal;
+	float d; // Plane offset (normal . corner)
+	Material material;
+};
+
+// Infinite plane, unbounded so it lives outside the BVHs
+struct PlanePrim {
+	Eigen::Vector3f normal;
+	float d; // normal . (any point on the plane)
+	Material material;
+};
+
+// Axis aligned box
+struct BoxPrim {
+	Eigen::Vector3f min;
+	Eigen::Vector3f max;
+	Material material;
+};
+
+// Min distance for a hit, keeps bounced rays from hitting the surface they left
+constexpr float HIT_EPSILON = 0.001f;
+
+inline float intersectPrim(const SpherePrim& sphere, const Eigen::Vector3f& origin, const Eigen::Vector3f& dir) {
+	Eigen::Vector3f oc = origin - sphere.center;
+	float a = dir.squaredNorm();
+	float half_b = dir.dot(oc);
+	float c = oc.squaredNorm() - sphere.radius * sphere.radius;
+	float discriminant = half_b * half_b - a * c;
+
+	if (discriminant <= 0)
+		return std::numeric_limits<float>::infinity();
+
+	float t = (-half_b - std::sqrt(discriminant)) / a;
+	return t > HIT_EPSILON ? t : std::numeric_limits<float>::infinity();
+}
+
+// Ray side setup of the watertight triangle test (Woop, Benthin, Wald 2013): axes permuted so the
+// direction's largest component is z, then a shear that turns the ray into +z. Shared edges can't leak rays
+struct WatertightRay {
+	Eigen::Vector3f origin;
+	int kx, ky, kz;
+	float sx, sy, sz;
+};
+
+inline WatertightRay makeWatertightRay(const Eigen::Vector3f& origin, const Eigen::Vector3f& dir) {
+	WatertightRay ray;
+	ray.origin = origin;
+
+	dir.cwiseAbs().maxCoeff(&ray.kz);
+	ray.kx = (ray.kz + 1) % 3;
+	ray.ky = (ray.kx + 1) % 3;
+	if (dir[ray.kz] < 0.0f)
+		std::swap(ray.kx, ray.ky); // Keeps the winding
+
+	ray.sx = dir[ray.kx] / dir[ray.kz];
+	ray.sy = dir[ray.ky] / dir[ray.kz];
+	ray.sz = 1.0f / dir[ray.kz];
+	return ray;
+}
+
+// Two sided, edges and vertices count as inside
+inline float intersectWatertight(const WatertightRay& ray, const float* p0, const float* p1, const float* p2) {
+	const float inf = std::numeric_limits<float>::infinity();
+
+	float az = p0[ray.kz] - ray.origin[ray.kz];
+	float bz = p1[ray.kz] - ray.origin[ray.kz];
+	float cz = p2[ray.kz] - ray.origin[ray.kz];
+	float ax = p0[ray.kx] - ray.origin[ray.kx] - ray.sx * az;
+	float ay = p0[ray.ky] - ray.origin[ray.ky] - ray.sy * az;
+	float bx = p1[ray.kx] - ray.origin[ray.kx] - ray.sx * bz;
+	float by = p1[ray.ky] - ray.origin[ray.ky] - ray.sy * bz;
+	float cx = p2[ray.kx] - ray.origin[ray.kx] - ray.sx * cz;
+	float cy = p2[ray.ky] - ray.origin[ray.ky] - ray.sy * cz;
+
+	// Scaled barycentrics, all the same sign when the ray passes through the triangle
+	float u = cx * by - cy * bx;
+	float v = ax * cy - ay * cx;
+	float w = bx * ay - by * ax;
+	if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f))
+		return inf;
+
+	float det = u + v + w;
+	if (det == 0.0f)
+		return inf;
+
+	float t = (u * az + v * bz + w * cz) * ray.sz / det;
+	return t > HIT_EPSILON ? t : inf;
+}
+
+inline float intersectPrim(const QuadPrim& quad, const Eigen::Vector3f& origin, const Eigen::Vector3f& dir) {
+	const float inf = std::numeric_limits<float>::infinity();
+
+	float denom = quad.normal.dot(dir);
+	if (std::abs(denom) < 1e-8f)
+		return inf;
+
+	float t = (quad.d - quad.normal.dot(origin)) / denom;
+	if (t <= HIT_EPSILON)
+		return inf;
+
+	Eigen::Vector3f planar = origin + t * dir - quad.corner;
+	float alpha = quad.w.dot(planar.cross(quad.v));
+	float beta = quad.w.dot(quad.u.cross(planar));
+	if (alpha < 0.0f || alpha > 1.0f || beta < 0.0f || beta > 1.0f)
+		return inf;
+
+	return t;
+}
+
+inline float intersectPrim(const PlanePrim& plane, const Eigen::Vector3f& origin, const Eigen::Vector3f& dir) {
+	const float inf = std::numeric_limits<float>::infinity();
+
+	float denom = plane.normal.dot(dir);
+	if (std::abs(denom) < 1e-8f)
+		return inf;
+
+	float t = (plane.d - plane.normal.dot(origin)) / denom;
+	return t > HIT_EPSILON ? t : inf;
+}
+
+// Slab test. Rays starting inside (bounced off an inner face) hit the exit side instead
+inline float intersectPrim(const BoxPrim& box, const Eigen::Vector3f& origin, const Eigen::Vector3f& dir) {
+	const float inf = std::numeric_limits<float>::infinity();
+
+	Eigen::Vector3f invDir = dir.cwiseInverse();
+	Eigen::Vector3f t0 = (box.min - origin).cwiseProduct(invDir);
+	Eigen::Vector3f t1 = (box.max - origin).cwiseProduct(invDir);
+	float tNear = t0.cwiseMin(t1).maxCoeff();
+	float tFar = t0.cwiseMax(t1).minCoeff();
+
+	if (tNear > tFar || tFar <= HIT_EPSILON)
+		return inf;
+	return tNear > HIT_EPSILON ? tNear : tFar;
+}
+
+inline Eigen::Vector3f normalAt(const SpherePrim& sphere, const Eigen::Vector3f& point) {
+	return (point - sphere.center) / sphere.radius;
+}
+
+inline Eigen::Vector3f normalAt(const QuadPrim& quad, const Eigen::Vector3f&) {
+	return quad.normal;
+}
+
+inline Eigen::Vector3f normalAt(const PlanePrim& plane, const Eigen::Vector3f&) {
+	return plane.normal;
+}
+
+// Outward normal of the face the point is closest to
+inline Eigen::Vector3f normalAt(const BoxPrim& box, const Eigen::Vector3f& point) {
+	// Scenes skip flat boxes, the clamp only keeps a stray one (e.g. from an old scene cache) from turning into nan
+	Eigen::Vector3f halfSize = ((box.max - box.min) * 0.5f).cwiseMax(std::numeric_limits<float>::min());
+	Eigen::Vector3f local = (point - (box.min + box.max) * 0.5f).cwiseQuotient(halfSize);
+
+	int axis;
+	local.cwiseAbs().maxCoeff(&axis);
+
+	Eigen::Vector3f normal = Eigen::Vector3f::Zero();
+	normal[axis] = local[axis] > 0.0f ? 1.0f : -1.0f;
+	return normal;
+}
+
+inline AABB boundsOf(const SpherePrim& sphere) {
+	AABB b;
+	b.grow(sphere.center - Eigen::Vector3f::Constant(sphere.radius));
+	b.grow(sphere.center + Eigen::Vector3f::Constant(sphere.radius));
+	return b;
+}
+
+inline AABB boundsOf(const QuadPrim& quad) {
+	AABB b;
+	b.grow(quad.corner);
+	b.grow(quad.corner + quad.u);
+	b.grow(quad.corner + quad.v);
+	b.grow(quad.corner + quad.u + quad.v);
+	return b;
+}
+
+inline AABB boundsOf(const BoxPrim& box) {
+	AABB b;
+	b.grow(box.min);
+	b.grow(box.max);
+	return b;
+}
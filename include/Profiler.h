@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Scoped-zone profiler for the tracer hot path. Every thread records into its own ring buffer (no locks
+// while recording, oldest zones get overwritten) and the whole thing can be dumped as Chrome trace_event
+// JSON (chrome://tracing or ui.perfetto.dev). Off at runtime until setEnabled(true), compiled out without PBR_PROFILER
+class Profiler {
+  public:
+	struct Zone {
+		const char* name; // Must outlive the profiler (string literals)
+		int64_t startNs;
+		int64_t endNs;
+		int threadId;
+		int sample;
+		int bounce;
+		int chunk; // -1 if the zone isn't a per chunk task
+	};
+
+	static constexpr int RING_SIZE = 1 << 16; // Zones kept per thread
+
+	static void setEnabled(bool enabled);
+	static bool isEnabled();
+
+	// Sample/bounce the tracer is in, stamped onto every zone that starts after this (-1 = outside of one)
+	static void setContext(int sample, int bounce);
+
+	static void record(const char* name, int64_t startNs, int64_t endNs, int sample, int bounce, int chunk);
+	static int64_t nowNs();
+
+	// Drops every recorded zone
+	static void clear();
+
+	// Zones still in the rings, as trace_event JSON. Returns false if the file couldn't be written
+	// Best called while nothing is tracing, zones being recorded meanwhile may come out torn
+	static bool writeChromeTrace(const std::string& path);
+};
+
+// Records the time between construction and destruction (if the profiler was enabled at construction)
+class ProfileZone {
+  public:
+	explicit ProfileZone(const char* name, int chunk = -1);
+	~ProfileZone();
+
+	ProfileZone(const ProfileZone&) = delete;
+	ProfileZone& operator=(const ProfileZone&) = delete;
+
+  private:
+	const char* name;
+	int64_t startNs{-1};
+	int sample{-1};
+	int bounce{-1};
+	int chunk;
+};
+
+#define PBR_PROFILE_CONCAT_(a, b) a##b
+#define PBR_PROFILE_CONCAT(a, b) PBR_PROFILE_CONCAT_(a, b)
+
+#ifdef PBR_PROFILER
+#define PROFILE_ZONE(...) ProfileZone PBR_PROFILE_CONCAT(profileZone, __LINE__)(__VA_ARGS__)
+#define PROFILE_CONTEXT(sample, bounce) Profiler::setContext(sample, bounce)
+#else
+#define PROFILE_ZONE(...) ((void)0)
+#define PROFILE_CONTEXT(sample, bounce) ((void)0)
+#endif
@@ -1,67 +1,284 @@
 #pragma once
 
+#include "BVH.h"
+#include "Checkpoint.h"
+#include "Film.h"
+#include "ImageWriter.h"
+#include "MappedFile.h"
 #include "Material.h"
-#include "Renderer.h"
-#include "Sphere.h"
-#include "Square.h"
+#include "PacketKernels.h"
+#include "RenderView.h"
+#include "ThreadPool.h"
+#include "TileGrid.h"
+#include "TraceScene.h"
 #include <Eigen/Core>
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <functional>
 #include <limits>
-#include <random>
+#include <mutex>
+#include <stop_token>
+#include <string>
 #include <thread>
 #include <vector>
 
-class Renderer;
-
 struct ThreadChunk {
 	int start;
 	int end;
 };
 
+// One side of the double buffered accumulation: summed color and num of samples taken per pixel
+// The views point at the heap, or at a memory mapped scratch file for films that don't fit in RAM
+struct AccumulationBuffer {
+	Eigen::Map<Eigen::Matrix<float, 3, Eigen::Dynamic>> color{nullptr, 3, 0};
+	Eigen::Map<Eigen::Array<int, 1, Eigen::Dynamic>> samples{nullptr, 1, 0};
+
+	AccumulationBuffer() = default;
+	AccumulationBuffer(const AccumulationBuffer&) = delete;
+	AccumulationBuffer& operator=(const AccumulationBuffer&) = delete;
+
+	void reset(int numPixels); // Resized and zeroed
+	// From now on stored in path (colors, then sample counts), recreated by every reset. Empty goes back to
+	// the heap. False if the file can't be made, the buffer is then empty
+	bool setScratch(const std::string& path, int numPixels);
+	bool isMapped() const { return scratch.isOpen(); }
+
+  private:
+	void point(char* colorBytes, char* sampleBytes, int numPixels);
+
+	Eigen::Matrix<float, 3, Eigen::Dynamic> heapColor;
+	Eigen::Array<int, 1, Eigen::Dynamic> heapSamples;
+	std::string scratchPath;
+	MappedFile scratch;
+};
+
+// Totals for the last traceAll(), for benchmarks and the headless tools
+struct RenderStats {
+	double buildSeconds{0.0}; // Scene flattening + BVH builds (or the scene cache load)
+	double traceSeconds{0.0}; // Every sample, including ray generation and accumulation
+	long long raySegments{0}; // Rays traced summed over every bounce
+	int samples{0};           // Samples per pixel taken (adaptive sampling may stop before the target)
+	int passes{0};            // Batches of samples traced together
+	int convergedPixels{0};   // Pixels adaptive sampling stopped early
+};
+
 class RayTracer {
   private:
-	int N;         // Num of rays (diff bc numPixels*sampleCount)
+	int N;         // Num of rays, raySlots * batchSize. Ray r is sample r / raySlots of the pixel in slot windowBegin + r % raySlots
 	int numPixels; // Actual number of pixels
+	int samplesPerPass{1};  // Samples of each pixel traced together in one pass
+	int maxRays{1 << 21};   // Ray budget, caps the batch and the ray buffers. Past it, passes go window by window
+	int batchSize{1};       // Samples per pass the ray buffers are sized for, samplesPerPass within the budget
+	int raySlots{0};        // Pixels the ray buffers hold per sample, numPixels unless the image is over the budget
+	int passSamples{1};     // Samples being traced in the current pass (the last one can be short)
 	int targetSampleCount;
 	int currentSampleCount;
 	int maxBounces;
-	int NUM_THREADS{64};
+	int rouletteDepth{3}; // Bounces before Russian roulette may end a path, maxBounces or more turns it off
+	int NUM_CHUNKS{64}; // Work is split into at least this many tasks per bounce (more on big images, see computeChunks)
 	std::atomic<bool> tracing{false}; // We want this to be atomic since it's being assigned within multiple threads
 
+	// Created once, reused by every pass of every sample (mutable so const readers can develop the film on it too)
+	mutable ThreadPool pool;
+
+	// Background render (traceAllAsync/restartAsync). Stopped cooperatively: the stop token is polled between
+	// passes, bounces and chunks, so a cancel lands within one chunk of work
+	std::jthread renderJob;
+	std::stop_token stopToken; // Of the render in progress, empty (never stops) for synchronous ones
+
+	// Wavefront: indices of the rays still alive, compacted after every bounce
+	// With wavefront off the queue keeps every ray and kernels skip dead ones instead
+	bool wavefront{true};
+	std::vector<int> activeRays;
+	std::vector<int> nextActiveRays;
+	int numActive{0};
+	std::vector<int> chunkAlive = std::vector<int>(NUM_CHUNKS);   // Survivors per chunk after shading (sized with chunks)
+	std::vector<int> chunkOffsets = std::vector<int>(NUM_CHUNKS); // Where each chunk's survivors go in the next queue
+
+	// Pixels are queued tile by tile (TileGrid.h), chunks hold about a tile's worth of rays
+	// Ray slots follow the same order, so walking a tile's rays walks memory front to back
+	TileGrid tiles;
+	int tileSize{32};
+	TileOrder tileOrder{TileOrder::Morton};
+	Eigen::Array<int, 1, Eigen::Dynamic> tile_pending; // Pixels of each tile not accumulated yet this pass
+	std::function<void(const Tile&, int)> tileCallback;
+
+	// Window: the run of whole tiles whose rays are in flight. An image over the ray budget is traced a window
+	// at a time through the same buffers, so ray state is sized by the budget and only the film is per pixel
+	int windowBegin{0}; // Slots [windowBegin, windowEnd)
+	int windowEnd{0};
+	int windowTileBegin{0}; // Tiles [windowTileBegin, windowTileEnd)
+	int windowTileEnd{0};
+	int activeBegin{0}; // The window's part of activeSlots
+	int activeEnd{0};
+	std::vector<int> window_pixel; // Pixel of each window slot
+
+	// Throughput stats
+	std::atomic<double> raysPerSecond{0.0};
+	std::atomic<long long> nodesVisited{0};
+	std::atomic<double> avgNodesVisited{0.0};
+	RenderStats lastStats;
+	bool verbose{true}; // Per sample logging
+
+	// Flattened primitives + acceleration structures, rebuilt once per render
+	TraceScene scene;
+	double sceneSeconds{0.0}; // How long the current scene took to build or load
+	bool useBVH{true};
+	SimdLevel simdLevel{bestSimdLevel()};
+
 	Eigen::Array<int, 1, Eigen::Dynamic> ray_steps;               // Lifecycle of each ray
 	Eigen::Matrix<float, 3, Eigen::Dynamic> ray_colors;           // Final color to be rendered on ImagePlane texture
 	Eigen::Matrix<float, 3, Eigen::Dynamic> ray_origins;          // Position of each ray
 	Eigen::Matrix<float, 3, Eigen::Dynamic> ray_directions;       // Direction of each ray (normalized)
 	Eigen::Matrix<float, 1, Eigen::Dynamic> t_distance;           // Tracks closest hit (prevents rendering mistakes due to execution order)
-	Eigen::Matrix<float, 3, Eigen::Dynamic> accumulated_buffer_a; // Double buffered
-	Eigen::Matrix<float, 3, Eigen::Dynamic> accumulated_buffer_b;
+	Eigen::Array<int, 1, Eigen::Dynamic> hit_type;                // PrimType of the closest hit
+	Eigen::Array<int, 1, Eigen::Dynamic> hit_object;              // Index into that type's array in scene, -1 if nothing was hit
+	AccumulationBuffer accumulated_buffer_a; // Double buffered, unless a is mapped (setFilmScratch) and b stays empty
+	AccumulationBuffer accumulated_buffer_b;
+
+	// Accumulation happens as paths finish, inside the chunk that shaded them. A pixel's samples are summed in order
+	// by whichever of its rays finishes last, so the sums don't depend on the batch size or on scheduling
+	AccumulationBuffer* passTarget{nullptr};       // Buffer this pass accumulates into, nullptr outside traceAll
+	const AccumulationBuffer* passSource{nullptr}; // Sums so far, passTarget = passSource + this pass
+	Eigen::Array<int, 1, Eigen::Dynamic> pixel_pending; // Rays of each window slot still in flight this pass
 
 	// We need this since we are dealing with multiple threads + rendering
-	std::atomic<const Eigen::Matrix<float, 3, Eigen::Dynamic>*> display_buffer;
+	std::atomic<const AccumulationBuffer*> display_buffer;
 	std::atomic<int> display_sample_count{0};
 
-	// For random sampling
-	std::mt19937 rng;
-	std::uniform_real_distribution<float> dist;
+	// Exposure/tonemap/encode the accumulation is developed with, guarded by resolveMutex
+	FilmSettings film;
+	FilmSettings passFilm; // Copy taken at the start of each pass for the tiles it resolves
+
+	// RGBA8 copy of the display average for the viewer, resolved by the render thread whenever a pass lands
+	// The back image is written outside displayMutex, only the swap and readers' copies take it
+	bool resolveEnabled{false};
+	mutable std::mutex resolveMutex; // One resolve at a time, it owns the back image
+	std::vector<uint32_t> display_rgba_front;
+	std::vector<uint32_t> display_rgba_back;
+	mutable std::mutex displayMutex;
+	std::atomic<uint64_t> displayVersion{0}; // Bumps on every swap, so readers can skip frames with nothing new
+
+	// Adaptive sampling: a pixel stops getting samples once the error of its mean is below the threshold
+	// Its per pixel state only exists while it's on, without it every slot of a window is active
+	float adaptiveThreshold{0.0f}; // Error of the pixel mean at 95% confidence, 0 means every pixel gets every sample
+	int minAdaptiveSamples{32};    // Variance estimates from fewer samples aren't trusted
+	bool trackConvergence{false};  // Adaptive sampling was on when the render started
+	Eigen::Array<float, 1, Eigen::Dynamic> luminance_sq_sum;  // Running sum of squared sample luminance (the mean comes from the accumulation)
+	Eigen::Array<uint8_t, 1, Eigen::Dynamic> pixel_converged; // Set once a pixel stops being sampled
+	std::vector<int> activeSlots;                             // Slots still being sampled (ascending), rays are only generated for these
+	std::vector<int> nextActiveSlots;
+	int numActivePixels{0};
+
+	// Keys the counter based sampler (Sampler.h), same seed same image
+	uint32_t seed{0};
+
+	// Set from the view by initializeRays. A region render keys the sampler by the full image's pixel indices
+	int regionX{0};
+	int regionY{0};
+	int regionImageWidth{0}; // Full image width, 0 when the view is the whole image
+
+	// Checkpoints (Checkpoint.h): the film is saved at the end of a pass once checkpointInterval seconds went by since
+	// the last save, and after the last pass. Passes a cancel cuts short are never saved
+	std::string checkpointPath; // Empty means no checkpoints
+	double checkpointInterval{60.0};
+	uint64_t checkpointKeyValue{0}; // Of the render in progress, hashing the scene isn't free
+	// Checkpoint the next traceAll continues from, open only between resumeFrom() and that render
+	MappedFile resumeFile;
+	CheckpointState resumeState;
+	CheckpointArrays resumeArrays;
 
   public:
 	// Init
 	RayTracer(int numPixels, int maxBounces, int sampleCount = 1);
-	void initializeRays(Renderer&, int sampleIndex);
+	~RayTracer();
+	// Up to batchSize samples from sampleIndex on, for the current window (the first one outside a render)
+	void initializeRays(const RenderView& view, int sampleIndex, int numSamples = 1);
 	void resize(int numPixels);
+	void allocateRays(); // Ray buffers for the current batch size and budget
 	void setSampleCount(int samples);
+	void setSamplesPerPass(int samples) { samplesPerPass = std::max(samples, 1); }
+	void setRayBudget(int rays) { maxRays = std::max(rays, 1); }
+	void setTileSize(int size) { tileSize = std::max(size, 1); }
+	void setTileOrder(TileOrder order) { tileOrder = order; }
+	// Called (from a worker thread) whenever a tile's pixels are all accumulated, with the samples they have now
+	// Set it before rendering, it's not synchronized with a render in progress
+	void setTileCallback(std::function<void(const Tile& tile, int samples)> callback) { tileCallback = std::move(callback); }
 
-	// For multithreading
+	// For multithreading (chunks index into the active ray queue)
 	std::vector<ThreadChunk> chunks;
-	void computeChunks();
-	void traceChunk(int chunkIndex, const std::vector<Shape*>& worldObjects);
+	void computeChunks(int numItems);
+	void resetActiveRays(); // Every active pixel's ray back in the queue, chunks recomputed over it
+	void resetActivePixels(); // Every pixel unconverged again
+	void updateConvergence(const AccumulationBuffer& accumulated, AccumulationBuffer& next); // Drops converged pixels from the active list, freezes them in next
+	void compactActiveRays();
+	void traceChunk(int chunkIndex);
+	void traceChunkPackets(int chunkIndex);
+	void resetChunk(int chunkIndex);
+	int shadeChunk(int chunkIndex); // Returns num of rays still alive, finished paths get accumulated during a pass
+	void bounceChunk(int chunkIndex); // Reset, trace and shade one chunk back to back, survivors go to chunkAlive
+	void accumulateSlot(int slot, AccumulationBuffer& dst, const AccumulationBuffer& src); // The pass's samples of the slot's pixel, in order
+	void accumulateRange(int start, int end, AccumulationBuffer& dst, const AccumulationBuffer& src); // Slots [start, end), all in the current window
 
 	// Trace
-	void traceAllAsync(const std::vector<Shape*>& worldObjects, Renderer& renderer);
+	void buildAccelerationStructure(const std::vector<Shape*>& worldObjects);
+	// worldObjects is read by the render thread, it has to outlive the job (or a cancel())
+	void traceAllAsync(const std::vector<Shape*>& worldObjects, const RenderView& view); // No-op while a render is running
+	void restartAsync(const std::vector<Shape*>& worldObjects, const RenderView& view); // Abandons the running render, then starts over
+	void restartAsync(const RenderView& view);                                          // Same, keeping the scene already built (e.g. camera moved)
+	void cancel();                                                                      // Stops the running render and waits for it, buffers keep the last finished pass
+
+	// Block until every sample is done or stop is requested
+	void traceAll(const std::vector<Shape*>& worldObjects, const RenderView& view, std::stop_token stop = {});
+	void traceAll(const RenderView& view, std::stop_token stop = {}); // Same, over the scene already built or loaded
 	void traceStep();
 
-	// Color averaging
+	// Scene cache (SceneCache.h). Load returns false when there's no usable cache for key, the scene is then empty
+	bool loadScene(const std::string& path, uint64_t key);
+	bool saveScene(const std::string& path, uint64_t key) const;
+
+	// Color averaging, developed through the film settings (0-255, parallel over tiles)
 	Eigen::Matrix<int, 3, Eigen::Dynamic> getAveragedColors() const;
+	void getAveragedColors(Eigen::Matrix<int, 3, Eigen::Dynamic>& colors) const; // Reuses colors' storage
+	// Film in a memory mapped file at path instead of RAM (empty goes back to RAM), so the image size is bounded by
+	// disk. Single buffered: passes accumulate in place, which is fine since every pixel keeps its own sample count,
+	// but a display reading mid-pass may see a pixel's new sum before its new count. Not while a render runs.
+	// False if the file can't be made, the film stays in RAM then
+	bool setFilmScratch(const std::string& path);
+	bool isFilmMapped() const { return accumulated_buffer_a.isMapped(); }
+	FilmSettings getFilm() const;
+	void setFilm(const FilmSettings& settings); // Re-resolves the display right away, no need to wait for the next pass
+
+	// Display path: with resolve on, every tile is developed straight into RGBA8 as soon as its pixels finish a pass
+	void setResolveDisplay(bool enabled) { resolveEnabled = enabled; }
+	void resolveDisplay();
+	uint64_t getDisplayVersion() const { return displayVersion.load(std::memory_order_acquire); }
+	// Copies the latest resolved image if it's newer than version (and has numTexels texels), then updates version
+	bool copyDisplayRGBA8(uint32_t* pixels, int numTexels, uint64_t& version) const;
+
+	// Streamed output (ImageWriter.h), developed through the film settings a span at a time so the image is never
+	// whole in memory. False if out doesn't match the image size or a write failed
+	bool writeImage(ImageStream& out) const; // The display image, row by row on the pool
+	// One tile. From the tile callback it writes the pass that just finished the tile, so a render can flush tiles
+	// as they complete and the file ends up holding the final image without a separate write
+	bool writeTile(ImageStream& out, const Tile& tile) const;
+
+	// Checkpoints, empty path turns them off. Set before rendering, like the tile callback
+	void setCheckpoint(const std::string& path, double intervalSeconds = 60.0);
+	// The next traceAll of view continues from the checkpoint at path instead of a black film, from its sample count up
+	// to the target (so raising the target adds samples to a finished render). Settings have to be set first, the seed,
+	// bounces, roulette depth and adaptive sampling on or off must match the checkpoint's along with scene and camera.
+	// False if there's no such checkpoint, the next render then starts from scratch
+	bool resumeFrom(const std::string& path, const RenderView& view);
+	int getResumeSamples() const { return resumeFile.isOpen() ? resumeState.samples : 0; } // Samples the pending resume starts from
+	uint64_t checkpointKey(const RenderView& view) const; // Everything a checkpoint's film depends on but its sample count
+
+	// Distributed rendering (Distributed.h): a worker renders a region view and ships its display buffer, the
+	// coordinator adds it into its own film at region's place (image imageWidth wide). Call resize first, disjoint
+	// regions can be merged concurrently. Sums start from zero on both sides, so the film matches a local render
+	const AccumulationBuffer& getDisplayBuffer() const { return *display_buffer.load(); }
+	void mergeRegion(int imageWidth, const Tile& region, const float* color, const int* samples);
 
 	// Getters
 	const Eigen::Array<int, 1, Eigen::Dynamic>& getRaySteps() const { return ray_steps; }
@@ -70,12 +287,66 @@ class RayTracer {
 	int getCurrentSampleCount() const { return currentSampleCount; }
 
 	int getNumRays() const { return N; }
+	int getBatchSize() const { return batchSize; }
+	int getRaySlots() const { return raySlots; }
+	size_t getRayStateBytes() const; // Ray buffers, queues and in flight counters, everything sized by the budget rather than the image
 	int getNumPixels() const { return numPixels; }
 	int getMaxSteps() const { return maxBounces; }
-	int getNumThreads() const { return NUM_THREADS; }
+	int getNumThreads() const { return (int)pool.size(); }
+	int getNumChunks() const { return (int)chunks.size(); }
+	const TileGrid& getTiles() const { return tiles; }
+	double getRaysPerSecond() const { return raysPerSecond; }
+	double getAvgNodesVisited() const { return avgNodesVisited; }
+	const TraceScene& getScene() const { return scene; }
+	const RenderStats& getLastRenderStats() const { return lastStats; }
+	void setVerbose(bool enabled) { verbose = enabled; }
+	void setUseBVH(bool enabled) { useBVH = enabled; }
+	void setWavefront(bool enabled) { wavefront = enabled; }
+	bool getWavefront() const { return wavefront; }
+	SimdLevel getSimdLevel() const { return simdLevel; }
+	int getNumActivePixels() const { return numActivePixels; }
+	float getAdaptiveThreshold() const { return adaptiveThreshold; }
+	void setAdaptiveThreshold(float threshold) { adaptiveThreshold = std::max(threshold, 0.0f); }
+	void setMinAdaptiveSamples(int samples) { minAdaptiveSamples = std::max(samples, 2); }
+	int getRouletteDepth() const { return rouletteDepth; }
+	void setRouletteDepth(int depth) { rouletteDepth = std::max(depth, 1); }
+	uint32_t getSeed() const { return seed; }
+	void setSeed(uint32_t newSeed) { seed = newSeed; }
+	void setSimdLevel(SimdLevel level) {
+		simdLevel = isSimdLevelSupported(level) ? level : bestSimdLevel();
+		scene.setSimdLevel(simdLevel);
+	}
 	int isTracing() const { return tracing; }
 
 	// Intersections
-	void intersectSphere(const Sphere&, int chunkIndex);
-	void intersectSquare(const Square&, int chunkIndex);
+	void intersectSphere(int sphereIndex, int chunkIndex);
+	void intersectTriangle(int triangleIndex, int chunkIndex);
+	void intersectSquare(int quadIndex, int chunkIndex);
+	void intersectPlane(int planeIndex, int chunkIndex);
+	void intersectBox(int boxIndex, int chunkIndex);
+
+  private:
+	void startJob(std::function<void(std::stop_token)> job);
+	void buildTiles(int width, int height); // Tile grid + ray slot order for the image, a no-op if nothing changed
+	void budgetShape(int& batch, int& slots) const; // batchSize and raySlots the budget allows for this image
+	void selectWindow(int firstTile); // As many whole tiles from firstTile on as the ray buffers hold (at least one)
+	long long traceWindow(const RenderView& view, int sample); // Every bounce of the pass for the current window, returns ray segments traced
+	int activeSlot(int k) const { return trackConvergence ? activeSlots[activeBegin + k] : windowBegin + k; } // k-th active slot of the window
+	int rayIndex(int slot, int sample) const { return sample * raySlots + slot - windowBegin; }
+	int raySlot(int ray) const { return windowBegin + ray % raySlots; }
+	int slotPixel(int slot) const { return window_pixel[slot - windowBegin]; } // Slots of the current window only
+	int samplerPixel(int pixel) const { // Full image index of a pixel, what the sampler is keyed by
+		return regionImageWidth == 0 ? pixel : (regionY + pixel / tiles.getWidth()) * regionImageWidth + regionX + pixel % tiles.getWidth();
+	}
+	AccumulationBuffer* secondBuffer() { return accumulated_buffer_a.isMapped() ? &accumulated_buffer_a : &accumulated_buffer_b; } // Other side of the double buffer
+	void finishRay(int ray); // Path is done, accumulates its pixel once every sample of the pass is
+	void finishTile(int tileIndex); // Every pixel of the tile is accumulated for this pass
+	void resolveTile(const Tile& tile); // Develops the tile from the pass's buffer into the front display image
+	void restoreCheckpoint(); // Film, sample count and adaptive state from resumeFile, after traceAll's resets
+	void writeCheckpoint(const RenderView& view, const AccumulationBuffer& accumulated) const;
+	bool stopRequested() const { return stopToken.stop_requested(); }
+
+	// intersect(origin, dir) returns the hit distance of primIndex, or infinity
+	template <typename IntersectFunc>
+	void intersectChunk(PrimType type, int primIndex, int chunkIndex, IntersectFunc&& intersect);
 };
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "Camera.h"
+#include "ImagePlane.h"
+#include "Transform.h"
+
+// Camera + film description the tracer renders from
+// Plain data so it can be built without a window (see pbr-render) and copied into a render thread
+struct RenderView {
+	Transform eye;    // Rays are aimed from here...
+	ImagePlane plane; // ...through this plane
+	int width{0};
+	int height{0};
+
+	// A region view renders just width x height pixels at (regionX, regionY) of a bigger image. Rays and sampler
+	// keys are the full image's, so a region comes out exactly like the same pixels of a full render
+	int regionX{0};
+	int regionY{0};
+	int fullWidth{0}; // 0 when the view is the whole image
+	int fullHeight{0};
+
+	int numPixels() const { return width * height; }
+	int imageWidth() const { return fullWidth > 0 ? fullWidth : width; }
+	int imageHeight() const { return fullHeight > 0 ? fullHeight : height; }
+	RenderView region(int x, int y, int regionWidth, int regionHeight) const; // x, y relative to this view
+
+	// Snapshot of the interactive camera (uses the saved camera while in ghost mode)
+	static RenderView fromCamera(const Camera& cam, int width, int height);
+
+	// Pinhole camera looking along yaw/pitch, image plane at the near plane
+	static RenderView lookFrom(const glm::vec3& position, float yaw, float pitch, float fov, int width, int height, float nearPlane = 0.1f);
+};
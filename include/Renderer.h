@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Camera.h"
+#include "EBO.h"
 #include "Ray.h"
 #include "RayTracer.h"
 #include "ShaderProgram.h"
@@ -45,7 +46,7 @@ class Renderer {
 
 	// Textures
 	GLuint imagePlaneTexture;
-	void updateTexture(const Eigen::Matrix<int, 3, Eigen::Dynamic>& colors_matrix);
+	void updateTexture(const RayTracer& tracer); // Uploads the tracer's resolved image, only when a new pass landed
 	void initializeImagePlaneTexture();
 
 	// Utility
@@ -85,10 +86,20 @@ class Renderer {
 	// Shape Buffers
 	std::vector<VBO*> shapeVBOs;
 	std::vector<VAO*> shapeVAOs;
+	std::vector<EBO*> shapeEBOs;      // Null for shapes that are a plain triangle soup
+	std::vector<GLsizei> shapeCounts; // Indices or vertices to draw
 
 	// Texture
 	GLuint textureID;
 
+	// Image plane uploads go through a ring of pixel buffers, glTexSubImage2D just queues the transfer
+	static constexpr int NUM_DISPLAY_PBOS = 3;
+	GLuint displayPBOs[NUM_DISPLAY_PBOS]{};
+	int displayPBOIndex{0};
+	int textureWidth{0};
+	int textureHeight{0};
+	uint64_t uploadedVersion{0}; // Tracer display version the texture shows
+
 	// Mouse state
 	bool isDragging;
 	double lastMouseX;
@@ -102,6 +113,7 @@ class Renderer {
 	void initializeShaders();
 	void initializeBuffers();
 	void initializeTexture();
+	void resizeImagePlaneTexture();
 	void setupRasterUniforms(const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection, const glm::vec4& color);
 	void clampImagePlanePan();
 	static Renderer* instance;
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+
+// Counter based random numbers: every value is a pure function of (seed, pixel, sample, bounce, dimension)
+// No generator state to create, share or advance, so any thread can draw any pixel's numbers and a given
+// seed renders the same image bit for bit no matter how the work was split
+
+// Which random number of a path vertex is being drawn
+enum SampleDimension : uint32_t {
+	DIM_PIXEL_X = 0, // Jitter inside the pixel (bounce 0 only)
+	DIM_PIXEL_Y = 1,
+	DIM_BOUNCE_U = 2, // Scatter direction
+	DIM_BOUNCE_V = 3,
+	DIM_ROULETTE = 4, // Russian roulette survival
+};
+
+// PCG output permutation on a single LCG step (Jarzynski & Olano, "Hash Functions for GPU Rendering")
+inline uint32_t pcgHash(uint32_t v) {
+	uint32_t state = v * 747796405u + 2891336453u;
+	uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+inline uint32_t sampleHash(uint32_t seed, uint32_t pixel, uint32_t sample, uint32_t bounce, uint32_t dimension) {
+	uint32_t h = pcgHash(seed ^ pcgHash(pixel));
+	h = pcgHash(h ^ sample);
+	return pcgHash(h ^ ((bounce << 8u) | dimension));
+}
+
+// Uniform in [0, 1), top 24 bits so every value is exactly representable
+inline float sampleFloat(uint32_t seed, uint32_t pixel, uint32_t sample, uint32_t bounce, uint32_t dimension) {
+	return (float)(sampleHash(seed, pixel, sample, bounce, dimension) >> 8u) * (1.0f / 16777216.0f);
+}
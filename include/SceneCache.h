@@ -0,0 +1,42 @@
+#pragma once
+
+#include "TraceScene.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+
+// Binary snapshot of a built TraceScene: the flattened primitives, the shared vertex buffer and every BVH,
+// already in leaf order. Each array is stored 64 byte aligned in its in-memory layout, so loading is a mmap
+// plus one straight copy per array, no parsing and no BVH builds. Files are host endian and only valid for
+// builds with the same struct layouts (checked on load)
+
+constexpr uint32_t SCENE_CACHE_VERSION = 1; // Bump when the file layout changes
+
+// Identifies what a scene was built from (FNV-1a over everything added). A cache is only used when its key
+// matches, so anything that changes the built scene has to go into the key
+class SceneCacheKey {
+  public:
+	void add(const void* data, size_t size);
+	void add(const std::string& text);
+
+	template <typename T>
+	    requires std::is_arithmetic_v<T> || std::is_enum_v<T>
+	void add(T value) {
+		add(&value, sizeof(T));
+	}
+
+	// Path, size and modification time, so editing the file makes the cache stale. Missing files add just the path
+	void addFile(const std::string& path);
+
+	uint64_t value() const { return hash; }
+
+  private:
+	uint64_t hash{14695981039346656037ull};
+};
+
+// Written to a temporary next to path and renamed over it, readers never see half a file
+bool saveSceneCache(const std::string& path, const TraceScene& scene, uint64_t key);
+
+// Returns false (scene left empty) if the cache is missing, stale, from another layout or malformed
+bool loadSceneCache(const std::string& path, TraceScene& scene, uint64_t key);
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "Shape.h"
+#include <vector>
+
+// Scenes shared by the viewer and the headless tools. Shapes are heap allocated, free with destroyScene
+
+// Part of every scene cache key, bump it when a scene below changes so old caches get rebuilt
+constexpr int SCENE_REVISION = 1;
+
+void buildDefaultScene(std::vector<Shape*>& worldObjects);
+
+// count diffuse spheres scattered in front of the default camera, spread out so density stays
+// roughly constant as count grows. Same seed, same scene
+void buildRandomSphereScene(std::vector<Shape*>& worldObjects, int count, unsigned seed = 1);
+
+void destroyScene(std::vector<Shape*>& worldObjects);
@@ -2,13 +2,14 @@
 #include "Material.h"
 #include "Ray.h"
 #include <glm/glm.hpp>
+#include <cstdint>
 #include <glm/gtc/matrix_transform.hpp>
 #include <vector>
 
 class Shape {
   protected:
 	std::vector<float> vertices;
-	Material material;
+	Material material{Material::NORMAL};
 
   public:
 	glm::vec3 position{0.0f, 0.0f, 0.0f};
@@ -16,6 +17,7 @@ class Shape {
 	virtual ~Shape() = default;
 
 	virtual std::vector<float> getVertices() const = 0;
+	virtual const std::vector<uint32_t>* getIndices() const { return nullptr; } // Null means getVertices() is a triangle soup
 	virtual Material getMaterial() const { return material; };
 
 	glm::mat4 getModelMatrix() const;
@@ -3,6 +3,8 @@
 
 class Square : public Shape {
   public:
+	glm::vec3 p0, p1, p2; // Corner and its two neighbours (4th corner is p1 + p2 - p0)
+
 	Square(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2);
 
 	std::vector<float> getVertices() const override;
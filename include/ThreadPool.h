@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Long-lived worker pool so we don't pay for thread creation on every bounce.
+// Every worker owns a deque: it pops from the front of its own and steals from the back of the others.
+class ThreadPool {
+  public:
+	using Task = std::function<void()>;
+
+	explicit ThreadPool(unsigned int numThreads = std::thread::hardware_concurrency());
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	void submit(Task task);
+
+	// Splits [begin, end) into ranges of at most `grain` and blocks until all of them ran
+	// The calling thread helps out instead of just waiting
+	void parallelFor(int begin, int end, int grain, const std::function<void(int, int)>& func);
+
+	unsigned int size() const { return (unsigned int)workers.size(); }
+
+  private:
+	struct WorkerQueue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	std::vector<std::unique_ptr<WorkerQueue>> queues;
+	std::vector<std::thread> workers;
+
+	std::mutex sleepMutex;
+	std::condition_variable wake;
+	std::atomic<int> pending{0};
+	std::atomic<bool> stopping{false};
+	std::atomic<unsigned int> nextQueue{0};
+
+	void workerLoop(int index);
+	bool tryRunTask(int index);
+	bool popLocal(int index, Task& task);
+	bool steal(int thief, Task& task);
+	int currentWorkerIndex() const;
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Screen space tiles the tracer schedules its work by. Pixels are queued tile by tile, so every chunk of the
+// ray queue covers a compact 2D patch (coherent rays, one hot spot spread over many small tasks) and a tile's
+// pixels all finish at about the same time, which lets the display show it as soon as it's done
+
+struct Tile {
+	int x;
+	int y;
+	int width;
+	int height;
+
+	int numPixels() const { return width * height; }
+};
+
+// Order tiles are handed out in
+enum class TileOrder {
+	Morton,   // Z curve, neighbouring tiles stay close in the queue
+	Spiral,   // From the center out, the interesting part of the frame usually shows first
+	Scanline, // Row by row
+};
+
+const char* tileOrderName(TileOrder order);
+bool parseTileOrder(const std::string& name, TileOrder& order); // False if the name isn't one of tileOrderName()'s
+
+class TileGrid {
+  public:
+	// Rebuilds only when something changed
+	void build(int width, int height, int tileSize = 32, TileOrder order = TileOrder::Morton);
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	int getTileSize() const { return tileSize; }
+	TileOrder getOrder() const { return order; }
+
+	int numTiles() const { return (int)tiles.size(); }
+	const Tile& tile(int index) const { return tiles[index]; }             // Index in schedule order
+	// Slots number every pixel tile after tile, row major inside a tile, so a tile's pixels are a contiguous run
+	// Nothing here is per pixel, pixelAt() searches the tiles (hot loops keep their own table for the slots they use)
+	int pixelAt(int slot) const;
+	int tileSlot(int index) const { return slotStart[index]; } // First slot of the tile, tileSlot(numTiles()) is the pixel count
+	int tileOf(int pixel) const { return gridTile[(pixel / width / tileSize) * tilesX + (pixel % width) / tileSize]; }
+
+  private:
+	int width{0};
+	int height{0};
+	int tileSize{0};
+	TileOrder order{TileOrder::Morton};
+
+	int tilesX{0};
+
+	std::vector<Tile> tiles;
+	std::vector<int> slotStart;
+	std::vector<int> gridTile; // Schedule index of the tile at each grid position, per tile so it stays small
+};
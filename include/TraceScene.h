@@ -0,0 +1,52 @@
+#pragma once
+
+#include "BVH.h"
+#include "PacketKernels.h"
+#include "Primitives.h"
+#include "Shape.h"
+#include <vector>
+
+// The scene as the tracer sees it: flattened once at render start into contiguous per-type
+// arrays, each sorted into the leaf order of its own BVH. The Shape hierarchy stays the editing/visualization side
+class TraceScene {
+  public:
+	std::vector<SpherePrim> spheres;
+	std::vector<TrianglePrim> triangles; // Index into positions
+	std::vector<float> positions;        // xyz per vertex, shared by every triangle (meshes keep their sharing)
+	std::vector<QuadPrim> quads;
+	std::vector<BoxPrim> boxes;
+	std::vector<PlanePrim> planes; // Unbounded, every ray tests all of them (scenes only have a few)
+
+	SphereSoA sphereSoA; // Same spheres again for the packet kernels
+
+	BVH sphereBVH;
+	BVH triangleBVH;
+	BVH quadBVH;
+	BVH boxBVH;
+
+	void build(const std::vector<Shape*>& worldObjects);
+	void clear();
+
+	void setSimdLevel(SimdLevel level) { simdLevel = level; } // Kernel for the triangle leaves
+	int numVertices() const { return (int)(positions.size() / 3); }
+	int numPrims() const { return (int)(spheres.size() + triangles.size() + quads.size() + boxes.size() + planes.size()); }
+
+	// Closest hit over every type (optionally skipping spheres when a packet kernel already did them)
+	// Returns num of BVH nodes visited
+	int intersect(const Eigen::Vector3f& origin, const Eigen::Vector3f& dir, float& tClosest, PrimType& hitType, int& hitIndex, bool includeSpheres = true) const;
+
+	// Single triangle, for brute force references
+	float intersectTriangle(int index, const Eigen::Vector3f& origin, const Eigen::Vector3f& dir) const;
+
+	// Unit normal facing the incoming ray, plus the material at a hit
+	void surfaceAt(PrimType type, int index, const Eigen::Vector3f& point, const Eigen::Vector3f& dir, Eigen::Vector3f& normal, Material& material) const;
+
+	void printStats() const;
+
+  private:
+	SimdLevel simdLevel{bestSimdLevel()};
+
+	void buildBVHs();
+	int addVertex(const Eigen::Vector3f& p);
+	AABB triangleBounds(const TrianglePrim& tri) const;
+};
@@ -0,0 +1,168 @@
+#include "BVH.h"
+#include <chrono>
+#include <numeric>
+
+void BVH::clear() {
+	nodes.clear();
+	primIndices.clear();
+	stats = BuildStats{};
+}
+
+void BVH::assign(std::vector<BVHNode> builtNodes, const BuildStats& builtStats) {
+	nodes = std::move(builtNodes);
+	stats = builtStats;
+
+	int numPrims = 0;
+	for (const BVHNode& node : nodes)
+		numPrims += node.count;
+
+	// Prims already sit in leaf order, so the mapping is the identity
+	primIndices.resize(numPrims);
+	std::iota(primIndices.begin(), primIndices.end(), 0);
+}
+
+void BVH::build(const std::vector<AABB>& primBounds) {
+	auto start = std::chrono::steady_clock::now();
+	clear();
+
+	int numPrims = (int)primBounds.size();
+	if (numPrims == 0)
+		return;
+
+	primIndices.resize(numPrims);
+	std::iota(primIndices.begin(), primIndices.end(), 0);
+
+	std::vector<Eigen::Vector3f> centroids(numPrims);
+	for (int i = 0; i < numPrims; i++) {
+		centroids[i] = primBounds[i].centroid();
+	}
+
+	// A binary tree never has more than 2n - 1 nodes
+	nodes.reserve(2 * numPrims - 1);
+
+	BVHNode root;
+	root.leftOrFirst = 0;
+	root.count = numPrims;
+	for (const AABB& b : primBounds)
+		root.bounds.grow(b);
+	nodes.push_back(root);
+
+	subdivide(0, 0, primBounds, centroids);
+
+	// SAH cost of the finished tree (relative to the root, traversal and intersection cost of 1)
+	float rootArea = nodes[0].bounds.surfaceArea();
+	for (const BVHNode& node : nodes) {
+		float relArea = rootArea > 0.0f ? node.bounds.surfaceArea() / rootArea : 1.0f;
+		stats.sahCost += relArea * (node.isLeaf() ? (float)node.count : 1.0f);
+		if (node.isLeaf()) {
+			stats.leafCount++;
+			stats.maxLeafSize = std::max(stats.maxLeafSize, node.count);
+		}
+	}
+	stats.nodeCount = (int)nodes.size();
+	stats.buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void BVH::subdivide(int nodeIndex, int depth, const std::vector<AABB>& primBounds, const std::vector<Eigen::Vector3f>& centroids) {
+	stats.maxDepth = std::max(stats.maxDepth, depth);
+
+	int first = nodes[nodeIndex].leftOrFirst;
+	int count = nodes[nodeIndex].count;
+	if (count <= 1 || depth >= MAX_DEPTH)
+		return;
+
+	// Bin along the centroid bounds, not the node bounds (big prims would squash everything into one bin)
+	AABB centroidBounds;
+	for (int i = first; i < first + count; i++)
+		centroidBounds.grow(centroids[primIndices[i]]);
+
+	struct Bin {
+		AABB bounds;
+		int count{0};
+	};
+
+	float bestCost = std::numeric_limits<float>::infinity();
+	int bestAxis = -1;
+	int bestSplit = -1;
+
+	for (int axis = 0; axis < 3; axis++) {
+		float axisMin = centroidBounds.min[axis];
+		float axisMax = centroidBounds.max[axis];
+		if (axisMax <= axisMin)
+			continue;
+
+		Bin bins[NUM_BINS];
+		float scale = (float)NUM_BINS / (axisMax - axisMin);
+		for (int i = first; i < first + count; i++) {
+			int prim = primIndices[i];
+			int b = std::min(NUM_BINS - 1, (int)((centroids[prim][axis] - axisMin) * scale));
+			bins[b].count++;
+			bins[b].bounds.grow(primBounds[prim]);
+		}
+
+		// Sweep from both sides so each split plane costs O(1)
+		float leftArea[NUM_BINS - 1], rightArea[NUM_BINS - 1];
+		int leftCount[NUM_BINS - 1], rightCount[NUM_BINS - 1];
+		AABB leftBox, rightBox;
+		int leftSum = 0, rightSum = 0;
+		for (int i = 0; i < NUM_BINS - 1; i++) {
+			leftSum += bins[i].count;
+			leftCount[i] = leftSum;
+			leftBox.grow(bins[i].bounds);
+			leftArea[i] = leftBox.surfaceArea();
+
+			rightSum += bins[NUM_BINS - 1 - i].count;
+			rightCount[NUM_BINS - 2 - i] = rightSum;
+			rightBox.grow(bins[NUM_BINS - 1 - i].bounds);
+			rightArea[NUM_BINS - 2 - i] = rightBox.surfaceArea();
+		}
+
+		for (int i = 0; i < NUM_BINS - 1; i++) {
+			if (leftCount[i] == 0 || rightCount[i] == 0)
+				continue;
+			float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = i;
+			}
+		}
+	}
+
+	// Every centroid in the same spot, nothing left to split on
+	if (bestAxis < 0)
+		return;
+
+	// Compare against just intersecting everything (traversal cost of 1 per child visit)
+	float parentArea = nodes[nodeIndex].bounds.surfaceArea();
+	float splitCost = 1.0f + (parentArea > 0.0f ? bestCost / parentArea : 0.0f);
+	if (count <= MAX_LEAF_SIZE && splitCost >= (float)count)
+		return;
+
+	float axisMin = centroidBounds.min[bestAxis];
+	float scale = (float)NUM_BINS / (centroidBounds.max[bestAxis] - axisMin);
+	int* mid = std::partition(primIndices.data() + first, primIndices.data() + first + count, [&](int prim) {
+		int b = std::min(NUM_BINS - 1, (int)((centroids[prim][bestAxis] - axisMin) * scale));
+		return b <= bestSplit;
+	});
+	int leftCount = (int)(mid - (primIndices.data() + first));
+
+	int leftIndex = (int)nodes.size();
+	BVHNode left, right;
+	left.leftOrFirst = first;
+	left.count = leftCount;
+	right.leftOrFirst = first + leftCount;
+	right.count = count - leftCount;
+	for (int i = left.leftOrFirst; i < left.leftOrFirst + left.count; i++)
+		left.bounds.grow(primBounds[primIndices[i]]);
+	for (int i = right.leftOrFirst; i < right.leftOrFirst + right.count; i++)
+		right.bounds.grow(primBounds[primIndices[i]]);
+
+	nodes.push_back(left);
+	nodes.push_back(right);
+	nodes[nodeIndex].leftOrFirst = leftIndex;
+	nodes[nodeIndex].count = 0;
+
+	subdivide(leftIndex, depth + 1, primBounds, centroids);
+	subdivide(leftIndex + 1, depth + 1, primBounds, centroids);
+}
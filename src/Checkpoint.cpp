@@ -0,0 +1,137 @@
+#include "Checkpoint.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <unistd.h>
+
+namespace {
+
+constexpr char MAGIC[8] = {'P', 'B', 'R', 'C', 'K', 'P', 'T', '\0'};
+constexpr uint32_t BYTE_ORDER_MARK = 0x01020304; // Reads back swapped on a machine of the other endianness
+
+// Arrays follow in CheckpointArrays order, packed (every element is 4 bytes but the trailing flags)
+struct FileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint64_t key;
+	int32_t width;
+	int32_t height;
+	int32_t samples;
+	uint32_t adaptive;
+};
+
+size_t payloadBytes(const CheckpointState& state) {
+	size_t n = (size_t)state.width * (size_t)state.height;
+	size_t perPixel = 3 * sizeof(float) + sizeof(int);
+	if (state.adaptive)
+		perPixel += sizeof(float) + sizeof(uint8_t);
+	return n * perPixel;
+}
+
+bool writeAll(int fd, const void* data, size_t size) {
+	const char* bytes = static_cast<const char*>(data);
+	while (size > 0) {
+		ssize_t written = write(fd, bytes, size);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return false;
+		bytes += written;
+		size -= (size_t)written;
+	}
+	return true;
+}
+
+// The rename itself only survives a crash once the directory entry is on disk
+void syncDirectory(const std::string& path) {
+	std::filesystem::path parent = std::filesystem::path(path).parent_path();
+	int fd = ::open(parent.empty() ? "." : parent.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+}
+
+} // namespace
+
+bool saveCheckpoint(const std::string& path, const CheckpointState& state, const CheckpointArrays& arrays) {
+	FileHeader header{};
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = CHECKPOINT_VERSION;
+	header.byteOrder = BYTE_ORDER_MARK;
+	header.key = state.key;
+	header.width = state.width;
+	header.height = state.height;
+	header.samples = state.samples;
+	header.adaptive = state.adaptive ? 1 : 0;
+
+	size_t n = (size_t)state.width * (size_t)state.height;
+	std::string tempPath = path + ".tmp";
+	int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		std::cerr << "Failed to write checkpoint " << tempPath << ": " << std::strerror(errno) << std::endl;
+		return false;
+	}
+
+	bool written = writeAll(fd, &header, sizeof(header)) && writeAll(fd, arrays.color, 3 * n * sizeof(float)) && writeAll(fd, arrays.samples, n * sizeof(int));
+	if (state.adaptive)
+		written = written && writeAll(fd, arrays.luminanceSq, n * sizeof(float)) && writeAll(fd, arrays.converged, n * sizeof(uint8_t));
+	// On disk before it's renamed in, or a crash could leave a complete looking name over missing data
+	written = written && fsync(fd) == 0;
+	written = close(fd) == 0 && written;
+
+	if (!written || std::rename(tempPath.c_str(), path.c_str()) != 0) {
+		std::cerr << "Failed to write checkpoint " << path << ": " << std::strerror(errno) << std::endl;
+		std::remove(tempPath.c_str());
+		return false;
+	}
+	syncDirectory(path);
+	return true;
+}
+
+bool loadCheckpoint(const std::string& path, uint64_t key, MappedFile& file, CheckpointState& state, CheckpointArrays& arrays) {
+	if (!file.open(path))
+		return false;
+
+	FileHeader header;
+	if (file.size() < sizeof(header)) {
+		std::cerr << "Checkpoint " << path << " is truncated" << std::endl;
+		return false;
+	}
+	std::memcpy(&header, file.data(), sizeof(header));
+
+	if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != CHECKPOINT_VERSION || header.byteOrder != BYTE_ORDER_MARK) {
+		std::cerr << "Checkpoint " << path << " is from another version" << std::endl;
+		return false;
+	}
+	if (header.key != key) {
+		std::cerr << "Checkpoint " << path << " is of another scene, camera or sampler setup" << std::endl;
+		return false;
+	}
+
+	state.key = header.key;
+	state.width = header.width;
+	state.height = header.height;
+	state.samples = header.samples;
+	state.adaptive = header.adaptive != 0;
+	if (state.width <= 0 || state.height <= 0 || state.samples < 0 || file.size() != sizeof(header) + payloadBytes(state)) {
+		std::cerr << "Checkpoint " << path << " is malformed" << std::endl;
+		return false;
+	}
+
+	size_t n = (size_t)state.width * (size_t)state.height;
+	const char* bytes = file.data() + sizeof(header);
+	arrays = CheckpointArrays{};
+	arrays.color = reinterpret_cast<const float*>(bytes);
+	arrays.samples = reinterpret_cast<const int*>(bytes + 3 * n * sizeof(float));
+	if (state.adaptive) {
+		size_t luminanceOffset = 3 * n * sizeof(float) + n * sizeof(int);
+		arrays.luminanceSq = reinterpret_cast<const float*>(bytes + luminanceOffset);
+		arrays.converged = reinterpret_cast<const uint8_t*>(bytes + luminanceOffset + n * sizeof(float));
+	}
+	return true;
+}
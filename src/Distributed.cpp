@@ -0,0 +1,423 @@
+#include "Distributed.h"
+#include "Profiler.h"
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <initializer_list>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+constexpr uint32_t MESSAGE_MAGIC = 0x44524250; // "PBRD"
+constexpr uint64_t MAX_SCENE_BYTES = 8ull << 30; // Past this a Setup message is taken for garbage
+
+enum class MessageType : uint32_t {
+	Setup,  // Coordinator -> worker: DistributedJob, then the scene cache bytes
+	Render, // Coordinator -> worker: the Tile to render
+	Result, // Worker -> coordinator: the Tile, its 3 floats of summed color per pixel, then its int sample counts
+	Done,   // Coordinator -> worker: no tiles left, disconnect
+};
+
+struct MessageHeader {
+	uint32_t magic;
+	uint32_t version;
+	MessageType type;
+	uint32_t padding;
+	uint64_t size; // Payload bytes after the header
+};
+
+struct Span {
+	const void* data;
+	size_t size;
+};
+
+bool sendAll(int fd, const void* data, size_t size) {
+	const char* bytes = static_cast<const char*>(data);
+	while (size > 0) {
+		ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL); // A dead peer is an error here, not a SIGPIPE
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return false;
+		bytes += sent;
+		size -= (size_t)sent;
+	}
+	return true;
+}
+
+// False on errors, on the peer closing and on the receive timeout running out
+bool recvAll(int fd, void* data, size_t size) {
+	char* bytes = static_cast<char*>(data);
+	while (size > 0) {
+		ssize_t received = recv(fd, bytes, size, 0);
+		if (received < 0 && errno == EINTR)
+			continue;
+		if (received <= 0)
+			return false;
+		bytes += received;
+		size -= (size_t)received;
+	}
+	return true;
+}
+
+bool sendMessage(int fd, MessageType type, std::initializer_list<Span> payload) {
+	MessageHeader header{MESSAGE_MAGIC, DISTRIBUTED_VERSION, type, 0, 0};
+	for (const Span& span : payload)
+		header.size += span.size;
+
+	if (!sendAll(fd, &header, sizeof(header)))
+		return false;
+	for (const Span& span : payload)
+		if (!sendAll(fd, span.data, span.size))
+			return false;
+	return true;
+}
+
+bool recvHeader(int fd, MessageHeader& header) {
+	if (!recvAll(fd, &header, sizeof(header)))
+		return false;
+	if (header.magic != MESSAGE_MAGIC || header.version != DISTRIBUTED_VERSION) {
+		std::cerr << "Peer speaks another protocol (or is another build)" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void setNoDelay(int fd) {
+	// Tile messages are tiny and answered right away, don't let Nagle sit on them
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+// Scenes travel as scene cache files, so a worker loads exactly what the coordinator built
+std::filesystem::path scratchScenePath(const char* role) {
+	return std::filesystem::temp_directory_path() / ("pbr-" + std::string(role) + "-" + std::to_string(getpid()) + ".scene");
+}
+
+bool serializeScene(const RayTracer& tracer, uint64_t key, std::vector<char>& bytes) {
+	std::filesystem::path path = scratchScenePath("coordinator");
+	bool saved = tracer.saveScene(path.string(), key);
+	if (saved) {
+		std::ifstream file(path, std::ios::binary);
+		bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		saved = !file.bad();
+	}
+	std::error_code ignored;
+	std::filesystem::remove(path, ignored);
+	return saved;
+}
+
+bool deserializeScene(RayTracer& tracer, uint64_t key, const std::vector<char>& bytes) {
+	std::filesystem::path path = scratchScenePath("worker");
+	bool written;
+	{
+		std::ofstream file(path, std::ios::binary | std::ios::trunc);
+		file.write(bytes.data(), (std::streamsize)bytes.size());
+		written = file.good();
+	}
+	bool loaded = written && tracer.loadScene(path.string(), key);
+	std::error_code ignored;
+	std::filesystem::remove(path, ignored);
+	return loaded;
+}
+
+// Tiles not merged yet. A failed worker's tile goes back to the front, so it's the next one handed out
+class TileQueue {
+  public:
+	explicit TileQueue(int numTiles) : remaining(numTiles) {
+		for (int i = 0; i < numTiles; i++)
+			pending.push_back(i);
+	}
+
+	// Next tile to render, -1 once every tile is merged. Waits while the ones left are out with other workers
+	int take() {
+		std::unique_lock<std::mutex> lock(mutex);
+		ready.wait(lock, [&] { return !pending.empty() || remaining == 0; });
+		if (remaining == 0)
+			return -1;
+		int index = pending.front();
+		pending.pop_front();
+		return index;
+	}
+
+	void giveBack(int index) {
+		std::lock_guard<std::mutex> lock(mutex);
+		pending.push_front(index);
+		ready.notify_one();
+	}
+
+	void finish() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--remaining == 0)
+			ready.notify_all();
+	}
+
+	bool done() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return remaining == 0;
+	}
+
+  private:
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::deque<int> pending;
+	int remaining;
+};
+
+// Settings a worker sizes its buffers by, in range (a tile's rays have to fit the int ray budget)
+bool validJob(const DistributedJob& job) {
+	return job.view.width > 0 && job.view.height > 0 && job.samples > 0 && job.bounces > 0 && job.samplesPerPass > 0 && job.tileSize > 0 &&
+	       (long long)job.tileSize * job.tileSize * job.samplesPerPass <= std::numeric_limits<int>::max();
+}
+
+// Tiles come from the job's grid, anything else would size the worker's film by whatever the message said
+bool validTile(const DistributedJob& job, const Tile& tile) {
+	return tile.x >= 0 && tile.y >= 0 && tile.width > 0 && tile.height > 0 && tile.width <= job.tileSize && tile.height <= job.tileSize &&
+	       tile.x + tile.width <= job.view.width && tile.y + tile.height <= job.view.height;
+}
+
+// Result payload for tile, checked against the tile it was sent
+bool recvResult(int fd, const Tile& tile, std::vector<float>& color, std::vector<int>& samples) {
+	MessageHeader header;
+	Tile returned;
+	size_t n = (size_t)tile.numPixels();
+	if (!recvHeader(fd, header) || header.type != MessageType::Result || header.size != sizeof(Tile) + n * (3 * sizeof(float) + sizeof(int)))
+		return false;
+	if (!recvAll(fd, &returned, sizeof(returned)) || returned.x != tile.x || returned.y != tile.y || returned.width != tile.width || returned.height != tile.height)
+		return false;
+
+	color.resize(3 * n);
+	samples.resize(n);
+	return recvAll(fd, color.data(), color.size() * sizeof(float)) && recvAll(fd, samples.data(), samples.size() * sizeof(int));
+}
+
+int connectTo(const std::string& host, int port) {
+	addrinfo hints{};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	// The coordinator may still be starting up
+	auto giveUp = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	do {
+		addrinfo* addresses = nullptr;
+		if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) == 0) {
+			for (addrinfo* address = addresses; address; address = address->ai_next) {
+				int fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+				if (fd < 0)
+					continue;
+				if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+					freeaddrinfo(addresses);
+					return fd;
+				}
+				close(fd);
+			}
+			freeaddrinfo(addresses);
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	} while (std::chrono::steady_clock::now() < giveUp);
+	return -1;
+}
+
+} // namespace
+
+int listenOn(int& port, bool loopbackOnly) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	sockaddr_in address{};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(loopbackOnly ? INADDR_LOOPBACK : INADDR_ANY);
+	address.sin_port = htons((uint16_t)port);
+	socklen_t length = sizeof(address);
+	if (bind(fd, reinterpret_cast<sockaddr*>(&address), length) != 0 || listen(fd, SOMAXCONN) != 0 ||
+	    getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	port = ntohs(address.sin_port);
+	return fd;
+}
+
+bool runCoordinator(int listenFd, const DistributedJob& job, RayTracer& tracer, double tileTimeout, CoordinatorStats& stats,
+                    const std::function<void(const Tile&)>& onTileMerged) {
+	PROFILE_ZONE("runCoordinator");
+
+	std::vector<char> scene;
+	if (!serializeScene(tracer, job.sceneKey, scene)) {
+		std::cerr << "Failed to serialize the scene for workers" << std::endl;
+		return false;
+	}
+
+	// Workers' results get added into a zeroed film. Workers pass in the batches a local render would
+	const RenderView& view = job.view;
+	tracer.resize(view.numPixels());
+	DistributedJob sent = job;
+	sent.samplesPerPass = tracer.getBatchSize();
+
+	TileGrid grid;
+	grid.build(view.width, view.height, job.tileSize, job.tileOrder);
+	TileQueue queue(grid.numTiles());
+
+	std::atomic<int> liveWorkers{0};
+	std::atomic<int> mergedTiles{0};
+	std::atomic<int> redispatched{0};
+	int workers = 0;
+
+	timeval timeout{};
+	timeout.tv_sec = (time_t)tileTimeout;
+	timeout.tv_usec = (suseconds_t)((tileTimeout - (double)timeout.tv_sec) * 1e6);
+
+	// One thread per connection, it hands its worker a tile at a time and merges what comes back
+	auto serve = [&](int fd, int worker) {
+		setNoDelay(fd);
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+		std::vector<float> color;
+		std::vector<int> samples;
+		if (sendMessage(fd, MessageType::Setup, {{&sent, sizeof(sent)}, {scene.data(), scene.size()}})) {
+			for (int index = queue.take(); index >= 0; index = queue.take()) {
+				const Tile& tile = grid.tile(index);
+				if (!sendMessage(fd, MessageType::Render, {{&tile, sizeof(tile)}}) || !recvResult(fd, tile, color, samples)) {
+					std::cerr << "Worker " << worker << " failed on tile " << index << ", handing it out again" << std::endl;
+					queue.giveBack(index);
+					redispatched++;
+					break;
+				}
+
+				tracer.mergeRegion(view.width, tile, color.data(), samples.data());
+				if (onTileMerged)
+					onTileMerged(tile);
+				mergedTiles++;
+				queue.finish();
+			}
+		}
+
+		// Only reached with tiles left if this worker failed, then there's nothing to tell it
+		if (queue.done())
+			sendMessage(fd, MessageType::Done, {});
+		close(fd);
+		liveWorkers--;
+	};
+
+	std::vector<std::thread> connections;
+	bool idle = false;
+	auto lastLive = std::chrono::steady_clock::now();
+	while (!queue.done()) {
+		pollfd incoming{listenFd, POLLIN, 0};
+		if (poll(&incoming, 1, 100) > 0) {
+			int fd = accept(listenFd, nullptr, nullptr);
+			if (fd >= 0) {
+				liveWorkers++;
+				connections.emplace_back(serve, fd, workers++);
+			}
+		}
+
+		// Every worker gone and none coming back, nobody is going to finish the tiles left
+		auto now = std::chrono::steady_clock::now();
+		if (liveWorkers > 0) {
+			lastLive = now;
+		} else if (std::chrono::duration<double>(now - lastLive).count() > tileTimeout) {
+			std::cerr << "No workers for " << tileTimeout << " s with " << grid.numTiles() - mergedTiles << " tiles left" << std::endl;
+			idle = true;
+			break;
+		}
+	}
+
+	for (std::thread& connection : connections)
+		connection.join();
+
+	stats.workers = workers;
+	stats.tiles = mergedTiles;
+	stats.redispatched = redispatched;
+	return !idle;
+}
+
+bool runWorker(const std::string& host, int port) {
+	int fd = connectTo(host, port);
+	if (fd < 0) {
+		std::cerr << "Failed to connect to " << host << ":" << port << std::endl;
+		return false;
+	}
+	setNoDelay(fd);
+
+	MessageHeader header;
+	DistributedJob job;
+	std::vector<char> scene;
+	// The size comes off the network, it's checked before anything is allocated by it
+	bool setup = recvHeader(fd, header) && header.type == MessageType::Setup && header.size >= sizeof(job) &&
+	             header.size - sizeof(job) <= MAX_SCENE_BYTES && recvAll(fd, &job, sizeof(job)) && validJob(job);
+	if (setup) {
+		scene.resize(header.size - sizeof(job));
+		setup = recvAll(fd, scene.data(), scene.size());
+	}
+	if (!setup) {
+		std::cerr << "Didn't get a job from " << host << ":" << port << std::endl;
+		close(fd);
+		return false;
+	}
+
+	RayTracer tracer(0, job.bounces, job.samples);
+	tracer.setVerbose(false);
+	tracer.setSeed(job.seed);
+	tracer.setRouletteDepth(job.rouletteDepth);
+	tracer.setAdaptiveThreshold(job.adaptiveThreshold);
+	tracer.setMinAdaptiveSamples(job.minAdaptiveSamples);
+	tracer.setTileSize(job.tileSize);
+	tracer.setTileOrder(job.tileOrder);
+	// Passes have to match the coordinator's for adaptive sampling to stop pixels at the same samples
+	tracer.setSamplesPerPass(job.samplesPerPass);
+	tracer.setRayBudget(std::max(1 << 21, job.tileSize * job.tileSize * job.samplesPerPass));
+
+	if (!deserializeScene(tracer, job.sceneKey, scene)) {
+		std::cerr << "Failed to load the coordinator's scene" << std::endl;
+		close(fd);
+		return false;
+	}
+	scene = {};
+
+	int rendered = 0;
+	while (recvHeader(fd, header)) {
+		if (header.type == MessageType::Done) {
+			std::cout << "Worker rendered " << rendered << " tiles" << std::endl;
+			close(fd);
+			return true;
+		}
+
+		Tile tile;
+		if (header.type != MessageType::Render || header.size != sizeof(tile) || !recvAll(fd, &tile, sizeof(tile)) || !validTile(job, tile))
+			break;
+
+		PROFILE_ZONE("renderTile");
+		tracer.traceAll(job.view.region(tile.x, tile.y, tile.width, tile.height));
+
+		const AccumulationBuffer& film = tracer.getDisplayBuffer();
+		size_t n = (size_t)tile.numPixels();
+		if (!sendMessage(fd, MessageType::Result, {{&tile, sizeof(tile)}, {film.color.data(), 3 * n * sizeof(float)}, {film.samples.data(), n * sizeof(int)}}))
+			break;
+		rendered++;
+	}
+
+	std::cerr << "Lost the coordinator after " << rendered << " tiles" << std::endl;
+	close(fd);
+	return false;
+}
@@ -0,0 +1,22 @@
+#include "EBO.h"
+#include <iostream>
+
+using std::cout, std::endl;
+
+EBO::EBO(const std::vector<uint32_t>* indices) {
+	glGenBuffers(1, &m_id);
+	if (m_id == 0) {
+		cout << "Failed to generate Element Buffer Object" << endl;
+		return;
+	}
+	bind();
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices->size() * sizeof(uint32_t), indices->data(), GL_STATIC_DRAW);
+}
+
+EBO::~EBO() { glDeleteBuffers(1, &m_id); }
+
+void EBO::bind() { glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_id); }
+
+void EBO::unbind() { glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0); }
+
+GLuint EBO::id() { return m_id; }
@@ -0,0 +1,195 @@
+#include "Film.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Encoded value of every quantized linear value in [0, 1], fine enough to stay within a code of the exact
+// curve where sRGB is steepest (near black)
+constexpr int LUT_BITS = 14;
+constexpr int LUT_SIZE = 1 << LUT_BITS;
+using EncodeLUT = std::array<uint8_t, LUT_SIZE>;
+
+EncodeLUT buildLUT(bool srgb) {
+	EncodeLUT lut;
+	for (int i = 0; i < LUT_SIZE; i++) {
+		double linear = (double)i / (LUT_SIZE - 1);
+		double encoded = linear;
+		if (srgb)
+			encoded = linear <= 0.0031308 ? linear * 12.92 : 1.055 * std::pow(linear, 1.0 / 2.4) - 0.055;
+		lut[i] = (uint8_t)std::lround(std::clamp(encoded, 0.0, 1.0) * 255.0);
+	}
+	return lut;
+}
+
+const EncodeLUT& encodeLUT(bool srgb) {
+	static const EncodeLUT srgbLUT = buildLUT(true);
+	static const EncodeLUT linearLUT = buildLUT(false);
+	return srgb ? srgbLUT : linearLUT;
+}
+
+// Tonemap curve on one linear value, the vector paths below compute the same thing
+template <Tonemap OP>
+inline float tonemapScalar(float x) {
+	if constexpr (OP == Tonemap::Reinhard)
+		return x / (x + 1.0f);
+	else if constexpr (OP == Tonemap::ACES)
+		return (x * (x * 2.51f + 0.03f)) / (x * (x * 2.43f + 0.59f) + 0.14f);
+	else
+		return x;
+}
+
+#if defined(__AVX2__)
+template <Tonemap OP>
+inline __m256 tonemap8(__m256 x) {
+	if constexpr (OP == Tonemap::Reinhard) {
+		return _mm256_div_ps(x, _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+	} else if constexpr (OP == Tonemap::ACES) {
+		__m256 num = _mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(2.51f)), _mm256_set1_ps(0.03f)));
+		__m256 den = _mm256_add_ps(_mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(2.43f)), _mm256_set1_ps(0.59f))), _mm256_set1_ps(0.14f));
+		return _mm256_div_ps(num, den);
+	} else {
+		return x;
+	}
+}
+#elif defined(__SSE2__)
+template <Tonemap OP>
+inline __m128 tonemap4(__m128 x) {
+	if constexpr (OP == Tonemap::Reinhard) {
+		return _mm_div_ps(x, _mm_add_ps(x, _mm_set1_ps(1.0f)));
+	} else if constexpr (OP == Tonemap::ACES) {
+		__m128 num = _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(2.51f)), _mm_set1_ps(0.03f)));
+		__m128 den = _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(2.43f)), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+		return _mm_div_ps(num, den);
+	} else {
+		return x;
+	}
+}
+#endif
+
+// index[j] = LUT entry of tonemap(color[j] * scale[j]), clamped to [0, 1] with NaN going to 0
+// Compilers turn the scalar clamp into branches, which mispredict all over noisy images, hence the explicit vectors
+template <Tonemap OP>
+void quantize(const float* color, const float* scale, int count, int* index) {
+	int j = 0;
+#if defined(__AVX2__)
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 steps = _mm256_set1_ps((float)(LUT_SIZE - 1));
+	const __m256 half = _mm256_set1_ps(0.5f);
+	for (; j + 8 <= count; j += 8) {
+		__m256 x = tonemap8<OP>(_mm256_mul_ps(_mm256_loadu_ps(color + j), _mm256_loadu_ps(scale + j)));
+		x = _mm256_min_ps(_mm256_max_ps(x, zero), one); // max returns the second operand for NaN
+		_mm256_storeu_si256((__m256i*)(index + j), _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(x, steps), half)));
+	}
+#elif defined(__SSE2__)
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 steps = _mm_set1_ps((float)(LUT_SIZE - 1));
+	const __m128 half = _mm_set1_ps(0.5f);
+	for (; j + 4 <= count; j += 4) {
+		__m128 x = tonemap4<OP>(_mm_mul_ps(_mm_loadu_ps(color + j), _mm_loadu_ps(scale + j)));
+		x = _mm_min_ps(_mm_max_ps(x, zero), one);
+		_mm_storeu_si128((__m128i*)(index + j), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(x, steps), half)));
+	}
+#endif
+	for (; j < count; j++) {
+		float x = tonemapScalar<OP>(color[j] * scale[j]);
+		x = x > 0.0f ? (x < 1.0f ? x : 1.0f) : 0.0f;
+		index[j] = (int)(x * (float)(LUT_SIZE - 1) + 0.5f);
+	}
+}
+
+// store(pixel, r, g, b) gets each developed pixel
+template <typename Store>
+void develop(const FilmColors& color, const FilmSamples& samples, int start, int end, const FilmSettings& settings, Store&& store) {
+	const EncodeLUT& lut = encodeLUT(settings.srgb);
+	float exposureScale = std::exp2(settings.exposure);
+
+	// Per channel, so the color columns can be walked as one flat array of floats
+	alignas(32) float scale[3 * FILM_TILE];
+	alignas(32) int index[3 * FILM_TILE];
+
+	for (int block = start; block < end; block += FILM_TILE) {
+		int n = std::min(FILM_TILE, end - block);
+
+		// Average + exposure in one multiply, unsampled pixels get 0
+		for (int i = 0; i < n; i++) {
+			int pixelSamples = samples(block + i);
+			float s = pixelSamples > 0 ? exposureScale / (float)pixelSamples : 0.0f;
+			scale[3 * i] = scale[3 * i + 1] = scale[3 * i + 2] = s;
+		}
+
+		const float* values = color.col(block).data();
+		switch (settings.tonemap) {
+		case Tonemap::Clamp:
+			quantize<Tonemap::Clamp>(values, scale, 3 * n, index);
+			break;
+		case Tonemap::Reinhard:
+			quantize<Tonemap::Reinhard>(values, scale, 3 * n, index);
+			break;
+		case Tonemap::ACES:
+			quantize<Tonemap::ACES>(values, scale, 3 * n, index);
+			break;
+		}
+
+		for (int i = 0; i < n; i++)
+			store(block + i, lut[index[3 * i]], lut[index[3 * i + 1]], lut[index[3 * i + 2]]);
+	}
+}
+
+} // namespace
+
+const char* tonemapName(Tonemap tonemap) {
+	switch (tonemap) {
+	case Tonemap::Clamp:
+		return "clamp";
+	case Tonemap::Reinhard:
+		return "reinhard";
+	case Tonemap::ACES:
+		return "aces";
+	}
+	return "unknown";
+}
+
+bool parseTonemap(const std::string& name, Tonemap& tonemap) {
+	for (Tonemap t : {Tonemap::Clamp, Tonemap::Reinhard, Tonemap::ACES}) {
+		if (name == tonemapName(t)) {
+			tonemap = t;
+			return true;
+		}
+	}
+	return false;
+}
+
+void developRGBA8(const FilmColors& color, const FilmSamples& samples, int start, int end, const FilmSettings& settings, uint32_t* out) {
+	develop(color, samples, start, end, settings, [out](int pixel, uint32_t r, uint32_t g, uint32_t b) { out[pixel] = r | (g << 8) | (b << 16) | (255u << 24); });
+}
+
+void developRGB8(const FilmColors& color, const FilmSamples& samples, int start, int end, const FilmSettings& settings, Eigen::Matrix<int, 3, Eigen::Dynamic>& out) {
+	develop(color, samples, start, end, settings, [&out](int pixel, int r, int g, int b) { out.col(pixel) << r, g, b; });
+}
+
+void developRGB8Packed(const FilmColors& color, const FilmSamples& samples, int start, int end, const FilmSettings& settings, uint8_t* out) {
+	develop(color, samples, start, end, settings, [out, start](int pixel, uint8_t r, uint8_t g, uint8_t b) {
+		uint8_t* texel = out + 3 * (pixel - start);
+		texel[0] = r;
+		texel[1] = g;
+		texel[2] = b;
+	});
+}
+
+void developLinear(const FilmColors& color, const FilmSamples& samples, int start, int end, const FilmSettings& settings, float* out) {
+	float exposureScale = std::exp2(settings.exposure);
+	for (int pixel = start; pixel < end; pixel++) {
+		int pixelSamples = samples(pixel);
+		float scale = pixelSamples > 0 ? exposureScale / (float)pixelSamples : 0.0f;
+		for (int c = 0; c < 3; c++)
+			*out++ = color(c, pixel) * scale;
+	}
+}
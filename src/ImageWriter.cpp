@@ -0,0 +1,92 @@
+#include "ImageWriter.h"
+#include <algorithm>
+#include <bit>
+#include <fcntl.h>
+#include <fstream>
+#include <unistd.h>
+
+bool writePPM(const std::string& path, int width, int height, const Eigen::Matrix<int, 3, Eigen::Dynamic>& colors) {
+	if (colors.cols() != (Eigen::Index)width * height)
+		return false;
+
+	std::ofstream file(path, std::ios::binary);
+	if (!file)
+		return false;
+
+	file << "P6\n"
+	     << width << " " << height << "\n255\n";
+
+	std::vector<unsigned char> bytes(colors.size());
+	for (Eigen::Index i = 0; i < colors.size(); i++) {
+		bytes[i] = (unsigned char)std::clamp(colors.data()[i], 0, 255);
+	}
+	file.write((const char*)bytes.data(), (std::streamsize)bytes.size());
+
+	return (bool)file;
+}
+
+ImageStream::~ImageStream() {
+	close();
+}
+
+bool ImageStream::open(const std::string& path, int newWidth, int newHeight) {
+	close();
+
+	width = newWidth;
+	height = newHeight;
+	floatPixels = path.size() >= 4 && path.compare(path.size() - 4, 4, ".pfm") == 0;
+	failed = false;
+
+	// PFM's scale sign says the float byte order, they're written as they are in memory
+	const char* scale = std::endian::native == std::endian::little ? "\n-1.0\n" : "\n1.0\n";
+	std::string header = (floatPixels ? "PF\n" : "P6\n") + std::to_string(width) + " " + std::to_string(height) + (floatPixels ? scale : "\n255\n");
+	headerSize = header.size();
+	size_t pixelBytes = floatPixels ? 3 * sizeof(float) : 3;
+
+	fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+
+	// Full size up front, the pixels read as zeros (black) until their span is written
+	if (ftruncate(fd, (off_t)(headerSize + (size_t)width * height * pixelBytes)) != 0 || pwrite(fd, header.data(), headerSize, 0) != (ssize_t)headerSize) {
+		::close(fd);
+		fd = -1;
+		return false;
+	}
+	return true;
+}
+
+bool ImageStream::writeSpan(int x, int y, int count, const void* pixels) {
+	if (fd < 0 || x < 0 || y < 0 || count < 0 || x + count > width || y >= height) {
+		failed = true;
+		return false;
+	}
+
+	size_t pixelBytes = floatPixels ? 3 * sizeof(float) : 3;
+	int row = floatPixels ? height - 1 - y : y;
+	size_t bytes = (size_t)count * pixelBytes;
+	off_t offset = (off_t)(headerSize + ((size_t)row * width + x) * pixelBytes);
+
+	// pwrite can come up short, the rest goes in another call
+	const char* data = static_cast<const char*>(pixels);
+	while (bytes > 0) {
+		ssize_t written = pwrite(fd, data, bytes, offset);
+		if (written <= 0) {
+			failed = true;
+			return false;
+		}
+		data += written;
+		bytes -= (size_t)written;
+		offset += written;
+	}
+	return true;
+}
+
+bool ImageStream::close() {
+	if (fd < 0)
+		return !failed;
+
+	bool closed = ::close(fd) == 0;
+	fd = -1;
+	return closed && !failed;
+}
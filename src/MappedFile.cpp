@@ -0,0 +1,102 @@
+#include "MappedFile.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+MappedFile::~MappedFile() {
+	close();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+    : bytes(std::exchange(other.bytes, nullptr)), length(std::exchange(other.length, 0)), opened(std::exchange(other.opened, false)),
+      writable(std::exchange(other.writable, false)) {}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+	if (this != &other) {
+		close();
+		bytes = std::exchange(other.bytes, nullptr);
+		length = std::exchange(other.length, 0);
+		opened = std::exchange(other.opened, false);
+		writable = std::exchange(other.writable, false);
+	}
+	return *this;
+}
+
+bool MappedFile::open(const std::string& path) {
+	close();
+
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		::close(fd);
+		return false;
+	}
+
+	length = (size_t)info.st_size;
+	if (length > 0) {
+		void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapped == MAP_FAILED) {
+			::close(fd);
+			length = 0;
+			return false;
+		}
+
+		// We read front to back
+		madvise(mapped, length, MADV_SEQUENTIAL);
+		bytes = static_cast<char*>(mapped);
+	}
+
+	// The mapping keeps the file alive
+	::close(fd);
+	opened = true;
+	return true;
+}
+
+bool MappedFile::create(const std::string& path, size_t size) {
+	close();
+
+	// Truncating first drops whatever was there, the resize then reads back as zeros without writing any
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+
+	// Blocks are reserved up front: a store into a hole of a full disk would SIGBUS mid-render instead of failing here
+	if (ftruncate(fd, (off_t)size) != 0 || (size > 0 && posix_fallocate(fd, 0, (off_t)size) != 0)) {
+		::close(fd);
+		::unlink(path.c_str());
+		return false;
+	}
+
+	if (size > 0) {
+		void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (mapped == MAP_FAILED) {
+			::close(fd);
+			::unlink(path.c_str());
+			return false;
+		}
+		bytes = static_cast<char*>(mapped);
+	}
+
+	// The mapping keeps the file alive, its name only leaves scratch space behind once the map goes
+	::close(fd);
+	::unlink(path.c_str());
+	length = size;
+	opened = true;
+	writable = true;
+	return true;
+}
+
+void MappedFile::close() {
+	if (bytes != nullptr)
+		munmap(bytes, length);
+
+	bytes = nullptr;
+	length = 0;
+	opened = false;
+	writable = false;
+}
@@ -0,0 +1,626 @@
+#include "MeshLoader.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sstream>
+
+// Chunks are at least this big, smaller files are parsed on the calling thread
+static constexpr size_t MIN_CHUNK_BYTES = 1 << 20;
+
+// Runs func(chunk) for every chunk, on a pool only if there's more than one
+static void forEachChunk(int numChunks, const std::function<void(int)>& func) {
+	if (numChunks <= 1) {
+		for (int c = 0; c < numChunks; c++)
+			func(c);
+		return;
+	}
+
+	ThreadPool pool;
+	pool.parallelFor(0, numChunks, 1, [&](int start, int end) {
+		for (int c = start; c < end; c++)
+			func(c);
+	});
+}
+
+static int chunkCountFor(size_t bytes) {
+	int maxChunks = (int)std::max(1u, std::thread::hardware_concurrency()) * 4;
+	return (int)std::clamp<size_t>(bytes / MIN_CHUNK_BYTES, 1, (size_t)maxChunks);
+}
+
+// ---------------------------------------------------------------- OBJ
+
+static inline bool isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char* skipSpaces(const char* p, const char* end) {
+	while (p < end && isSpace(*p))
+		p++;
+	return p;
+}
+
+static inline const char* lineEnd(const char* p, const char* end) {
+	const char* newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+	return newline ? newline : end;
+}
+
+static inline bool parseFloat(const char*& p, const char* end, float& value) {
+	p = skipSpaces(p, end);
+	if (p < end && *p == '+')
+		p++;
+	auto result = std::from_chars(p, end, value);
+	if (result.ec != std::errc())
+		return false;
+	p = result.ptr;
+	return true;
+}
+
+// Num of vertex references on a face line (p just past the "f")
+static int countFaceRefs(const char* p, const char* end) {
+	int refs = 0;
+	while (true) {
+		p = skipSpaces(p, end);
+		if (p >= end)
+			return refs;
+		refs++;
+		while (p < end && !isSpace(*p))
+			p++;
+	}
+}
+
+// What a chunk holds, then where its output goes
+struct OBJChunk {
+	const char* begin;
+	const char* end;
+	int vertices{0};
+	int triangles{0};
+	int firstVertex{0};
+	int firstTriangle{0};
+};
+
+// Calls onVertex(p, end) / onFace(p, end) with p just past the keyword
+template <typename VertexFunc, typename FaceFunc>
+static void forEachOBJLine(const char* p, const char* end, VertexFunc&& onVertex, FaceFunc&& onFace) {
+	while (p < end) {
+		const char* eol = lineEnd(p, end);
+		const char* q = skipSpaces(p, eol);
+
+		if (eol - q >= 2 && isSpace(q[1])) {
+			if (q[0] == 'v')
+				onVertex(q + 1, eol);
+			else if (q[0] == 'f')
+				onFace(q + 1, eol);
+		}
+		p = eol < end ? eol + 1 : end;
+	}
+}
+
+bool parseOBJ(const char* data, size_t size, std::vector<float>& positions, std::vector<uint32_t>& indices, std::string& error) {
+	const char* fileEnd = data + size;
+
+	// Split on line boundaries
+	int numChunks = chunkCountFor(size);
+	std::vector<OBJChunk> chunks;
+	const char* start = data;
+	for (int c = 0; c < numChunks && start < fileEnd; c++) {
+		const char* stop = c == numChunks - 1 ? fileEnd : data + size * (c + 1) / numChunks;
+		if (stop < start)
+			stop = start;
+		if (stop < fileEnd)
+			stop = lineEnd(stop, fileEnd);
+		stop = std::min(stop + 1, fileEnd);
+		chunks.push_back({start, stop});
+		start = stop;
+	}
+
+	// Pass 1: count, so pass 2 can write straight into place
+	forEachChunk((int)chunks.size(), [&](int c) {
+		OBJChunk& chunk = chunks[c];
+		forEachOBJLine(
+		    chunk.begin, chunk.end, [&](const char*, const char*) { chunk.vertices++; },
+		    [&](const char* p, const char* eol) { chunk.triangles += std::max(0, countFaceRefs(p, eol) - 2); });
+	});
+
+	long long totalVertices = 0;
+	long long totalTriangles = 0;
+	for (OBJChunk& chunk : chunks) {
+		chunk.firstVertex = (int)totalVertices;
+		chunk.firstTriangle = (int)totalTriangles;
+		totalVertices += chunk.vertices;
+		totalTriangles += chunk.triangles;
+	}
+
+	if (totalVertices > INT32_MAX / 3 || totalTriangles > INT32_MAX / 3) {
+		error = "too many vertices or faces";
+		return false;
+	}
+
+	positions.assign(totalVertices * 3, 0.0f);
+	indices.assign(totalTriangles * 3, 0);
+
+	// Pass 2: parse
+	std::atomic<bool> failed{false};
+	forEachChunk((int)chunks.size(), [&](int c) {
+		const OBJChunk& chunk = chunks[c];
+		float* outVertex = positions.data() + (size_t)chunk.firstVertex * 3;
+		uint32_t* outIndex = indices.data() + (size_t)chunk.firstTriangle * 3;
+		int verticesSoFar = chunk.firstVertex;
+		std::vector<uint32_t> polygon;
+
+		forEachOBJLine(
+		    chunk.begin, chunk.end,
+		    [&](const char* p, const char* eol) {
+			    if (!parseFloat(p, eol, outVertex[0]) || !parseFloat(p, eol, outVertex[1]) || !parseFloat(p, eol, outVertex[2]))
+				    failed = true;
+			    outVertex += 3;
+			    verticesSoFar++;
+		    },
+		    [&](const char* p, const char* eol) {
+			    // v, v/vt, v//vn or v/vt/vn, only the position index matters. Negative ones count back from here
+			    polygon.clear();
+			    while (true) {
+				    p = skipSpaces(p, eol);
+				    if (p >= eol)
+					    break;
+
+				    long long ref = 0;
+				    auto result = std::from_chars(p, eol, ref);
+				    long long index = ref > 0 ? ref - 1 : verticesSoFar + ref;
+				    if (result.ec != std::errc() || ref == 0 || index < 0 || index >= totalVertices) {
+					    failed = true;
+					    return;
+				    }
+				    polygon.push_back((uint32_t)index);
+
+				    p = result.ptr;
+				    while (p < eol && !isSpace(*p))
+					    p++;
+			    }
+
+			    // Fan
+			    for (size_t k = 1; k + 1 < polygon.size(); k++) {
+				    outIndex[0] = polygon[0];
+				    outIndex[1] = polygon[k];
+				    outIndex[2] = polygon[k + 1];
+				    outIndex += 3;
+			    }
+		    });
+	});
+
+	if (failed) {
+		error = "malformed vertex or face line";
+		return false;
+	}
+	return true;
+}
+
+// ---------------------------------------------------------------- PLY
+
+enum class PLYType {
+	Int8,
+	UInt8,
+	Int16,
+	UInt16,
+	Int32,
+	UInt32,
+	Float32,
+	Float64,
+	Invalid,
+};
+
+static PLYType parsePLYType(const std::string& name) {
+	if (name == "char" || name == "int8")
+		return PLYType::Int8;
+	if (name == "uchar" || name == "uint8")
+		return PLYType::UInt8;
+	if (name == "short" || name == "int16")
+		return PLYType::Int16;
+	if (name == "ushort" || name == "uint16")
+		return PLYType::UInt16;
+	if (name == "int" || name == "int32")
+		return PLYType::Int32;
+	if (name == "uint" || name == "uint32")
+		return PLYType::UInt32;
+	if (name == "float" || name == "float32")
+		return PLYType::Float32;
+	if (name == "double" || name == "float64")
+		return PLYType::Float64;
+	return PLYType::Invalid;
+}
+
+static int plyTypeSize(PLYType type) {
+	switch (type) {
+	case PLYType::Int8:
+	case PLYType::UInt8:
+		return 1;
+	case PLYType::Int16:
+	case PLYType::UInt16:
+		return 2;
+	case PLYType::Int32:
+	case PLYType::UInt32:
+	case PLYType::Float32:
+		return 4;
+	case PLYType::Float64:
+		return 8;
+	default:
+		return 0;
+	}
+}
+
+template <typename T>
+static T loadBytes(const char* p, bool swap) {
+	char bytes[sizeof(T)];
+	std::memcpy(bytes, p, sizeof(T));
+	if (swap)
+		std::reverse(bytes, bytes + sizeof(T));
+
+	T value;
+	std::memcpy(&value, bytes, sizeof(T));
+	return value;
+}
+
+static double readPLYValue(const char* p, PLYType type, bool swap) {
+	switch (type) {
+	case PLYType::Int8:
+		return (double)loadBytes<int8_t>(p, swap);
+	case PLYType::UInt8:
+		return (double)loadBytes<uint8_t>(p, swap);
+	case PLYType::Int16:
+		return (double)loadBytes<int16_t>(p, swap);
+	case PLYType::UInt16:
+		return (double)loadBytes<uint16_t>(p, swap);
+	case PLYType::Int32:
+		return (double)loadBytes<int32_t>(p, swap);
+	case PLYType::UInt32:
+		return (double)loadBytes<uint32_t>(p, swap);
+	case PLYType::Float32:
+		return (double)loadBytes<float>(p, swap);
+	case PLYType::Float64:
+		return loadBytes<double>(p, swap);
+	default:
+		return 0.0;
+	}
+}
+
+struct PLYProperty {
+	std::string name;
+	PLYType type{PLYType::Invalid};
+	bool isList{false};
+	PLYType countType{PLYType::Invalid}; // Lists only
+};
+
+struct PLYElement {
+	std::string name;
+	long long count{0};
+	std::vector<PLYProperty> properties;
+
+	// Bytes per record, 0 if it has lists (records then have to be walked)
+	int fixedStride() const {
+		int stride = 0;
+		for (const PLYProperty& property : properties) {
+			if (property.isList)
+				return 0;
+			stride += plyTypeSize(property.type);
+		}
+		return stride;
+	}
+};
+
+// Bytes taken by one record starting at p, -1 if it runs past end
+static long long plyRecordSize(const PLYElement& element, const char* p, const char* end, bool swap) {
+	const char* start = p;
+	for (const PLYProperty& property : element.properties) {
+		if (property.isList) {
+			if (p + plyTypeSize(property.countType) > end)
+				return -1;
+			long long count = (long long)readPLYValue(p, property.countType, swap);
+			p += plyTypeSize(property.countType) + count * plyTypeSize(property.type);
+		} else {
+			p += plyTypeSize(property.type);
+		}
+		if (p > end)
+			return -1;
+	}
+	return p - start;
+}
+
+bool parsePLY(const char* data, size_t size, std::vector<float>& positions, std::vector<uint32_t>& indices, std::string& error) {
+	const char* fileEnd = data + size;
+
+	// Header is plain text up to end_header
+	const char* headerEnd = nullptr;
+	for (const char* p = data; p < fileEnd;) {
+		const char* eol = lineEnd(p, fileEnd);
+		if (std::string(p, eol).rfind("end_header", 0) == 0) {
+			headerEnd = std::min(eol + 1, fileEnd);
+			break;
+		}
+		p = eol < fileEnd ? eol + 1 : fileEnd;
+	}
+	if (size < 3 || std::strncmp(data, "ply", 3) != 0 || headerEnd == nullptr) {
+		error = "not a PLY file";
+		return false;
+	}
+
+	bool swap = false;
+	std::vector<PLYElement> elements;
+	std::istringstream header(std::string(data, headerEnd));
+	for (std::string line; std::getline(header, line);) {
+		std::istringstream words(line);
+		std::string keyword;
+		words >> keyword;
+
+		if (keyword == "format") {
+			std::string format;
+			words >> format;
+			if (format == "binary_big_endian") {
+				swap = std::endian::native == std::endian::little;
+			} else if (format == "binary_little_endian") {
+				swap = std::endian::native == std::endian::big;
+			} else {
+				error = "only binary PLY is supported (got " + format + ")";
+				return false;
+			}
+		} else if (keyword == "element") {
+			PLYElement element;
+			words >> element.name >> element.count;
+			elements.push_back(element);
+		} else if (keyword == "property" && !elements.empty()) {
+			PLYProperty property;
+			std::string type;
+			words >> type;
+			if (type == "list") {
+				std::string countType, itemType;
+				words >> countType >> itemType;
+				property.isList = true;
+				property.countType = parsePLYType(countType);
+				property.type = parsePLYType(itemType);
+			} else {
+				property.type = parsePLYType(type);
+			}
+			words >> property.name;
+
+			if (property.type == PLYType::Invalid || (property.isList && property.countType == PLYType::Invalid)) {
+				error = "unknown property type in: " + line;
+				return false;
+			}
+			elements.back().properties.push_back(property);
+		}
+	}
+
+	// Find where every element's data starts (walking variable sized ones we don't care about)
+	const char* p = headerEnd;
+	const char* vertexData = nullptr;
+	const char* faceData = nullptr;
+	const PLYElement* vertexElement = nullptr;
+	const PLYElement* faceElement = nullptr;
+
+	for (const PLYElement& element : elements) {
+		if (element.name == "vertex") {
+			vertexElement = &element;
+			vertexData = p;
+		} else if (element.name == "face") {
+			faceElement = &element;
+			faceData = p;
+		}
+
+		int stride = element.fixedStride();
+		if (stride > 0) {
+			p += element.count * stride;
+		} else {
+			for (long long r = 0; r < element.count && p <= fileEnd; r++) {
+				long long bytes = plyRecordSize(element, p, fileEnd, swap);
+				if (bytes < 0) {
+					p = fileEnd + 1;
+					break;
+				}
+				p += bytes;
+			}
+		}
+
+		if (p > fileEnd) {
+			error = "file ends inside element " + element.name;
+			return false;
+		}
+		if (vertexElement && faceElement)
+			break; // Nothing after both is needed, elements can come in either order
+	}
+
+	if (vertexElement == nullptr || faceElement == nullptr) {
+		error = "needs a vertex and a face element";
+		return false;
+	}
+
+	// Vertices: fixed size records, decoded in parallel
+	int vertexStride = vertexElement->fixedStride();
+	int offsets[3] = {-1, -1, -1};
+	PLYType types[3] = {PLYType::Invalid, PLYType::Invalid, PLYType::Invalid};
+	int offset = 0;
+	for (const PLYProperty& property : vertexElement->properties) {
+		int axis = property.name == "x" ? 0 : (property.name == "y" ? 1 : (property.name == "z" ? 2 : -1));
+		if (axis >= 0) {
+			offsets[axis] = offset;
+			types[axis] = property.type;
+		}
+		offset += plyTypeSize(property.type);
+	}
+	if (vertexStride == 0 || offsets[0] < 0 || offsets[1] < 0 || offsets[2] < 0) {
+		error = "vertex element needs x, y, z and no lists";
+		return false;
+	}
+
+	long long numVertices = vertexElement->count;
+	if (numVertices > INT32_MAX / 3) {
+		error = "too many vertices";
+		return false;
+	}
+	positions.assign(numVertices * 3, 0.0f);
+
+	int vertexChunks = chunkCountFor((size_t)(numVertices * vertexStride));
+	forEachChunk(vertexChunks, [&](int c) {
+		long long first = numVertices * c / vertexChunks;
+		long long last = numVertices * (c + 1) / vertexChunks;
+		for (long long v = first; v < last; v++) {
+			const char* record = vertexData + v * vertexStride;
+			for (int axis = 0; axis < 3; axis++)
+				positions[v * 3 + axis] = (float)readPLYValue(record + offsets[axis], types[axis], swap);
+		}
+	});
+
+	// Faces: records are variable sized, so one serial walk over just the list counts finds where
+	// each chunk starts (and how many triangles come before it), then chunks decode in parallel
+	int listProperty = -1;
+	for (int i = 0; i < (int)faceElement->properties.size(); i++) {
+		const PLYProperty& property = faceElement->properties[i];
+		if (property.isList && (property.name == "vertex_indices" || property.name == "vertex_index"))
+			listProperty = i;
+	}
+	if (listProperty < 0) {
+		error = "face element needs a vertex_indices list";
+		return false;
+	}
+
+	long long numFaces = faceElement->count;
+	int faceChunks = chunkCountFor((size_t)(p - faceData));
+	std::vector<const char*> chunkStart(faceChunks + 1);
+	std::vector<long long> chunkTriangle(faceChunks + 1);
+
+	const char* record = faceData;
+	long long triangles = 0;
+	int chunk = 0;
+	for (long long f = 0; f < numFaces; f++) {
+		while (chunk < faceChunks && f == numFaces * chunk / faceChunks) {
+			chunkStart[chunk] = record;
+			chunkTriangle[chunk] = triangles;
+			chunk++;
+		}
+
+		const char* q = record;
+		for (int i = 0; i < (int)faceElement->properties.size(); i++) {
+			const PLYProperty& property = faceElement->properties[i];
+			if (property.isList) {
+				long long count = (long long)readPLYValue(q, property.countType, swap);
+				if (i == listProperty)
+					triangles += std::max(0LL, count - 2);
+				q += plyTypeSize(property.countType) + count * plyTypeSize(property.type);
+			} else {
+				q += plyTypeSize(property.type);
+			}
+		}
+		record = q;
+	}
+	while (chunk <= faceChunks) {
+		chunkStart[chunk] = record;
+		chunkTriangle[chunk] = triangles;
+		chunk++;
+	}
+
+	if (triangles > INT32_MAX / 3) {
+		error = "too many faces";
+		return false;
+	}
+	indices.assign(triangles * 3, 0);
+
+	std::atomic<bool> badIndex{false};
+	forEachChunk(faceChunks, [&](int c) {
+		const char* q = chunkStart[c];
+		uint32_t* out = indices.data() + chunkTriangle[c] * 3;
+
+		while (q < chunkStart[c + 1]) {
+			for (int i = 0; i < (int)faceElement->properties.size(); i++) {
+				const PLYProperty& property = faceElement->properties[i];
+				if (!property.isList) {
+					q += plyTypeSize(property.type);
+					continue;
+				}
+
+				long long count = (long long)readPLYValue(q, property.countType, swap);
+				q += plyTypeSize(property.countType);
+				int itemSize = plyTypeSize(property.type);
+
+				if (i == listProperty) {
+					// Fan
+					for (long long k = 0; k < count; k++) {
+						long long index = (long long)readPLYValue(q + k * itemSize, property.type, swap);
+						if (index < 0 || index >= numVertices)
+							badIndex = true;
+					}
+					uint32_t first = (uint32_t)readPLYValue(q, property.type, swap);
+					for (long long k = 1; k + 1 < count; k++) {
+						out[0] = first;
+						out[1] = (uint32_t)readPLYValue(q + k * itemSize, property.type, swap);
+						out[2] = (uint32_t)readPLYValue(q + (k + 1) * itemSize, property.type, swap);
+						out += 3;
+					}
+				}
+				q += count * itemSize;
+			}
+		}
+	});
+
+	if (badIndex) {
+		error = "face index out of range";
+		return false;
+	}
+	return true;
+}
+
+// ---------------------------------------------------------------- Loading
+
+static std::string lowercaseExtension(const std::string& path) {
+	size_t dot = path.find_last_of('.');
+	if (dot == std::string::npos)
+		return "";
+
+	std::string extension = path.substr(dot + 1);
+	std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+	return extension;
+}
+
+Mesh* loadMesh(const std::string& path, Material material, MeshLoadStats* stats) {
+	auto start = std::chrono::steady_clock::now();
+
+	std::string extension = lowercaseExtension(path);
+	if (extension != "obj" && extension != "ply") {
+		std::cerr << "Unsupported mesh format: " << path << " (expected .obj or .ply)" << std::endl;
+		return nullptr;
+	}
+
+	MappedFile file;
+	if (!file.open(path)) {
+		std::cerr << "Failed to open " << path << std::endl;
+		return nullptr;
+	}
+
+	std::vector<float> positions;
+	std::vector<uint32_t> indices;
+	std::string error;
+	bool parsed = extension == "obj" ? parseOBJ(file.data(), file.size(), positions, indices, error) : parsePLY(file.data(), file.size(), positions, indices, error);
+	if (!parsed) {
+		std::cerr << "Failed to load " << path << ": " << error << std::endl;
+		return nullptr;
+	}
+
+	MeshLoadStats loadStats;
+	loadStats.bytes = file.size();
+	loadStats.vertices = (int)(positions.size() / 3);
+	loadStats.triangles = (int)(indices.size() / 3);
+
+	Mesh* mesh = new Mesh(std::move(positions), std::move(indices), material);
+	loadStats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << "Loaded " << path << ": " << loadStats.vertices << " vertices, " << loadStats.triangles << " triangles in " << loadStats.seconds * 1e3 << " ms ("
+	          << loadStats.megabytesPerSecond() << " MB/s, " << loadStats.trianglesPerSecond() / 1e6 << " Mtris/s)" << std::endl;
+
+	if (stats)
+		*stats = loadStats;
+	return mesh;
+}
@@ -0,0 +1,478 @@
+#include "PacketKernels.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+SimdLevel bestSimdLevel() {
+#if defined(__AVX2__)
+	return SimdLevel::AVX2;
+#elif defined(__SSE2__)
+	return SimdLevel::SSE;
+#else
+	return SimdLevel::Scalar;
+#endif
+}
+
+bool isSimdLevelSupported(SimdLevel level) {
+	return (int)level <= (int)bestSimdLevel();
+}
+
+const char* simdLevelName(SimdLevel level) {
+	switch (level) {
+	case SimdLevel::AVX2:
+		return "avx2";
+	case SimdLevel::SSE:
+		return "sse";
+	default:
+		return "scalar";
+	}
+}
+
+void SphereSoA::clear() {
+	cx.clear();
+	cy.clear();
+	cz.clear();
+	radiusSq.clear();
+}
+
+void SphereSoA::push(const Eigen::Vector3f& center, float radius) {
+	cx.push_back(center.x());
+	cy.push_back(center.y());
+	cz.push_back(center.z());
+	radiusSq.push_back(radius * radius);
+}
+
+void RayPacket::clear() {
+	// Padding lanes can never beat a tHit of 0 (hits need t > 0.001)
+	for (int i = 0; i < SIZE; i++) {
+		ox[i] = oy[i] = oz[i] = 0.0f;
+		dx[i] = dy[i] = dz[i] = 0.0f;
+		idx[i] = idy[i] = idz[i] = 0.0f;
+		tHit[i] = 0.0f;
+		hitIndex[i] = -1;
+	}
+	count = 0;
+}
+
+void RayPacket::add(const Eigen::Vector3f& origin, const Eigen::Vector3f& dir, float tMax) {
+	int i = count++;
+	ox[i] = origin.x();
+	oy[i] = origin.y();
+	oz[i] = origin.z();
+	dx[i] = dir.x();
+	dy[i] = dir.y();
+	dz[i] = dir.z();
+	idx[i] = 1.0f / dir.x();
+	idy[i] = 1.0f / dir.y();
+	idz[i] = 1.0f / dir.z();
+	tHit[i] = tMax;
+	hitIndex[i] = -1;
+}
+
+// Scalar reference, same math as RayTracer's per-ray path
+static void intersectSpheresScalar(RayPacket& p, const SphereSoA& s, int first, int last) {
+	for (int lane = 0; lane < p.count; lane++) {
+		float a = p.dx[lane] * p.dx[lane] + p.dy[lane] * p.dy[lane] + p.dz[lane] * p.dz[lane];
+
+		for (int i = first; i < last; i++) {
+			float ocx = p.ox[lane] - s.cx[i];
+			float ocy = p.oy[lane] - s.cy[i];
+			float ocz = p.oz[lane] - s.cz[i];
+			float half_b = p.dx[lane] * ocx + p.dy[lane] * ocy + p.dz[lane] * ocz;
+			float c = ocx * ocx + ocy * ocy + ocz * ocz - s.radiusSq[i];
+			float discriminant = half_b * half_b - a * c;
+			if (discriminant <= 0.0f)
+				continue;
+
+			float t = (-half_b - std::sqrt(discriminant)) / a;
+			if (t > 0.001f && t < p.tHit[lane]) {
+				p.tHit[lane] = t;
+				p.hitIndex[lane] = i;
+			}
+		}
+	}
+}
+
+// Corners of up to 8 triangles relative to the ray origin, in the ray's permuted axis order
+// Gathered through the index buffer once per batch, padding lanes are all zero (det = 0, never a hit)
+struct TriangleLanes {
+	alignas(32) float ax[8], ay[8], az[8];
+	alignas(32) float bx[8], by[8], bz[8];
+	alignas(32) float cx[8], cy[8], cz[8];
+};
+
+static void gatherTriangles(const WatertightRay& ray, const float* positions, const TrianglePrim* triangles, int first, int count, TriangleLanes& l) {
+	float ox = ray.origin[ray.kx];
+	float oy = ray.origin[ray.ky];
+	float oz = ray.origin[ray.kz];
+
+	for (int lane = 0; lane < 8; lane++) {
+		if (lane >= count) {
+			l.ax[lane] = l.ay[lane] = l.az[lane] = 0.0f;
+			l.bx[lane] = l.by[lane] = l.bz[lane] = 0.0f;
+			l.cx[lane] = l.cy[lane] = l.cz[lane] = 0.0f;
+			continue;
+		}
+
+		const TrianglePrim& tri = triangles[first + lane];
+		const float* p0 = positions + 3 * tri.v0;
+		const float* p1 = positions + 3 * tri.v1;
+		const float* p2 = positions + 3 * tri.v2;
+
+		l.ax[lane] = p0[ray.kx] - ox;
+		l.ay[lane] = p0[ray.ky] - oy;
+		l.az[lane] = p0[ray.kz] - oz;
+		l.bx[lane] = p1[ray.kx] - ox;
+		l.by[lane] = p1[ray.ky] - oy;
+		l.bz[lane] = p1[ray.kz] - oz;
+		l.cx[lane] = p2[ray.kx] - ox;
+		l.cy[lane] = p2[ray.ky] - oy;
+		l.cz[lane] = p2[ray.kz] - oz;
+	}
+}
+
+// Lane with the closest of the `valid` hits, -1 if none beat tHit (which is updated)
+static int closestLane(const float* t, int validMask, int numLanes, float& tHit) {
+	int best = -1;
+	for (int lane = 0; lane < numLanes; lane++) {
+		if ((validMask >> lane) & 1 && t[lane] < tHit) {
+			tHit = t[lane];
+			best = lane;
+		}
+	}
+	return best;
+}
+
+static bool packetHitsBoxScalar(const RayPacket& p, const AABB& box) {
+	for (int lane = 0; lane < p.count; lane++) {
+		Eigen::Vector3f origin(p.ox[lane], p.oy[lane], p.oz[lane]);
+		Eigen::Vector3f invDir(p.idx[lane], p.idy[lane], p.idz[lane]);
+		if (box.intersect(origin, invDir, p.tHit[lane]) != std::numeric_limits<float>::infinity())
+			return true;
+	}
+	return false;
+}
+
+#if defined(__SSE2__)
+static inline __m128 blend4(__m128 a, __m128 b, __m128 mask) {
+	return _mm_or_ps(_mm_and_ps(mask, b), _mm_andnot_ps(mask, a));
+}
+
+static void intersectSpheresSSE(RayPacket& p, const SphereSoA& s, int first, int last) {
+	const __m128 eps = _mm_set1_ps(0.001f);
+	const __m128 zero = _mm_setzero_ps();
+
+	for (int half = 0; half < p.count; half += 4) {
+		__m128 ox = _mm_load_ps(p.ox + half);
+		__m128 oy = _mm_load_ps(p.oy + half);
+		__m128 oz = _mm_load_ps(p.oz + half);
+		__m128 dx = _mm_load_ps(p.dx + half);
+		__m128 dy = _mm_load_ps(p.dy + half);
+		__m128 dz = _mm_load_ps(p.dz + half);
+		__m128 tHit = _mm_load_ps(p.tHit + half);
+		__m128 hit = _mm_castsi128_ps(_mm_load_si128((const __m128i*)(p.hitIndex + half)));
+
+		__m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+		for (int i = first; i < last; i++) {
+			__m128 ocx = _mm_sub_ps(ox, _mm_set1_ps(s.cx[i]));
+			__m128 ocy = _mm_sub_ps(oy, _mm_set1_ps(s.cy[i]));
+			__m128 ocz = _mm_sub_ps(oz, _mm_set1_ps(s.cz[i]));
+
+			__m128 half_b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)), _mm_mul_ps(dz, ocz));
+			__m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_set1_ps(s.radiusSq[i]));
+			__m128 discriminant = _mm_sub_ps(_mm_mul_ps(half_b, half_b), _mm_mul_ps(a, c));
+
+			__m128 mask = _mm_cmpgt_ps(discriminant, zero);
+			if (!_mm_movemask_ps(mask))
+				continue;
+
+			__m128 root = _mm_sqrt_ps(_mm_max_ps(discriminant, zero));
+			__m128 t = _mm_div_ps(_mm_sub_ps(_mm_sub_ps(zero, half_b), root), a);
+			mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpgt_ps(t, eps), _mm_cmplt_ps(t, tHit)));
+
+			tHit = blend4(tHit, t, mask);
+			hit = blend4(hit, _mm_castsi128_ps(_mm_set1_epi32(i)), mask);
+		}
+
+		_mm_store_ps(p.tHit + half, tHit);
+		_mm_store_si128((__m128i*)(p.hitIndex + half), _mm_castps_si128(hit));
+	}
+}
+
+// 4 triangles starting at lane `offset`, same math as intersectWatertight
+static int intersectTrianglesSSE(const WatertightRay& ray, const TriangleLanes& l, int offset, float& tHit) {
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 sx = _mm_set1_ps(ray.sx);
+	const __m128 sy = _mm_set1_ps(ray.sy);
+
+	__m128 az = _mm_load_ps(l.az + offset);
+	__m128 bz = _mm_load_ps(l.bz + offset);
+	__m128 cz = _mm_load_ps(l.cz + offset);
+	__m128 ax = _mm_sub_ps(_mm_load_ps(l.ax + offset), _mm_mul_ps(sx, az));
+	__m128 ay = _mm_sub_ps(_mm_load_ps(l.ay + offset), _mm_mul_ps(sy, az));
+	__m128 bx = _mm_sub_ps(_mm_load_ps(l.bx + offset), _mm_mul_ps(sx, bz));
+	__m128 by = _mm_sub_ps(_mm_load_ps(l.by + offset), _mm_mul_ps(sy, bz));
+	__m128 cx = _mm_sub_ps(_mm_load_ps(l.cx + offset), _mm_mul_ps(sx, cz));
+	__m128 cy = _mm_sub_ps(_mm_load_ps(l.cy + offset), _mm_mul_ps(sy, cz));
+
+	__m128 u = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+	__m128 v = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+	__m128 w = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+	__m128 anyNeg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)), _mm_cmplt_ps(w, zero));
+	__m128 anyPos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)), _mm_cmpgt_ps(w, zero));
+	__m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+	__m128 mask = _mm_andnot_ps(_mm_and_ps(anyNeg, anyPos), _mm_cmpneq_ps(det, zero));
+	if (!_mm_movemask_ps(mask))
+		return -1;
+
+	__m128 scaledT = _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, az), _mm_mul_ps(v, bz)), _mm_mul_ps(w, cz));
+	__m128 t = _mm_div_ps(_mm_mul_ps(scaledT, _mm_set1_ps(ray.sz)), det);
+	mask = _mm_and_ps(mask, _mm_cmpgt_ps(t, _mm_set1_ps(HIT_EPSILON)));
+
+	alignas(16) float tLanes[4];
+	_mm_store_ps(tLanes, t);
+	return closestLane(tLanes, _mm_movemask_ps(mask), 4, tHit);
+}
+
+static bool packetHitsBoxSSE(const RayPacket& p, const AABB& box) {
+	const __m128 zero = _mm_setzero_ps();
+
+	for (int half = 0; half < p.count; half += 4) {
+		__m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.min.x()), _mm_load_ps(p.ox + half)), _mm_load_ps(p.idx + half));
+		__m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.max.x()), _mm_load_ps(p.ox + half)), _mm_load_ps(p.idx + half));
+		__m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.min.y()), _mm_load_ps(p.oy + half)), _mm_load_ps(p.idy + half));
+		__m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.max.y()), _mm_load_ps(p.oy + half)), _mm_load_ps(p.idy + half));
+		__m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.min.z()), _mm_load_ps(p.oz + half)), _mm_load_ps(p.idz + half));
+		__m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.max.z()), _mm_load_ps(p.oz + half)), _mm_load_ps(p.idz + half));
+
+		__m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)), _mm_max_ps(_mm_min_ps(t0z, t1z), zero));
+		__m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)), _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_load_ps(p.tHit + half)));
+
+		// Padding lanes are excluded through the lane count
+		int lanes = (1 << std::min(4, p.count - half)) - 1;
+		if (_mm_movemask_ps(_mm_cmple_ps(tNear, tFar)) & lanes)
+			return true;
+	}
+	return false;
+}
+#endif
+
+#if defined(__AVX2__)
+static void intersectSpheresAVX2(RayPacket& p, const SphereSoA& s, int first, int last) {
+	const __m256 eps = _mm256_set1_ps(0.001f);
+	const __m256 zero = _mm256_setzero_ps();
+
+	__m256 ox = _mm256_load_ps(p.ox);
+	__m256 oy = _mm256_load_ps(p.oy);
+	__m256 oz = _mm256_load_ps(p.oz);
+	__m256 dx = _mm256_load_ps(p.dx);
+	__m256 dy = _mm256_load_ps(p.dy);
+	__m256 dz = _mm256_load_ps(p.dz);
+	__m256 tHit = _mm256_load_ps(p.tHit);
+	__m256 hit = _mm256_castsi256_ps(_mm256_load_si256((const __m256i*)p.hitIndex));
+
+	__m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+
+	for (int i = first; i < last; i++) {
+		__m256 ocx = _mm256_sub_ps(ox, _mm256_set1_ps(s.cx[i]));
+		__m256 ocy = _mm256_sub_ps(oy, _mm256_set1_ps(s.cy[i]));
+		__m256 ocz = _mm256_sub_ps(oz, _mm256_set1_ps(s.cz[i]));
+
+		__m256 half_b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)), _mm256_mul_ps(dz, ocz));
+		__m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), _mm256_set1_ps(s.radiusSq[i]));
+		__m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(half_b, half_b), _mm256_mul_ps(a, c));
+
+		__m256 mask = _mm256_cmp_ps(discriminant, zero, _CMP_GT_OQ);
+		if (!_mm256_movemask_ps(mask))
+			continue;
+
+		__m256 root = _mm256_sqrt_ps(_mm256_max_ps(discriminant, zero));
+		__m256 t = _mm256_div_ps(_mm256_sub_ps(_mm256_sub_ps(zero, half_b), root), a);
+		mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(t, eps, _CMP_GT_OQ), _mm256_cmp_ps(t, tHit, _CMP_LT_OQ)));
+
+		tHit = _mm256_blendv_ps(tHit, t, mask);
+		hit = _mm256_blendv_ps(hit, _mm256_castsi256_ps(_mm256_set1_epi32(i)), mask);
+	}
+
+	_mm256_store_ps(p.tHit, tHit);
+	_mm256_store_si256((__m256i*)p.hitIndex, _mm256_castps_si256(hit));
+}
+
+static int intersectTrianglesAVX2(const WatertightRay& ray, const TriangleLanes& l, float& tHit) {
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 sx = _mm256_set1_ps(ray.sx);
+	const __m256 sy = _mm256_set1_ps(ray.sy);
+
+	__m256 az = _mm256_load_ps(l.az);
+	__m256 bz = _mm256_load_ps(l.bz);
+	__m256 cz = _mm256_load_ps(l.cz);
+	__m256 ax = _mm256_sub_ps(_mm256_load_ps(l.ax), _mm256_mul_ps(sx, az));
+	__m256 ay = _mm256_sub_ps(_mm256_load_ps(l.ay), _mm256_mul_ps(sy, az));
+	__m256 bx = _mm256_sub_ps(_mm256_load_ps(l.bx), _mm256_mul_ps(sx, bz));
+	__m256 by = _mm256_sub_ps(_mm256_load_ps(l.by), _mm256_mul_ps(sy, bz));
+	__m256 cx = _mm256_sub_ps(_mm256_load_ps(l.cx), _mm256_mul_ps(sx, cz));
+	__m256 cy = _mm256_sub_ps(_mm256_load_ps(l.cy), _mm256_mul_ps(sy, cz));
+
+	__m256 u = _mm256_sub_ps(_mm256_mul_ps(cx, by), _mm256_mul_ps(cy, bx));
+	__m256 v = _mm256_sub_ps(_mm256_mul_ps(ax, cy), _mm256_mul_ps(ay, cx));
+	__m256 w = _mm256_sub_ps(_mm256_mul_ps(bx, ay), _mm256_mul_ps(by, ax));
+
+	__m256 anyNeg = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ), _mm256_cmp_ps(v, zero, _CMP_LT_OQ)), _mm256_cmp_ps(w, zero, _CMP_LT_OQ));
+	__m256 anyPos = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ), _mm256_cmp_ps(v, zero, _CMP_GT_OQ)), _mm256_cmp_ps(w, zero, _CMP_GT_OQ));
+	__m256 det = _mm256_add_ps(_mm256_add_ps(u, v), w);
+	__m256 mask = _mm256_andnot_ps(_mm256_and_ps(anyNeg, anyPos), _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+	if (!_mm256_movemask_ps(mask))
+		return -1;
+
+	__m256 scaledT = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(u, az), _mm256_mul_ps(v, bz)), _mm256_mul_ps(w, cz));
+	__m256 t = _mm256_div_ps(_mm256_mul_ps(scaledT, _mm256_set1_ps(ray.sz)), det);
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, _mm256_set1_ps(HIT_EPSILON), _CMP_GT_OQ));
+
+	alignas(32) float tLanes[8];
+	_mm256_store_ps(tLanes, t);
+	return closestLane(tLanes, _mm256_movemask_ps(mask), 8, tHit);
+}
+
+static bool packetHitsBoxAVX2(const RayPacket& p, const AABB& box) {
+	const __m256 zero = _mm256_setzero_ps();
+
+	__m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.min.x()), _mm256_load_ps(p.ox)), _mm256_load_ps(p.idx));
+	__m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.max.x()), _mm256_load_ps(p.ox)), _mm256_load_ps(p.idx));
+	__m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.min.y()), _mm256_load_ps(p.oy)), _mm256_load_ps(p.idy));
+	__m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.max.y()), _mm256_load_ps(p.oy)), _mm256_load_ps(p.idy));
+	__m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.min.z()), _mm256_load_ps(p.oz)), _mm256_load_ps(p.idz));
+	__m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.max.z()), _mm256_load_ps(p.oz)), _mm256_load_ps(p.idz));
+
+	__m256 tNear = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)), _mm256_max_ps(_mm256_min_ps(t0z, t1z), zero));
+	__m256 tFar = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)), _mm256_min_ps(_mm256_max_ps(t0z, t1z), _mm256_load_ps(p.tHit)));
+
+	int lanes = (1 << p.count) - 1;
+	return (_mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ)) & lanes) != 0;
+}
+#endif
+
+void intersectSpheresPacket(SimdLevel level, RayPacket& packet, const SphereSoA& spheres, int first, int last) {
+	switch (level) {
+#if defined(__AVX2__)
+	case SimdLevel::AVX2:
+		intersectSpheresAVX2(packet, spheres, first, last);
+		return;
+#endif
+#if defined(__SSE2__)
+	case SimdLevel::SSE:
+		intersectSpheresSSE(packet, spheres, first, last);
+		return;
+#endif
+	default:
+		intersectSpheresScalar(packet, spheres, first, last);
+		return;
+	}
+}
+
+bool packetHitsBox(SimdLevel level, const RayPacket& packet, const AABB& box) {
+	switch (level) {
+#if defined(__AVX2__)
+	case SimdLevel::AVX2:
+		return packetHitsBoxAVX2(packet, box);
+#endif
+#if defined(__SSE2__)
+	case SimdLevel::SSE:
+		return packetHitsBoxSSE(packet, box);
+#endif
+	default:
+		return packetHitsBoxScalar(packet, box);
+	}
+}
+
+void intersectTriangles(SimdLevel level, const WatertightRay& ray, const float* positions, const TrianglePrim* triangles, int first, int last, float& tHit, int& hitIndex) {
+	if (level == SimdLevel::Scalar || !isSimdLevelSupported(level)) {
+		for (int i = first; i < last; i++) {
+			const TrianglePrim& tri = triangles[i];
+			float t = intersectWatertight(ray, positions + 3 * tri.v0, positions + 3 * tri.v1, positions + 3 * tri.v2);
+			if (t < tHit) {
+				tHit = t;
+				hitIndex = i;
+			}
+		}
+		return;
+	}
+
+	TriangleLanes lanes;
+	for (int batch = first; batch < last; batch += 8) {
+		int count = std::min(8, last - batch);
+		gatherTriangles(ray, positions, triangles, batch, count, lanes);
+
+		int lane = -1;
+#if defined(__AVX2__)
+		if (level == SimdLevel::AVX2)
+			lane = intersectTrianglesAVX2(ray, lanes, tHit);
+#endif
+#if defined(__SSE2__)
+		if (level == SimdLevel::SSE) {
+			lane = intersectTrianglesSSE(ray, lanes, 0, tHit);
+			if (count > 4) {
+				int upper = intersectTrianglesSSE(ray, lanes, 4, tHit);
+				if (upper >= 0)
+					lane = 4 + upper;
+			}
+		}
+#endif
+		if (lane >= 0)
+			hitIndex = batch + lane;
+	}
+}
+
+int traversePacket(SimdLevel level, RayPacket& packet, const BVH& bvh, const SphereSoA& spheres) {
+	const std::vector<BVHNode>& nodes = bvh.getNodes();
+	if (nodes.empty() || packet.count == 0)
+		return 0;
+
+	if (!packetHitsBox(level, packet, nodes[0].bounds))
+		return 1;
+
+	int stack[128];
+	int stackSize = 0;
+	int visited = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0) {
+		const BVHNode& node = nodes[stack[--stackSize]];
+		visited++;
+
+		if (node.isLeaf()) {
+			intersectSpheresPacket(level, packet, spheres, node.leftOrFirst, node.leftOrFirst + node.count);
+			continue;
+		}
+
+		int left = node.leftOrFirst;
+		int right = left + 1;
+		bool hitLeft = packetHitsBox(level, packet, nodes[left].bounds);
+		bool hitRight = packetHitsBox(level, packet, nodes[right].bounds);
+
+		// Guess the near child from the first ray, along the axis the children are most separated on
+		Eigen::Vector3f separation = nodes[right].bounds.centroid() - nodes[left].bounds.centroid();
+		int axis;
+		separation.cwiseAbs().maxCoeff(&axis);
+		float firstDir = axis == 0 ? packet.dx[0] : (axis == 1 ? packet.dy[0] : packet.dz[0]);
+		bool rightFirst = firstDir * separation[axis] < 0.0f;
+
+		// Push the far one first so the near one gets popped next
+		int nearChild = rightFirst ? right : left;
+		int farChild = rightFirst ? left : right;
+		bool hitNear = rightFirst ? hitRight : hitLeft;
+		bool hitFar = rightFirst ? hitLeft : hitRight;
+
+		if (hitFar)
+			stack[stackSize++] = farChild;
+		if (hitNear)
+			stack[stackSize++] = nearChild;
+	}
+
+	return visited;
+}
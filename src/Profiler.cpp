@@ -0,0 +1,153 @@
+#include "Profiler.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+// Only its owning thread writes to a ring, `head` is published after the zone is in place
+struct ThreadRing {
+	std::vector<Profiler::Zone> zones = std::vector<Profiler::Zone>(Profiler::RING_SIZE);
+	std::atomic<uint64_t> head{0};
+	std::atomic<bool> inUse{true};
+	int threadId{0};
+};
+
+std::atomic<bool> enabled{false};
+std::atomic<int> contextSample{-1};
+std::atomic<int> contextBounce{-1};
+
+// Rings outlive their threads and get handed to the next new thread (the viewer starts one per render)
+std::mutex registryMutex;
+std::vector<std::unique_ptr<ThreadRing>> rings;
+int nextThreadId = 0;
+
+ThreadRing* acquireRing() {
+	std::lock_guard<std::mutex> lock(registryMutex);
+
+	ThreadRing* ring = nullptr;
+	for (auto& candidate : rings) {
+		bool expected = false;
+		if (candidate->inUse.compare_exchange_strong(expected, true)) {
+			ring = candidate.get();
+			break;
+		}
+	}
+
+	if (ring == nullptr) {
+		rings.push_back(std::make_unique<ThreadRing>());
+		ring = rings.back().get();
+	}
+
+	ring->threadId = nextThreadId++;
+	return ring;
+}
+
+struct RingHandle {
+	ThreadRing* ring{nullptr};
+	~RingHandle() {
+		if (ring != nullptr)
+			ring->inUse = false;
+	}
+};
+
+thread_local RingHandle tlsRing;
+
+} // namespace
+
+void Profiler::setEnabled(bool enable) {
+	enabled.store(enable, std::memory_order_relaxed);
+}
+
+bool Profiler::isEnabled() {
+	return enabled.load(std::memory_order_relaxed);
+}
+
+void Profiler::setContext(int sample, int bounce) {
+	contextSample.store(sample, std::memory_order_relaxed);
+	contextBounce.store(bounce, std::memory_order_relaxed);
+}
+
+int64_t Profiler::nowNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Profiler::record(const char* name, int64_t startNs, int64_t endNs, int sample, int bounce, int chunk) {
+	if (tlsRing.ring == nullptr)
+		tlsRing.ring = acquireRing();
+
+	ThreadRing& ring = *tlsRing.ring;
+	uint64_t head = ring.head.load(std::memory_order_relaxed);
+	ring.zones[head % RING_SIZE] = {name, startNs, endNs, ring.threadId, sample, bounce, chunk};
+	ring.head.store(head + 1, std::memory_order_release);
+}
+
+void Profiler::clear() {
+	std::lock_guard<std::mutex> lock(registryMutex);
+	for (auto& ring : rings)
+		ring->head.store(0, std::memory_order_relaxed);
+}
+
+bool Profiler::writeChromeTrace(const std::string& path) {
+	std::vector<Zone> zones;
+	std::vector<int> threadIds;
+
+	{
+		std::lock_guard<std::mutex> lock(registryMutex);
+		for (auto& ring : rings) {
+			uint64_t head = ring->head.load(std::memory_order_acquire);
+			uint64_t count = std::min<uint64_t>(head, RING_SIZE);
+			for (uint64_t i = head - count; i < head; i++)
+				zones.push_back(ring->zones[i % RING_SIZE]);
+		}
+	}
+
+	std::sort(zones.begin(), zones.end(), [](const Zone& a, const Zone& b) { return a.startNs < b.startNs; });
+	for (const Zone& zone : zones)
+		threadIds.push_back(zone.threadId);
+	std::sort(threadIds.begin(), threadIds.end());
+	threadIds.erase(std::unique(threadIds.begin(), threadIds.end()), threadIds.end());
+
+	std::ofstream file(path);
+	if (!file)
+		return false;
+
+	// Timestamps are microseconds from the first zone
+	int64_t origin = zones.empty() ? 0 : zones.front().startNs;
+	file.setf(std::ios::fixed);
+	file.precision(3);
+
+	file << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+	bool first = true;
+	for (int id : threadIds) {
+		file << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << id << ", \"args\": {\"name\": \"thread " << id << "\"}}";
+		first = false;
+	}
+	for (const Zone& zone : zones) {
+		file << (first ? "" : ",\n") << "{\"name\": \"" << zone.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << zone.threadId
+		     << ", \"ts\": " << (double)(zone.startNs - origin) / 1e3 << ", \"dur\": " << (double)(zone.endNs - zone.startNs) / 1e3
+		     << ", \"args\": {\"sample\": " << zone.sample << ", \"bounce\": " << zone.bounce << ", \"chunk\": " << zone.chunk << "}}";
+		first = false;
+	}
+	file << "\n]}\n";
+
+	return (bool)file;
+}
+
+ProfileZone::ProfileZone(const char* name, int chunk) : name(name), chunk(chunk) {
+	if (!Profiler::isEnabled())
+		return;
+
+	sample = contextSample.load(std::memory_order_relaxed);
+	bounce = contextBounce.load(std::memory_order_relaxed);
+	startNs = Profiler::nowNs();
+}
+
+ProfileZone::~ProfileZone() {
+	if (startNs >= 0)
+		Profiler::record(name, startNs, Profiler::nowNs(), sample, bounce, chunk);
+}
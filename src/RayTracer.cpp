@@ -1,86 +1,273 @@
 #include "RayTracer.h"
+#include "Profiler.h"
+#include "Sampler.h"
+#include "SceneCache.h"
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <iostream>
 #include <limits>
+#include <numbers>
+#include <numeric>
 
 RayTracer::RayTracer(int numPixels, int maxBounces, int sampleCount)
-    : numPixels(numPixels), targetSampleCount(sampleCount), maxBounces(maxBounces),
-      rng(std::random_device{}()), dist(-0.5f, 0.5f) {
-	N = numPixels;
+    : numPixels(numPixels), targetSampleCount(sampleCount), maxBounces(maxBounces) {
+	resize(numPixels);
+}
 
-	ray_origins.resize(3, N);
-	ray_directions.resize(3, N);
-	ray_colors.resize(3, N);
-	ray_steps.resize(1, N);
-	t_distance.resize(1, N);
+RayTracer::~RayTracer() {
+	// The render thread uses the pool and buffers, it has to go first
+	cancel();
+}
+
+void AccumulationBuffer::point(char* colorBytes, char* sampleBytes, int numPixels) {
+	// Placement new is how Eigen re-seats a Map
+	new (&color) Eigen::Map<Eigen::Matrix<float, 3, Eigen::Dynamic>>(reinterpret_cast<float*>(colorBytes), 3, numPixels);
+	new (&samples) Eigen::Map<Eigen::Array<int, 1, Eigen::Dynamic>>(reinterpret_cast<int*>(sampleBytes), 1, numPixels);
+}
 
-	accumulated_buffer_a.resize(3, numPixels);
-	accumulated_buffer_b.resize(3, numPixels);
-	accumulated_buffer_a.setZero();
-	accumulated_buffer_b.setZero();
+void AccumulationBuffer::reset(int numPixels) {
+	if (!scratchPath.empty()) {
+		heapColor.resize(3, 0);
+		heapSamples.resize(1, 0);
 
-	display_buffer = &accumulated_buffer_b;
+		// A fresh file reads back as zeros, nothing gets cleared page by page
+		size_t colorBytes = (size_t)numPixels * 3 * sizeof(float);
+		if (scratch.create(scratchPath, colorBytes + (size_t)numPixels * sizeof(int))) {
+			point(scratch.writableData(), scratch.writableData() + colorBytes, numPixels);
+			return;
+		}
+
+		std::cerr << "Failed to map film scratch file " << scratchPath << ", accumulating in RAM" << std::endl;
+		scratchPath.clear();
+	}
+
+	scratch.close();
+	heapColor.setZero(3, numPixels);
+	heapSamples.setZero(1, numPixels);
+	point(reinterpret_cast<char*>(heapColor.data()), reinterpret_cast<char*>(heapSamples.data()), numPixels);
+}
 
-	computeChunks();
+bool AccumulationBuffer::setScratch(const std::string& path, int numPixels) {
+	scratchPath = path;
+	reset(numPixels);
+	return path.empty() || isMapped();
 }
 
 void RayTracer::resize(int newNumPixels) {
 	numPixels = newNumPixels;
-	N = numPixels;
+
+	accumulated_buffer_a.reset(numPixels);
+	accumulated_buffer_b.reset(accumulated_buffer_a.isMapped() ? 0 : numPixels);
+
+	display_buffer.store(secondBuffer());
+	display_sample_count.store(0);
+	currentSampleCount = 0;
+
+	// One row of tiles (scanline slots) until a view gives the image a width
+	tiles = TileGrid{};
+	tiles.build(numPixels, 1, tileSize, tileOrder);
+	tile_pending.setZero(1, tiles.numTiles());
+
+	resetActivePixels();
+	allocateRays();
+}
+
+void RayTracer::budgetShape(int& batch, int& slots) const {
+	batch = std::clamp(maxRays / std::max(numPixels, 1), 1, samplesPerPass);
+	// A window has to fit at least one whole tile
+	slots = std::min(numPixels, std::max(maxRays / batch, tileSize * tileSize));
+}
+
+void RayTracer::allocateRays() {
+	budgetShape(batchSize, raySlots);
+	passSamples = 1;
+	N = raySlots * batchSize;
 
 	ray_origins.resize(3, N);
 	ray_directions.resize(3, N);
 	ray_colors.resize(3, N);
 	ray_steps.resize(1, N);
 	t_distance.resize(1, N);
+	hit_type.resize(1, N);
+	hit_object.resize(1, N);
 
-	accumulated_buffer_a.resize(3, numPixels);
-	accumulated_buffer_b.resize(3, numPixels);
-	accumulated_buffer_a.setZero();
-	accumulated_buffer_b.setZero();
+	pixel_pending.setZero(1, raySlots);
+	window_pixel.resize(raySlots);
 
-	display_buffer.store(&accumulated_buffer_b);
-	display_sample_count.store(0);
-	currentSampleCount = 0;
+	activeRays.resize(N);
+	nextActiveRays.resize(N);
+	computeChunks(N);
+	selectWindow(0);
+}
 
-	computeChunks();
+size_t RayTracer::getRayStateBytes() const {
+	size_t bytes = (ray_origins.size() + ray_directions.size() + ray_colors.size() + t_distance.size()) * sizeof(float);
+	bytes += (ray_steps.size() + hit_type.size() + hit_object.size() + pixel_pending.size()) * sizeof(int);
+	bytes += (activeRays.capacity() + nextActiveRays.capacity() + window_pixel.capacity()) * sizeof(int);
+	return bytes;
+}
+
+void RayTracer::selectWindow(int firstTile) {
+	int numTiles = tiles.numTiles();
+	windowTileBegin = std::min(firstTile, numTiles);
+	windowTileEnd = std::min(windowTileBegin + 1, numTiles);
+	windowBegin = tiles.tileSlot(windowTileBegin);
+	while (windowTileEnd < numTiles && tiles.tileSlot(windowTileEnd + 1) - windowBegin <= raySlots)
+		windowTileEnd++;
+	windowEnd = tiles.tileSlot(windowTileEnd);
+
+	// Slot -> pixel for the window, so the per ray lookups don't search the tiles
+	pool.parallelFor(windowTileBegin, windowTileEnd, 1, [this](int start, int end) {
+		int width = tiles.getWidth();
+		for (int t = start; t < end; t++) {
+			const Tile& tile = tiles.tile(t);
+			int slot = tiles.tileSlot(t) - windowBegin;
+			for (int y = tile.y; y < tile.y + tile.height; y++)
+				for (int x = tile.x; x < tile.x + tile.width; x++)
+					window_pixel[slot++] = y * width + x;
+		}
+	});
+
+	if (!trackConvergence) {
+		activeBegin = 0;
+		activeEnd = windowEnd - windowBegin;
+		return;
+	}
+
+	// The list stays in slot order, so the window's active slots are one run of it
+	auto first = activeSlots.begin();
+	auto last = first + numActivePixels;
+	activeBegin = (int)(std::lower_bound(first, last, windowBegin) - first);
+	activeEnd = (int)(std::lower_bound(first + activeBegin, last, windowEnd) - first);
 }
 
 void RayTracer::setSampleCount(int samples) {
 	targetSampleCount = samples;
 }
 
-void RayTracer::computeChunks() {
+// Splits the first numItems entries of the active ray queue. Chunks hold about a tile's worth of rays (at least
+// NUM_CHUNKS of them), so on big images the pool gets many small tasks and an expensive region is spread thin
+void RayTracer::computeChunks(int numItems) {
+	int tileRays = std::max(tileSize * tileSize * passSamples, 1);
+	int numChunks = std::max(NUM_CHUNKS, (numItems + tileRays - 1) / tileRays);
+	chunkAlive.resize(numChunks);
+	chunkOffsets.resize(numChunks);
+
 	chunks.clear();
-	int raysPerThread = N / NUM_THREADS;
-	int remainder = N % NUM_THREADS;
+	int raysPerChunk = numItems / numChunks;
+	int remainder = numItems % numChunks;
 
 	int start = 0;
-	for (int i = 0; i < NUM_THREADS; i++) {
-		int chunkSize = raysPerThread + (i < remainder ? 1 : 0);
+	for (int i = 0; i < numChunks; i++) {
+		int chunkSize = raysPerChunk + (i < remainder ? 1 : 0);
 		chunks.push_back({start, start + chunkSize});
 		start += chunkSize;
 	}
 }
 
-void RayTracer::initializeRays(Renderer& r, int sampleIndex) {
-	ray_steps.setConstant(maxBounces);
-	ray_colors.setConstant(1.0f);
-	t_distance.setConstant(std::numeric_limits<float>::infinity()); // We use infinity so that ANY object hit will be closer
+void RayTracer::resetActiveRays() {
+	// A pixel's samples sit next to each other in the queue, they start out coherent
+	numActive = (activeEnd - activeBegin) * passSamples;
+	pool.parallelFor(0, numActive, numActive / NUM_CHUNKS + 1, [this](int start, int end) {
+		for (int k = start; k < end; k++)
+			activeRays[k] = rayIndex(activeSlot(k / passSamples), k % passSamples);
+	});
+	computeChunks(numActive);
+}
+
+void RayTracer::resetActivePixels() {
+	numActivePixels = numPixels;
+	trackConvergence = adaptiveThreshold > 0.0f;
+
+	if (!trackConvergence) {
+		// Every slot stays active, the lists would only count up
+		luminance_sq_sum.resize(1, 0);
+		pixel_converged.resize(1, 0);
+		std::vector<int>().swap(activeSlots);
+		std::vector<int>().swap(nextActiveSlots);
+		return;
+	}
+
+	luminance_sq_sum.setZero(1, numPixels);
+	pixel_converged.setZero(1, numPixels);
+	nextActiveSlots.resize(numPixels);
+
+	// Slot (tile) order, so the ray queue and every chunk of it walk the image in 2D patches
+	activeSlots.resize(numPixels);
+	std::iota(activeSlots.begin(), activeSlots.end(), 0);
+}
+
+static float luminance(const Eigen::Vector3f& color) {
+	return 0.2126f * color.x() + 0.7152f * color.y() + 0.0722f * color.z();
+}
 
-	Camera& cam = r.getCamera();
-	// cam.updateImagePlane((float)r.getWidth(), (float)r.getHeight());
+void RayTracer::updateConvergence(const AccumulationBuffer& accumulated, AccumulationBuffer& next) {
+	PROFILE_ZONE("updateConvergence");
+
+	// Error of the mean at 95% confidence, relative only above 1. The display is linear, so noise in a dark pixel
+	// shows as much as in a bright one, and chasing its relative error would sink samples into shadows
+	const float minLuminance = 1.0f;
+	auto converged = [&](int i) {
+		int n = accumulated.samples(i);
+		if (n < minAdaptiveSamples)
+			return false;
+
+		float mean = luminance(accumulated.color.col(i)) / (float)n;
+		float variance = std::max(0.0f, (luminance_sq_sum(i) - (float)n * mean * mean) / (float)(n - 1));
+		float error = 1.96f * std::sqrt(variance / (float)n);
+		return error <= adaptiveThreshold * std::max(mean, minLuminance);
+	};
+
+	// Same chunked compaction as compactActiveRays, over the pixel list (the bounce loop is done with chunkAlive/chunkOffsets)
+	auto chunkStart = [this](int c) { return (int)((long long)numActivePixels * c / NUM_CHUNKS); };
+	pool.parallelFor(0, NUM_CHUNKS, 1, [&](int start, int end) {
+		for (int c = start; c < end; c++) {
+			int alive = 0;
+			for (int k = chunkStart(c); k < chunkStart(c + 1); k++) {
+				int i = tiles.pixelAt(activeSlots[k]);
+				if (converged(i)) {
+					// Never accumulated again, so the other buffer needs its final value too
+					pixel_converged(i) = 1;
+					next.color.col(i) = accumulated.color.col(i);
+					next.samples(i) = accumulated.samples(i);
+				} else {
+					alive++;
+				}
+			}
+			chunkAlive[c] = alive;
+		}
+	});
 
-	// Transform savedCamTransform = cam.getSavedCamTransform();
-	// glm::vec3 origin = savedCamTransform.position;
-	// Eigen::Vector3f cameraOrigin(origin.x, origin.y, origin.z);
+	int total = 0;
+	for (int c = 0; c < NUM_CHUNKS; c++) {
+		chunkOffsets[c] = total;
+		total += chunkAlive[c];
+	}
 
-	Transform renderCamTransform = cam.getGhostMode() ? cam.getSavedCamTransform() : cam.getCamTransform();
-	glm::vec3 origin = renderCamTransform.position;
+	pool.parallelFor(0, NUM_CHUNKS, 1, [&](int start, int end) {
+		for (int c = start; c < end; c++) {
+			int out = chunkOffsets[c];
+			for (int k = chunkStart(c); k < chunkStart(c + 1); k++) {
+				int slot = activeSlots[k];
+				if (!pixel_converged(tiles.pixelAt(slot)))
+					nextActiveSlots[out++] = slot;
+			}
+		}
+	});
+
+	activeSlots.swap(nextActiveSlots);
+	numActivePixels = total;
+}
+
+void RayTracer::initializeRays(const RenderView& view, int sampleIndex, int numSamples) {
+	PROFILE_ZONE("initializeRays");
+
+	glm::vec3 origin = view.eye.position;
 	Eigen::Vector3f cameraOrigin(origin.x, origin.y, origin.z);
 
-	auto screenWidth = r.getWidth();
-	auto screenHeight = r.getHeight();
+	int screenWidth = view.width;
+	int screenHeight = view.height;
 
 	// Must have in case user resizes window
 	// Also not in glfw resize callback due to performance
@@ -88,185 +275,851 @@ void RayTracer::initializeRays(Renderer& r, int sampleIndex) {
 	if (requiredPixels != numPixels) {
 		resize(requiredPixels);
 	}
+	buildTiles(screenWidth, screenHeight);
 
-	auto plane = cam.getImagePlane();
+	const ImagePlane& plane = view.plane;
 	auto quadTopLeft = plane.topLeft();
 	float quadWorldWidth = plane.worldSpaceWidth();
 
-	// Offset each pixel to ensure ray is centered
-	float pixelWidth = quadWorldWidth / (float)screenWidth;
+	// Offset each pixel to ensure ray is centered. A region view spans part of a bigger image's plane
+	float pixelWidth = quadWorldWidth / (float)view.imageWidth();
+	regionX = view.regionX;
+	regionY = view.regionY;
+	regionImageWidth = view.fullWidth;
+
+	bool firstWindow = windowTileBegin == 0;
+	if (verbose && firstWindow)
+		std::cout << "Initializing rays for sample " << sampleIndex << std::endl;
+
+	passSamples = std::clamp(numSamples, 1, batchSize);
+
+	// Parallelize ray creation, only the window's pixels adaptive sampling hasn't retired get rays
+	int numRays = (activeEnd - activeBegin) * passSamples;
+	tile_pending.segment(windowTileBegin, windowTileEnd - windowTileBegin).setZero();
+	pool.parallelFor(0, numRays, numRays / NUM_CHUNKS + 1, [&](int start, int end) {
+		if (stopRequested())
+			return;
+
+		for (int k = start; k < end; k++) {
+			int slot = activeSlot(k / passSamples);
+			int pixelIndex = slotPixel(slot);
+			int subSample = k % passSamples;
+			int ray = rayIndex(slot, subSample);
+			int x = regionX + pixelIndex % screenWidth;
+			int y = regionY + pixelIndex / screenWidth;
+			int samplerKey = samplerPixel(pixelIndex);
+			if (subSample == 0) {
+				pixel_pending(slot - windowBegin) = passSamples;
+				std::atomic_ref<int>(tile_pending(tiles.tileOf(pixelIndex))).fetch_add(1, std::memory_order_relaxed);
+			}
 
-	// Parallelize ray creation
-	const unsigned int numThreads = std::thread::hardware_concurrency();
-	std::vector<std::thread> threads;
-	threads.reserve(numThreads);
+			// Pixel offset right and down
+			glm::vec3 offsetRight = plane.transform.right() * (pixelWidth * x);
+			glm::vec3 offsetDown = plane.transform.up() * (pixelWidth * y);
+			glm::vec3 pixelTopLeft = quadTopLeft + offsetRight - offsetDown;
 
-	// Create chunk to do work on per thread
-	int chunk = (screenWidth + numThreads - 1) / numThreads;
+			float randX, randY;
 
-	std::cout << "Initializing rays for sample " << sampleIndex << std::endl;
+			// If sample count is 1, send through center of pixel
+			if (targetSampleCount == 1) {
+				randX = 0.0f;
+				randY = 0.0f;
+			} else {
+				randX = sampleFloat(seed, samplerKey, sampleIndex + subSample, 0, DIM_PIXEL_X);
+				randY = sampleFloat(seed, samplerKey, sampleIndex + subSample, 0, DIM_PIXEL_Y);
+			}
 
-	for (unsigned int t = 0; t < numThreads; t++) {
-		int startX = t * chunk;
-		int endX = std::min(startX + chunk, screenWidth);
+			glm::vec3 sampleOffsetRight = plane.transform.right() * (pixelWidth * randX);
+			glm::vec3 sampleOffsetDown = plane.transform.up() * (pixelWidth * randY);
+			glm::vec3 posOnImagePlane = pixelTopLeft + sampleOffsetRight - sampleOffsetDown;
 
-		threads.emplace_back([=, this]() {
-			std::mt19937 rng_local(std::random_device{}());
-			std::uniform_real_distribution<float> dist_local(0.0f, 1.0f);
+			Eigen::Vector3f posEigen(posOnImagePlane.x, posOnImagePlane.y, posOnImagePlane.z);
 
-			for (int x = startX; x < endX; x++) {
+			ray_origins.col(ray) = posEigen;
+			ray_directions.col(ray) = (posEigen - cameraOrigin).normalized();
+			ray_colors.col(ray).setOnes();
+			ray_steps(0, ray) = maxBounces;
+			t_distance(ray) = std::numeric_limits<float>::infinity(); // We use infinity so that ANY object hit will be closer
+		}
+	});
 
-				// Pixel offset right
-				glm::vec3 offsetRight = plane.transform.right() * (pixelWidth * x);
+	if (verbose && firstWindow)
+		std::cout << "Done!" << std::endl;
+}
 
-				for (int y = 0; y < screenHeight; y++) {
+Eigen::Matrix<int, 3, Eigen::Dynamic> RayTracer::getAveragedColors() const {
+	Eigen::Matrix<int, 3, Eigen::Dynamic> averaged_colors;
+	getAveragedColors(averaged_colors);
+	return averaged_colors;
+}
 
-					// Pixel offset down
-					glm::vec3 offsetDown = plane.transform.up() * (pixelWidth * y);
-					glm::vec3 pixelTopLeft = quadTopLeft + offsetRight - offsetDown;
+void RayTracer::getAveragedColors(Eigen::Matrix<int, 3, Eigen::Dynamic>& averaged_colors) const {
+	PROFILE_ZONE("getAveragedColors");
+	averaged_colors.resize(3, numPixels);
 
-					int pixelIndex = x + y * screenWidth;
+	int samples = display_sample_count.load();
+	const AccumulationBuffer* buffer_to_read = display_buffer.load();
 
-					float randX, randY;
+	if (samples == 0 || buffer_to_read == nullptr) {
+		averaged_colors.setZero();
+		return;
+	}
 
-					// If sample count is 1, send through center of pixel
-					if (targetSampleCount == 1) {
-						randX = 0.0f;
-						randY = 0.0f;
-					} else {
-						randX = dist_local(rng_local);
-						randY = dist_local(rng_local);
-					}
+	FilmSettings settings = getFilm();
+	pool.parallelFor(0, numPixels, FILM_TILE, [&](int start, int end) { developRGB8(buffer_to_read->color, buffer_to_read->samples, start, end, settings, averaged_colors); });
+}
 
-					glm::vec3 sampleOffsetRight = plane.transform.right() * (pixelWidth * randX);
-					glm::vec3 sampleOffsetDown = plane.transform.up() * (pixelWidth * randY);
-					glm::vec3 posOnImagePlane = pixelTopLeft + sampleOffsetRight - sampleOffsetDown;
+bool RayTracer::setFilmScratch(const std::string& path) {
+	bool mapped = accumulated_buffer_a.setScratch(path, numPixels);
+	accumulated_buffer_b.reset(accumulated_buffer_a.isMapped() ? 0 : numPixels);
+	display_buffer.store(secondBuffer());
+	display_sample_count.store(0);
+	return mapped;
+}
 
-					Eigen::Vector3f posEigen(posOnImagePlane.x, posOnImagePlane.y, posOnImagePlane.z);
+FilmSettings RayTracer::getFilm() const {
+	std::lock_guard<std::mutex> lock(resolveMutex);
+	return film;
+}
 
-					ray_origins.col(pixelIndex) = posEigen;
-					ray_directions.col(pixelIndex) = (posEigen - cameraOrigin).normalized();
-				}
-			}
-		});
+void RayTracer::setFilm(const FilmSettings& settings) {
+	{
+		std::lock_guard<std::mutex> lock(resolveMutex);
+		film = settings;
 	}
+	if (resolveEnabled && display_sample_count.load() > 0)
+		resolveDisplay();
+}
 
-	// Wait for all threads to finish
-	for (auto& th : threads)
-		th.join();
+void RayTracer::resolveDisplay() {
+	PROFILE_ZONE("resolveDisplay");
+	std::lock_guard<std::mutex> resolveLock(resolveMutex);
 
-	std::cout << "Done!" << std::endl;
-}
+	const AccumulationBuffer* buffer = display_buffer.load();
+	display_rgba_back.resize(numPixels); // Only allocates when the image size changes
 
-Eigen::Matrix<int, 3, Eigen::Dynamic> RayTracer::getAveragedColors() const {
-	Eigen::Matrix<int, 3, Eigen::Dynamic> averaged_colors(3, numPixels);
+	pool.parallelFor(0, numPixels, FILM_TILE, [&](int start, int end) { developRGBA8(buffer->color, buffer->samples, start, end, film, display_rgba_back.data()); });
 
-	int samples = display_sample_count.load();
-	const Eigen::Matrix<float, 3, Eigen::Dynamic>* buffer_to_read = display_buffer.load();
+	std::lock_guard<std::mutex> lock(displayMutex);
+	display_rgba_front.swap(display_rgba_back);
+	displayVersion.fetch_add(1, std::memory_order_release);
+}
 
-	if (samples == 0 || buffer_to_read == nullptr) {
-		averaged_colors.setZero();
-		return averaged_colors;
+// Develops pixels [x, x + count) of row y the way out stores them, then writes them
+static bool streamSpan(ImageStream& out, const AccumulationBuffer& buffer, const FilmSettings& settings, int x, int y, int count, std::vector<char>& scratch) {
+	int start = y * out.getWidth() + x;
+	if (out.isFloat()) {
+		scratch.resize((size_t)count * 3 * sizeof(float));
+		developLinear(buffer.color, buffer.samples, start, start + count, settings, reinterpret_cast<float*>(scratch.data()));
+	} else {
+		scratch.resize((size_t)count * 3);
+		developRGB8Packed(buffer.color, buffer.samples, start, start + count, settings, reinterpret_cast<uint8_t*>(scratch.data()));
 	}
+	return out.writeSpan(x, y, count, scratch.data());
+}
+
+bool RayTracer::writeImage(ImageStream& out) const {
+	PROFILE_ZONE("writeImage");
+	const AccumulationBuffer* buffer = display_buffer.load();
+	if ((long long)out.getWidth() * out.getHeight() != numPixels || buffer->samples.size() != numPixels)
+		return false;
+
+	FilmSettings settings = getFilm();
+	std::atomic<bool> written{true};
+
+	// Row by row, only a row per task is ever developed in memory
+	pool.parallelFor(0, out.getHeight(), 1, [&](int start, int end) {
+		std::vector<char> scratch;
+		for (int y = start; y < end; y++)
+			if (!streamSpan(out, *buffer, settings, 0, y, out.getWidth(), scratch))
+				written = false;
+	});
+	return written;
+}
 
-	for (int pixelIdx = 0; pixelIdx < numPixels; pixelIdx++) {
-		Eigen::Vector3f avgColor = ((*buffer_to_read).col(pixelIdx) / (float)samples) * 255.0f;
-		averaged_colors.col(pixelIdx) = avgColor.cast<int>();
+bool RayTracer::writeTile(ImageStream& out, const Tile& tile) const {
+	// From the tile callback the pass's buffer has the tile's latest samples, the display only gets it after the pass
+	const AccumulationBuffer* buffer = passTarget ? passTarget : display_buffer.load();
+	FilmSettings settings = passTarget ? passFilm : getFilm();
+	if ((long long)out.getWidth() * out.getHeight() != numPixels || buffer->samples.size() != numPixels)
+		return false;
+
+	std::vector<char> scratch;
+	bool written = true;
+	for (int y = tile.y; y < tile.y + tile.height; y++)
+		written &= streamSpan(out, *buffer, settings, tile.x, y, tile.width, scratch);
+	return written;
+}
+
+void RayTracer::mergeRegion(int imageWidth, const Tile& region, const float* color, const int* samples) {
+	PROFILE_ZONE("mergeRegion");
+	AccumulationBuffer& target = *secondBuffer();
+	for (int row = 0; row < region.height; row++) {
+		int dst = (region.y + row) * imageWidth + region.x;
+		int src = row * region.width;
+		for (int col = 0; col < region.width; col++) {
+			target.color.col(dst + col) += Eigen::Map<const Eigen::Vector3f>(color + 3 * (src + col));
+			target.samples(dst + col) += samples[src + col];
+		}
 	}
 
-	return averaged_colors;
+	display_buffer.store(&target);
+	display_sample_count.store(targetSampleCount);
 }
 
-void RayTracer::traceAllAsync(const std::vector<Shape*>& worldObjects, Renderer& renderer) {
+bool RayTracer::copyDisplayRGBA8(uint32_t* pixels, int numTexels, uint64_t& version) const {
+	std::lock_guard<std::mutex> lock(displayMutex);
+
+	uint64_t latest = displayVersion.load(std::memory_order_relaxed);
+	if (latest == version || (int)display_rgba_front.size() != numTexels)
+		return false;
+
+	std::copy(display_rgba_front.begin(), display_rgba_front.end(), pixels);
+	version = latest;
+	return true;
+}
+
+void RayTracer::traceAllAsync(const std::vector<Shape*>& worldObjects, const RenderView& view) {
 	// We don't want trace if it's already tracing
 	if (isTracing())
 		return;
 
+	// Own thread so we can see it real-time (view is copied, the camera may move meanwhile)
+	startJob([this, &worldObjects, view](std::stop_token stop) { traceAll(worldObjects, view, stop); });
+}
+
+void RayTracer::restartAsync(const std::vector<Shape*>& worldObjects, const RenderView& view) {
+	cancel();
+	startJob([this, &worldObjects, view](std::stop_token stop) { traceAll(worldObjects, view, stop); });
+}
+
+void RayTracer::restartAsync(const RenderView& view) {
+	cancel();
+	startJob([this, view](std::stop_token stop) { traceAll(view, stop); });
+}
+
+void RayTracer::cancel() {
+	if (!renderJob.joinable())
+		return;
+
+	PROFILE_ZONE("cancel");
+	renderJob.request_stop();
+	renderJob.join();
+}
+
+void RayTracer::startJob(std::function<void(std::stop_token)> job) {
+	cancel(); // Also joins a job that already finished on its own
+
 	tracing = true;
+	renderJob = std::jthread([this, job = std::move(job)](std::stop_token stop) {
+		job(stop);
+		tracing = false;
+	});
+}
 
-	// Start in own separate thread so we can see it real-time
-	std::thread([this, &worldObjects, &renderer]() {
-		// Reset buffer states
-		accumulated_buffer_a.setZero();
-		accumulated_buffer_b.setZero();
-		currentSampleCount = 0;
-
-		Eigen::Matrix<float, 3, Eigen::Dynamic>* current_write_ptr = &accumulated_buffer_a;
-		const Eigen::Matrix<float, 3, Eigen::Dynamic>* current_read_ptr = &accumulated_buffer_b;
-
-		// Init
-		display_buffer.store(current_read_ptr);
-		display_sample_count.store(0);
-
-		// Sequential anti aliasing
-		for (int sample = 0; sample < targetSampleCount; sample++) {
-			initializeRays(renderer, sample);
-
-			// Bounces
-			for (int bounce = 0; bounce < maxBounces; bounce++) {
-				for (int i = 0; i < N; i++) {
-					if (ray_steps(0, i) > 0) {
-						t_distance(i) = std::numeric_limits<float>::infinity();
-					}
-				}
+void RayTracer::traceAll(const std::vector<Shape*>& worldObjects, const RenderView& view, std::stop_token stop) {
+	// Scene doesn't change during a render
+	buildAccelerationStructure(worldObjects);
+	traceAll(view, stop);
+}
 
-				std::vector<std::thread> threads;
-				for (int i = 0; i < NUM_THREADS; i++) {
-					threads.emplace_back(&RayTracer::traceChunk, this, i, worldObjects);
-				}
-				for (auto& t : threads) {
-					t.join();
-				}
+void RayTracer::traceAll(const RenderView& view, std::stop_token stop) {
+	stopToken = stop;
 
-				for (int i = 0; i < N; i++) {
-					if (ray_steps(0, i) > 0 && t_distance(i) == std::numeric_limits<float>::infinity()) {
-						Eigen::Vector3f dir = ray_directions.col(i).normalized();
-						float t = 0.5f * (dir.y() + 1.0f);
+	if (view.numPixels() != numPixels)
+		resize(view.numPixels());
 
-						// Simple sky gradient
-						Eigen::Vector3f sky_color = (1.0f - t) * Eigen::Vector3f(1.0f, 1.0f, 1.0f) + t * Eigen::Vector3f(0.5f, 0.7f, 1.0f);
+	// Batch or budget may have changed since the buffers were sized
+	int batch, slots;
+	budgetShape(batch, slots);
+	if (batch != batchSize || slots != raySlots)
+		allocateRays();
 
-						ray_colors.col(i) = ray_colors.col(i).cwiseProduct(sky_color);
-						ray_steps(0, i) = 0;
-					}
-				}
+	// Ray queue goes tile by tile
+	buildTiles(view.width, view.height);
+
+	lastStats = RenderStats{};
+	lastStats.buildSeconds = sceneSeconds;
+	auto traceStart = std::chrono::steady_clock::now();
+
+	// Reset buffer states
+	accumulated_buffer_a.reset(numPixels);
+	accumulated_buffer_b.reset(accumulated_buffer_a.isMapped() ? 0 : numPixels);
+	currentSampleCount = 0;
+	resetActivePixels();
+	if (resumeFile.isOpen())
+		restoreCheckpoint();
+
+	if (!checkpointPath.empty())
+		checkpointKeyValue = checkpointKey(view);
+	auto lastCheckpoint = std::chrono::steady_clock::now();
+
+	AccumulationBuffer* current_write_ptr = &accumulated_buffer_a;
+	AccumulationBuffer* current_read_ptr = secondBuffer();
+
+	// Init
+	display_buffer.store(current_read_ptr);
+	display_sample_count.store(currentSampleCount);
+	lastStats.samples = currentSampleCount;
+	lastStats.convergedPixels = numPixels - numActivePixels;
+
+	// Sequential anti aliasing, a batch of samples per pass
+	for (int sample = currentSampleCount; sample < targetSampleCount; sample += passSamples) {
+		// Every pixel converged, nothing left to trace
+		if (numActivePixels == 0 || stopRequested())
+			break;
+
+		PROFILE_CONTEXT(sample, -1);
+		PROFILE_ZONE("sample");
+
+		auto sampleStart = std::chrono::steady_clock::now();
+		long long raySegments = 0;
+		nodesVisited = 0;
+
+		// Paths get accumulated by the chunk that finishes them, tiles get resolved as they complete
+		passTarget = current_write_ptr;
+		passSource = current_read_ptr;
+		passFilm = getFilm();
+
+		// Window by window through the same ray buffers, just one unless the image is over the ray budget
+		for (int firstTile = 0; firstTile < tiles.numTiles() && !stopRequested(); firstTile = windowTileEnd) {
+			selectWindow(firstTile);
+			if (activeBegin != activeEnd) // Skips windows adaptive sampling has retired entirely
+				raySegments += traceWindow(view, sample);
+		}
+
+		passTarget = nullptr;
+		passSource = nullptr;
+
+		// A cancelled pass is half traced (and half accumulated), the display keeps the last finished one
+		if (stopRequested())
+			break;
+
+		PROFILE_CONTEXT(sample, -1);
+		currentSampleCount += passSamples;
+
+		if (trackConvergence)
+			updateConvergence(*current_write_ptr, *current_read_ptr);
+
+		// The display image already got every tile of this pass as it finished
+		display_buffer.store(current_write_ptr);
+		display_sample_count.store(currentSampleCount);
+
+		bool lastPass = currentSampleCount >= targetSampleCount || numActivePixels == 0;
+		if (!checkpointPath.empty() && (lastPass || std::chrono::duration<double>(std::chrono::steady_clock::now() - lastCheckpoint).count() >= checkpointInterval)) {
+			writeCheckpoint(view, *current_write_ptr);
+			lastCheckpoint = std::chrono::steady_clock::now();
+		}
+
+		// Swap pointers for the next pass
+		std::swap(current_write_ptr, current_read_ptr);
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - sampleStart).count();
+		raysPerSecond = seconds > 0.0 ? (double)raySegments / seconds : 0.0;
+		avgNodesVisited = useBVH && raySegments > 0 ? (double)nodesVisited / (double)raySegments : 0.0;
+
+		lastStats.raySegments += raySegments;
+		lastStats.samples = currentSampleCount;
+		lastStats.passes++;
+		lastStats.convergedPixels = numPixels - numActivePixels;
+
+		if (verbose)
+			std::cout << "Completed sample " << currentSampleCount << " (" << raysPerSecond / 1e6 << " Mrays/s, " << avgNodesVisited << " BVH nodes/ray, "
+			          << numActivePixels << " pixels active)" << std::endl;
+	}
+
+	lastStats.traceSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - traceStart).count();
+	stopToken = {};
+	selectWindow(0);
+	PROFILE_CONTEXT(-1, -1);
+}
+
+long long RayTracer::traceWindow(const RenderView& view, int sample) {
+	initializeRays(view, sample, targetSampleCount - sample);
+	if (stopRequested())
+		return 0;
+
+	// Every ray starts out alive
+	resetActiveRays();
+	int liveRays = numActive;
+	long long raySegments = 0;
+
+	// Bounces
+	for (int bounce = 0; bounce < maxBounces; bounce++) {
+		PROFILE_CONTEXT(sample, bounce);
+		PROFILE_ZONE("bounce");
+
+		raySegments += liveRays;
+		computeChunks(numActive);
+
+		// One task per chunk does the whole bounce, cancelled chunks are skipped and the pass gets thrown away
+		pool.parallelFor(0, (int)chunks.size(), 1, [this](int start, int end) {
+			for (int c = start; c < end && !stopRequested(); c++)
+				bounceChunk(c);
+		});
+
+		if (stopRequested())
+			break;
+
+		liveRays = 0;
+		for (int c = 0; c < (int)chunks.size(); c++)
+			liveRays += chunkAlive[c];
+
+		// Check if all rays are done
+		if (liveRays == 0)
+			break;
+
+		// Drop dead rays so the next bounce only touches live ones
+		if (wavefront)
+			compactActiveRays();
+	}
 
-				// Check if all rays are done
-				if (ray_steps.isZero())
-					break;
+	return raySegments;
+}
+
+void RayTracer::buildAccelerationStructure(const std::vector<Shape*>& worldObjects) {
+	PROFILE_ZONE("buildAccelerationStructure");
+	auto start = std::chrono::steady_clock::now();
+
+	// Only place we look at concrete Shape types, the kernels work on the flat arrays
+	scene.build(worldObjects);
+	sceneSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (!verbose)
+		return;
+
+	std::cout << "Intersection kernel: " << (useBVH ? simdLevelName(simdLevel) : "brute force") << std::endl;
+	scene.printStats();
+}
+
+bool RayTracer::loadScene(const std::string& path, uint64_t key) {
+	PROFILE_ZONE("loadScene");
+	auto start = std::chrono::steady_clock::now();
+
+	bool loaded = loadSceneCache(path, scene, key);
+	sceneSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (!loaded || !verbose)
+		return loaded;
+
+	std::cout << "Loaded scene cache " << path << " in " << sceneSeconds * 1000.0 << " ms" << std::endl;
+	std::cout << "Intersection kernel: " << (useBVH ? simdLevelName(simdLevel) : "brute force") << std::endl;
+	scene.printStats();
+	return true;
+}
+
+bool RayTracer::saveScene(const std::string& path, uint64_t key) const {
+	return saveSceneCache(path, scene, key);
+}
+
+void RayTracer::setCheckpoint(const std::string& path, double intervalSeconds) {
+	checkpointPath = path;
+	checkpointInterval = std::max(intervalSeconds, 0.0);
+}
+
+uint64_t RayTracer::checkpointKey(const RenderView& view) const {
+	PROFILE_ZONE("checkpointKey");
+	SceneCacheKey key;
+
+	// The scene as traced, primitive by primitive
+	auto addArray = [&](const auto& prims) {
+		key.add((uint64_t)prims.size());
+		key.add(prims.data(), prims.size() * sizeof(prims[0]));
+	};
+	addArray(scene.spheres);
+	addArray(scene.triangles);
+	addArray(scene.positions);
+	addArray(scene.quads);
+	addArray(scene.boxes);
+	addArray(scene.planes);
+
+	// Where every pixel's rays start and aim (see initializeRays)
+	auto addVector = [&](const glm::vec3& v) {
+		key.add(v.x);
+		key.add(v.y);
+		key.add(v.z);
+	};
+	addVector(view.eye.position);
+	addVector(view.plane.topLeft());
+	addVector(view.plane.transform.right());
+	addVector(view.plane.transform.up());
+	key.add(view.plane.worldSpaceWidth());
+	key.add(view.width);
+	key.add(view.height);
+	key.add(view.regionX);
+	key.add(view.regionY);
+	key.add(view.imageWidth());
+	key.add(view.imageHeight());
+
+	// What the paths do with their samples
+	key.add(seed);
+	key.add(maxBounces);
+	key.add(rouletteDepth);
+	key.add(adaptiveThreshold > 0.0f);
+	return key.value();
+}
+
+bool RayTracer::resumeFrom(const std::string& path, const RenderView& view) {
+	PROFILE_ZONE("resumeFrom");
+	if (!loadCheckpoint(path, checkpointKey(view), resumeFile, resumeState, resumeArrays)) {
+		resumeFile.close();
+		return false;
+	}
+
+	if (verbose)
+		std::cout << "Resuming from checkpoint " << path << " at sample " << resumeState.samples << std::endl;
+	return true;
+}
+
+void RayTracer::restoreCheckpoint() {
+	PROFILE_ZONE("restoreCheckpoint");
+
+	// Settings changed since resumeFrom(), the film would be of a different render
+	if ((long long)resumeState.width * resumeState.height != numPixels || resumeState.adaptive != trackConvergence) {
+		std::cerr << "Checkpoint doesn't match this render, starting over" << std::endl;
+		resumeFile.close();
+		return;
+	}
+
+	// Both sides of the double buffer, a pass adds to one and writes the other
+	Eigen::Map<const Eigen::Matrix<float, 3, Eigen::Dynamic>> color(resumeArrays.color, 3, numPixels);
+	Eigen::Map<const Eigen::Array<int, 1, Eigen::Dynamic>> samples(resumeArrays.samples, 1, numPixels);
+	for (AccumulationBuffer* buffer : {&accumulated_buffer_a, &accumulated_buffer_b}) {
+		if (buffer->samples.size() == numPixels) {
+			buffer->color = color;
+			buffer->samples = samples;
+		}
+	}
+	currentSampleCount = resumeState.samples;
+
+	if (trackConvergence) {
+		luminance_sq_sum = Eigen::Map<const Eigen::Array<float, 1, Eigen::Dynamic>>(resumeArrays.luminanceSq, 1, numPixels);
+		pixel_converged = Eigen::Map<const Eigen::Array<uint8_t, 1, Eigen::Dynamic>>(resumeArrays.converged, 1, numPixels);
+
+		// Converged pixels leave the slot list, the rest keep their order
+		numActivePixels = 0;
+		for (int slot = 0; slot < numPixels; slot++)
+			if (!pixel_converged(tiles.pixelAt(slot)))
+				activeSlots[numActivePixels++] = slot;
+	}
+
+	resumeFile.close();
+}
+
+void RayTracer::writeCheckpoint(const RenderView& view, const AccumulationBuffer& accumulated) const {
+	PROFILE_ZONE("writeCheckpoint");
+
+	CheckpointState state;
+	state.key = checkpointKeyValue;
+	state.width = view.width;
+	state.height = view.height;
+	state.samples = currentSampleCount;
+	state.adaptive = trackConvergence;
+
+	CheckpointArrays arrays;
+	arrays.color = accumulated.color.data();
+	arrays.samples = accumulated.samples.data();
+	if (trackConvergence) {
+		arrays.luminanceSq = luminance_sq_sum.data();
+		arrays.converged = pixel_converged.data();
+	}
+
+	// A failed save keeps the previous checkpoint, the render goes on either way
+	if (saveCheckpoint(checkpointPath, state, arrays) && verbose)
+		std::cout << "Checkpoint " << checkpointPath << " at sample " << currentSampleCount << std::endl;
+}
+
+void RayTracer::traceChunk(int chunkIndex) {
+	PROFILE_ZONE("traceChunk", chunkIndex);
+
+	if (!useBVH) {
+		for (int s = 0; s < (int)scene.spheres.size(); s++)
+			intersectSphere(s, chunkIndex);
+		for (int t = 0; t < (int)scene.triangles.size(); t++)
+			intersectTriangle(t, chunkIndex);
+		for (int q = 0; q < (int)scene.quads.size(); q++)
+			intersectSquare(q, chunkIndex);
+		for (int b = 0; b < (int)scene.boxes.size(); b++)
+			intersectBox(b, chunkIndex);
+		for (int p = 0; p < (int)scene.planes.size(); p++)
+			intersectPlane(p, chunkIndex);
+		return;
+	}
+
+	if (simdLevel != SimdLevel::Scalar) {
+		traceChunkPackets(chunkIndex);
+		return;
+	}
+
+	const ThreadChunk& chunk = chunks[chunkIndex];
+	long long visited = 0;
+
+	for (int k = chunk.start; k < chunk.end; k++) {
+		int i = activeRays[k];
+		if (ray_steps(0, i) == 0)
+			continue;
+
+		float tClosest = t_distance(i);
+		PrimType type = PrimType::Sphere;
+		int index = -1;
+
+		visited += scene.intersect(ray_origins.col(i), ray_directions.col(i), tClosest, type, index);
+
+		t_distance(i) = tClosest;
+		hit_type(i) = (int)type;
+		hit_object(i) = index;
+	}
+
+	nodesVisited += visited;
+}
+
+void RayTracer::traceChunkPackets(int chunkIndex) {
+	const ThreadChunk& chunk = chunks[chunkIndex];
+	long long visited = 0;
+
+	RayPacket packet;
+	int rayIndices[RayPacket::SIZE];
+
+	auto flush = [&]() {
+		visited += (long long)traversePacket(simdLevel, packet, scene.sphereBVH, scene.sphereSoA) * packet.count;
+
+		for (int lane = 0; lane < packet.count; lane++) {
+			int i = rayIndices[lane];
+			float tClosest = packet.tHit[lane];
+			PrimType type = PrimType::Sphere;
+			int index = packet.hitIndex[lane];
+
+			// Flat geometry goes through the per-ray path
+			visited += scene.intersect(ray_origins.col(i), ray_directions.col(i), tClosest, type, index, false);
+
+			t_distance(i) = tClosest;
+			hit_type(i) = (int)type;
+			hit_object(i) = index;
+		}
+		packet.clear();
+	};
+
+	// Gather the live rays of the chunk into packets (our 3xN layout isn't lane friendly)
+	packet.clear();
+	for (int k = chunk.start; k < chunk.end; k++) {
+		int i = activeRays[k];
+		if (ray_steps(0, i) == 0)
+			continue;
+
+		rayIndices[packet.count] = i;
+		packet.add(ray_origins.col(i), ray_directions.col(i), t_distance(i));
+		if (packet.count == RayPacket::SIZE)
+			flush();
+	}
+	if (packet.count > 0)
+		flush();
+
+	nodesVisited += visited;
+}
+
+void RayTracer::compactActiveRays() {
+	PROFILE_ZONE("compactActiveRays");
+
+	// Exclusive prefix sum over the per chunk survivor counts from shadeChunk
+	int numChunks = (int)chunks.size();
+	int total = 0;
+	for (int c = 0; c < numChunks; c++) {
+		chunkOffsets[c] = total;
+		total += chunkAlive[c];
+	}
+
+	// Chunks scatter their survivors in parallel, order is kept so rays stay roughly coherent
+	pool.parallelFor(0, numChunks, 1, [this](int start, int end) {
+		for (int c = start; c < end; c++) {
+			const ThreadChunk& chunk = chunks[c];
+			int out = chunkOffsets[c];
+			for (int k = chunk.start; k < chunk.end; k++) {
+				int i = activeRays[k];
+				if (ray_steps(0, i) > 0)
+					nextActiveRays[out++] = i;
 			}
+		}
+	});
+
+	activeRays.swap(nextActiveRays);
+	numActive = total;
+}
+
+void RayTracer::resetChunk(int chunkIndex) {
+	const ThreadChunk& chunk = chunks[chunkIndex];
+
+	for (int k = chunk.start; k < chunk.end; k++) {
+		int i = activeRays[k];
+		if (ray_steps(0, i) > 0) {
+			t_distance(i) = std::numeric_limits<float>::infinity();
+			hit_object(i) = -1;
+		}
+	}
+}
 
-			// Accumulate sample
-			for (int i = 0; i < numPixels; ++i) {
-				(*current_write_ptr).col(i) = (*current_read_ptr).col(i) + ray_colors.col(i).cast<float>();
+int RayTracer::shadeChunk(int chunkIndex) {
+	PROFILE_ZONE("shadeChunk", chunkIndex);
+
+	const ThreadChunk& chunk = chunks[chunkIndex];
+	int alive = 0;
+
+	for (int k = chunk.start; k < chunk.end; k++) {
+		int i = activeRays[k];
+		if (ray_steps(0, i) == 0)
+			continue;
+
+		if (hit_object(i) < 0) {
+			Eigen::Vector3f dir = ray_directions.col(i).normalized();
+			float t = 0.5f * (dir.y() + 1.0f);
+
+			// Simple sky gradient
+			Eigen::Vector3f sky_color = (1.0f - t) * Eigen::Vector3f(1.0f, 1.0f, 1.0f) + t * Eigen::Vector3f(0.5f, 0.7f, 1.0f);
+
+			ray_colors.col(i) = ray_colors.col(i).cwiseProduct(sky_color);
+			ray_steps(0, i) = 0;
+			if (passTarget)
+				finishRay(i);
+			continue;
+		}
+
+		Eigen::Vector3f hit_point = ray_origins.col(i) + t_distance(i) * ray_directions.col(i);
+		Eigen::Vector3f N;
+		Material material;
+		scene.surfaceAt((PrimType)hit_type(i), hit_object(i), hit_point, ray_directions.col(i), N, material);
+
+		switch (material) {
+		case Material::DIFFUSE: {
+			// Uniform direction on the sphere, keyed by this path vertex
+			int bounce = maxBounces - ray_steps(0, i);
+			int pixel = samplerPixel(slotPixel(raySlot(i)));
+			int sample = currentSampleCount + i / raySlots;
+			float u = sampleFloat(seed, pixel, sample, bounce, DIM_BOUNCE_U);
+			float v = sampleFloat(seed, pixel, sample, bounce, DIM_BOUNCE_V);
+
+			float z = 1.0f - 2.0f * u;
+			float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+			float phi = 2.0f * std::numbers::pi_v<float> * v;
+			Eigen::Vector3f unit_vec(r * std::cos(phi), r * std::sin(phi), z);
+
+			if (unit_vec.dot(N) < 0.0f) {
+				unit_vec = -unit_vec;
 			}
-			currentSampleCount++;
 
-			display_buffer.store(current_write_ptr);
-			display_sample_count.store(currentSampleCount);
+			ray_origins.col(i) = hit_point;
+			ray_directions.col(i) = unit_vec;
+
+			ray_colors.col(i) *= 0.5f;
 
-			// Swap pointers for the next pass
-			std::swap(current_write_ptr, *const_cast<Eigen::Matrix<float, 3, Eigen::Dynamic>**>(&current_read_ptr));
+			ray_steps(0, i) = ray_steps(0, i) - 1;
 
-			std::cout << "Completed sample " << currentSampleCount << std::endl;
+			// Russian roulette: past the minimum depth a path survives with probability equal to its throughput
+			// and survivors are scaled up by 1 / p, so dim paths end early without biasing the estimate
+			if (bounce + 1 >= rouletteDepth && ray_steps(0, i) > 0) {
+				float survival = std::min(1.0f, ray_colors.col(i).maxCoeff());
+				if (sampleFloat(seed, pixel, sample, bounce, DIM_ROULETTE) >= survival) {
+					ray_colors.col(i).setZero();
+					ray_steps(0, i) = 0;
+				} else {
+					ray_colors.col(i) /= survival;
+				}
+			}
+			break;
 		}
+		default: { // Normal
+			ray_colors.col(i) = (N + Eigen::Vector3f::Ones()) * 0.5f;
+			ray_steps(0, i) = 0;
+			break;
+		}
+		};
 
-		tracing = false;
-	}).detach();
+		if (ray_steps(0, i) > 0)
+			alive++;
+		else if (passTarget)
+			finishRay(i);
+	}
+
+	return alive;
 }
 
-void RayTracer::traceChunk(int chunkIndex, const std::vector<Shape*>& worldObjects) {
-	// const ThreadChunk& chunk = chunks[chunkIndex];
+void RayTracer::bounceChunk(int chunkIndex) {
+	resetChunk(chunkIndex);
+	traceChunk(chunkIndex);
+	chunkAlive[chunkIndex] = shadeChunk(chunkIndex);
+}
+
+void RayTracer::finishRay(int ray) {
+	int slot = raySlot(ray);
+
+	// acq_rel: the last ray to finish sees the colors the pixel's other rays wrote
+	if (passSamples > 1 && std::atomic_ref<int>(pixel_pending(slot - windowBegin)).fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
 
-	for (Shape* object : worldObjects) {
-		// Check if Sphere class (I wonder if there's a better way to do this?)
-		if (const Sphere* sphere = dynamic_cast<const Sphere*>(object)) {
-			intersectSphere(*sphere, chunkIndex);
+	accumulateSlot(slot, *passTarget, *passSource);
+
+	int tile = tiles.tileOf(slotPixel(slot));
+	if (std::atomic_ref<int>(tile_pending(tile)).fetch_sub(1, std::memory_order_acq_rel) == 1)
+		finishTile(tile);
+}
+
+void RayTracer::buildTiles(int width, int height) {
+	if (tiles.getWidth() == width && tiles.getHeight() == height && tiles.getTileSize() == tileSize && tiles.getOrder() == tileOrder)
+		return;
+
+	tiles.build(width, height, tileSize, tileOrder);
+	tile_pending.setZero(1, tiles.numTiles());
+
+	// The queue order changed with it, and a new tile size may change the window size
+	resetActivePixels();
+	allocateRays();
+}
+
+void RayTracer::finishTile(int tileIndex) {
+	const Tile& tile = tiles.tile(tileIndex);
+	if (resolveEnabled)
+		resolveTile(tile);
+	if (tileCallback)
+		tileCallback(tile, currentSampleCount + passSamples);
+}
+
+void RayTracer::resolveTile(const Tile& tile) {
+	PROFILE_ZONE("resolveTile");
+	int width = tiles.getWidth();
+
+	// Small enough to develop under the lock, readers wait a few microseconds at most
+	std::lock_guard<std::mutex> lock(displayMutex);
+	if ((int)display_rgba_front.size() != numPixels)
+		display_rgba_front.assign(numPixels, 0xFF000000u); // Black until its tile lands
+
+	for (int y = tile.y; y < tile.y + tile.height; y++) {
+		int rowStart = y * width + tile.x;
+		developRGBA8(passTarget->color, passTarget->samples, rowStart, rowStart + tile.width, passFilm, display_rgba_front.data());
+	}
+	displayVersion.fetch_add(1, std::memory_order_release);
+}
+
+void RayTracer::accumulateSlot(int slot, AccumulationBuffer& dst, const AccumulationBuffer& src) {
+	int pixel = slotPixel(slot);
+
+	// Sample by sample in order, so the sums don't depend on the batch size
+	Eigen::Vector3f sum = src.color.col(pixel);
+	float luminanceSq = trackConvergence ? luminance_sq_sum(pixel) : 0.0f;
+	for (int s = 0; s < passSamples; s++) {
+		int ray = rayIndex(slot, s);
+		sum += ray_colors.col(ray);
+
+		if (trackConvergence) {
+			float l = luminance(ray_colors.col(ray));
+			luminanceSq += l * l;
 		}
-		// if (const Square* square = dynamic_cast<const Square*>(object)) {
-		//	intersectSquare(*square, chunkIndex);
-		// }
 	}
+	dst.color.col(pixel) = sum;
+	dst.samples(pixel) = src.samples(pixel) + passSamples;
+	if (trackConvergence)
+		luminance_sq_sum(pixel) = luminanceSq;
+}
+
+void RayTracer::accumulateRange(int start, int end, AccumulationBuffer& dst, const AccumulationBuffer& src) {
+	for (int slot = start; slot < end; ++slot)
+		accumulateSlot(slot, dst, src);
 }
 
 void RayTracer::traceStep() {
@@ -291,71 +1144,48 @@ void RayTracer::traceStep() {
 	// }
 }
 
-// TODO: Vectorize / use matrix math instead of per ray calculations
-void RayTracer::intersectSphere(const Sphere& sphere, int chunkIndex) {
-	std::mt19937 rng_local(std::random_device{}());
-	std::uniform_real_distribution<float> dist_local(-1.0f, 1.0f);
-
+// Brute force references for the BVH path, they only record the closest hit (shading happens in shadeChunk)
+template <typename IntersectFunc>
+void RayTracer::intersectChunk(PrimType type, int primIndex, int chunkIndex, IntersectFunc&& intersect) {
 	const ThreadChunk& chunk = chunks[chunkIndex];
 
-	Eigen::Vector3f sphere_center(sphere.position.x, sphere.position.y, sphere.position.z);
-	float sphere_radius_sq = sphere.radius * sphere.radius;
-
-	for (int i = chunk.start; i < chunk.end; ++i) {
+	for (int k = chunk.start; k < chunk.end; ++k) {
+		int i = activeRays[k];
 		if (ray_steps(0, i) == 0) {
 			continue;
 		}
 
-		// Fake delay so I can debug
-		// std::this_thread::sleep_for(std::chrono::microseconds(1));
-
-		Eigen::Vector3f oc = ray_origins.col(i) - sphere_center;
-		float a = ray_directions.col(i).squaredNorm();
-		float half_b = ray_directions.col(i).dot(oc);
-		float c = oc.squaredNorm() - sphere_radius_sq;
-		float discriminant = half_b * half_b - a * c;
-
-		if (discriminant > 0) {
-			float root = std::sqrt(discriminant);
-			float t = (-half_b - root) / a; // Distance from ray origin
-
-			// If hit is in front of camera AND If hit object behind another, we don't care
-			if (t > 0.001f && t < t_distance(i)) {
-				t_distance(i) = t; // Update closest hit
-				Eigen::Vector3f hit_point = ray_origins.col(i) + t * ray_directions.col(i);
-				Eigen::Vector3f N = (hit_point - sphere_center).normalized();
-
-				// TODO: Move this outside of specific shape method
-				switch (sphere.getMaterial()) {
-				case Material::DIFFUSE: {
-					Eigen::Vector3f random_vec;
-					float lensq;
-					do {
-						random_vec = Eigen::Vector3f(dist_local(rng_local), dist_local(rng_local), dist_local(rng_local));
-						lensq = random_vec.squaredNorm();
-					} while (lensq > 1.0f || lensq < 1e-40f);
+		// If hit is in front of camera AND If hit object behind another, we don't care
+		float t = intersect(ray_origins.col(i), ray_directions.col(i));
+		if (t < t_distance(i)) {
+			t_distance(i) = t; // Update closest hit
+			hit_type(i) = (int)type;
+			hit_object(i) = primIndex;
+		}
+	}
+}
 
-					Eigen::Vector3f unit_vec = random_vec / std::sqrt(lensq);
+// Scalar brute force reference, per ray; the packet kernels (PacketKernels.cpp) replace it in the BVH traversal
+void RayTracer::intersectSphere(int sphereIndex, int chunkIndex) {
+	const SpherePrim& sphere = scene.spheres[sphereIndex];
+	intersectChunk(PrimType::Sphere, sphereIndex, chunkIndex, [&](const Eigen::Vector3f& o, const Eigen::Vector3f& d) { return intersectPrim(sphere, o, d); });
+}
 
-					if (unit_vec.dot(N) < 0.0f) {
-						unit_vec = -unit_vec;
-					}
+void RayTracer::intersectTriangle(int triangleIndex, int chunkIndex) {
+	intersectChunk(PrimType::Triangle, triangleIndex, chunkIndex, [&](const Eigen::Vector3f& o, const Eigen::Vector3f& d) { return scene.intersectTriangle(triangleIndex, o, d); });
+}
 
-					ray_origins.col(i) = hit_point;
-					ray_directions.col(i) = unit_vec;
+void RayTracer::intersectSquare(int quadIndex, int chunkIndex) {
+	const QuadPrim& quad = scene.quads[quadIndex];
+	intersectChunk(PrimType::Quad, quadIndex, chunkIndex, [&](const Eigen::Vector3f& o, const Eigen::Vector3f& d) { return intersectPrim(quad, o, d); });
+}
 
-					ray_colors.col(i) *= 0.5f;
+void RayTracer::intersectPlane(int planeIndex, int chunkIndex) {
+	const PlanePrim& plane = scene.planes[planeIndex];
+	intersectChunk(PrimType::Plane, planeIndex, chunkIndex, [&](const Eigen::Vector3f& o, const Eigen::Vector3f& d) { return intersectPrim(plane, o, d); });
+}
 
-					ray_steps(0, i) = ray_steps(0, i) - 1;
-					break;
-				}
-				default: { // Normal
-					ray_colors.col(i) = (N + Eigen::Vector3f::Ones()) * 0.5f;
-					ray_steps(0, i) = 0;
-					break;
-				}
-				};
-			}
-		}
-	}
+void RayTracer::intersectBox(int boxIndex, int chunkIndex) {
+	const BoxPrim& box = scene.boxes[boxIndex];
+	intersectChunk(PrimType::Box, boxIndex, chunkIndex, [&](const Eigen::Vector3f& o, const Eigen::Vector3f& d) { return intersectPrim(box, o, d); });
 }
@@ -0,0 +1,41 @@
+#include "RenderView.h"
+
+RenderView RenderView::fromCamera(const Camera& cam, int width, int height) {
+	Camera sized = cam;
+	sized.updateImagePlane((float)width, (float)height);
+
+	RenderView view;
+	view.eye = cam.getGhostMode() ? cam.getSavedCamTransform() : cam.getCamTransform();
+	view.plane = sized.getImagePlane();
+	view.width = width;
+	view.height = height;
+	return view;
+}
+
+RenderView RenderView::lookFrom(const glm::vec3& position, float yaw, float pitch, float fov, int width, int height, float nearPlane) {
+	RenderView view;
+	view.eye.position = position;
+	view.eye.yaw = yaw;
+	view.eye.pitch = pitch;
+
+	float planeHeight = 2.0f * nearPlane * tan(glm::radians(fov / 2.0f));
+	view.plane.setHeight(planeHeight);
+	view.plane.setWidth(planeHeight * (float)width / (float)height);
+	view.plane.transform = view.eye;
+	view.plane.transform.position = position + view.eye.forward() * nearPlane;
+
+	view.width = width;
+	view.height = height;
+	return view;
+}
+
+RenderView RenderView::region(int x, int y, int regionWidth, int regionHeight) const {
+	RenderView sub = *this;
+	sub.regionX = regionX + x;
+	sub.regionY = regionY + y;
+	sub.fullWidth = imageWidth();
+	sub.fullHeight = imageHeight();
+	sub.width = regionWidth;
+	sub.height = regionHeight;
+	return sub;
+}
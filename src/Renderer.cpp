@@ -140,6 +140,28 @@ void Renderer::initializeImagePlaneTexture() {
 
 	std::vector<uint32_t> initData(screenWidth * screenHeight, 0x22FFFFFF);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, screenWidth, screenHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, initData.data());
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenBuffers(NUM_DISPLAY_PBOS, displayPBOs);
+	resizeImagePlaneTexture();
+}
+
+// Storage for the current window size, the only place the texture and its pixel buffers get (re)allocated
+void Renderer::resizeImagePlaneTexture() {
+	if (textureWidth != screenWidth || textureHeight != screenHeight) {
+		glBindTexture(GL_TEXTURE_2D, imagePlaneTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, screenWidth, screenHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+	textureWidth = screenWidth;
+	textureHeight = screenHeight;
+
+	GLsizeiptr bytes = (GLsizeiptr)textureWidth * textureHeight * sizeof(uint32_t);
+	for (GLuint pbo : displayPBOs) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
 
 void Renderer::renderFrustrum() {
@@ -371,7 +393,10 @@ void Renderer::renderShapes(const std::vector<Shape*>& shapes) {
 
 		setupRasterUniforms(model, view, projection, color);
 		shapeVAOs[i]->bind();
-		glDrawArrays(GL_TRIANGLES, 0, shapes[i]->getVertices().size() / 3);
+		if (shapeEBOs[i])
+			glDrawElements(GL_TRIANGLES, shapeCounts[i], GL_UNSIGNED_INT, (void*)0);
+		else
+			glDrawArrays(GL_TRIANGLES, 0, shapeCounts[i]);
 	}
 
 	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
@@ -486,8 +511,14 @@ void Renderer::setupShapeBuffers(const std::vector<Shape*>& shapes) {
 		shapeVAO->setAttribPointer(0, 3, GL_FLOAT, false, 3 * sizeof(float), (void*)0);
 		glEnableVertexAttribArray(0);
 
+		// Meshes keep their shared vertices, the index buffer is recorded into the VAO
+		const std::vector<uint32_t>* indices = shape->getIndices();
+		EBO* shapeEBO = indices ? new EBO(indices) : nullptr;
+
 		shapeVBOs.push_back(shapeVBO);
 		shapeVAOs.push_back(shapeVAO);
+		shapeEBOs.push_back(shapeEBO);
+		shapeCounts.push_back((GLsizei)(indices ? indices->size() : shapeVerts.size() / 3));
 	}
 }
 
@@ -501,29 +532,40 @@ void Renderer::cleanupShapes() {
 		delete vbo;
 	for (VAO* vao : shapeVAOs)
 		delete vao;
+	for (EBO* ebo : shapeEBOs)
+		delete ebo;
 	shapeVBOs.clear();
 	shapeVAOs.clear();
+	shapeEBOs.clear();
+	shapeCounts.clear();
 }
 
-void Renderer::updateTexture(const Eigen::Matrix<int, 3, Eigen::Dynamic>& colors_matrix) {
-	std::vector<uint32_t> uint_rgb_data;
-	uint_rgb_data.reserve(colors_matrix.cols());
-
-	for (int i = 0; i < colors_matrix.cols(); i++) {
-		Eigen::Vector3i color = colors_matrix.col(i);
-
-		uint8_t r = static_cast<uint8_t>(color[0]);
-		uint8_t g = static_cast<uint8_t>(color[1]);
-		uint8_t b = static_cast<uint8_t>(color[2]);
-		uint8_t a = 255;
-		uint32_t pixel = (r << 0) | (g << 8) | (b << 16) | (a << 24);
+void Renderer::updateTexture(const RayTracer& tracer) {
+	// Nothing landed since the last upload, the texture already shows it
+	if (tracer.getDisplayVersion() == uploadedVersion)
+		return;
 
-		uint_rgb_data.push_back(pixel);
+	if (textureWidth != screenWidth || textureHeight != screenHeight)
+		resizeImagePlaneTexture();
+
+	// Next buffer of the ring, invalidated so the driver never makes us wait on an upload still reading it
+	displayPBOIndex = (displayPBOIndex + 1) % NUM_DISPLAY_PBOS;
+	GLsizeiptr bytes = (GLsizeiptr)textureWidth * textureHeight * sizeof(uint32_t);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, displayPBOs[displayPBOIndex]);
+	void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+
+	// Fails while the tracer's image is still the old size (right after a window resize), we retry next frame
+	bool copied = mapped && tracer.copyDisplayRGBA8((uint32_t*)mapped, textureWidth * textureHeight, uploadedVersion);
+	if (mapped)
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	// Sourced from the bound pixel buffer (offset 0), returns once the transfer is queued
+	if (copied) {
+		glBindTexture(GL_TEXTURE_2D, imagePlaneTexture);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, textureWidth, textureHeight, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glBindTexture(GL_TEXTURE_2D, 0);
 	}
-
-	glBindTexture(GL_TEXTURE_2D, imagePlaneTexture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, screenWidth, screenHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, uint_rgb_data.data());
-	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
 
 void Renderer::setDimensions(int width, int height) {
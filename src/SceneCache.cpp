@@ -0,0 +1,263 @@
+#include "SceneCache.h"
+#include "MappedFile.h"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <system_error>
+
+namespace {
+
+constexpr char MAGIC[8] = {'P', 'B', 'R', 'S', 'C', 'N', '\0', '\0'};
+constexpr size_t SECTION_ALIGN = 64;
+
+enum Section {
+	SPHERES,
+	TRIANGLES,
+	POSITIONS,
+	QUADS,
+	BOXES,
+	PLANES,
+	SPHERE_NODES,
+	TRIANGLE_NODES,
+	QUAD_NODES,
+	BOX_NODES,
+	BVH_STATS, // One BuildStats per BVH, same order as the node sections
+	NUM_SECTIONS
+};
+
+struct SectionEntry {
+	uint64_t offset;
+	uint64_t bytes;
+};
+
+struct CacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t layout; // See layoutHash()
+	uint64_t key;
+	SectionEntry sections[NUM_SECTIONS];
+};
+
+// Everything the raw copies depend on: struct sizes, byte order and the section list
+uint32_t layoutHash() {
+	SceneCacheKey layout;
+	layout.add((uint32_t)0x01020304);
+	layout.add((uint32_t)NUM_SECTIONS);
+	layout.add(sizeof(SpherePrim));
+	layout.add(sizeof(TrianglePrim));
+	layout.add(sizeof(QuadPrim));
+	layout.add(sizeof(BoxPrim));
+	layout.add(sizeof(PlanePrim));
+	layout.add(sizeof(BVHNode));
+	layout.add(sizeof(BVH::BuildStats));
+	layout.add(sizeof(Material));
+	return (uint32_t)(layout.value() ^ (layout.value() >> 32));
+}
+
+size_t alignUp(size_t value) {
+	return (value + SECTION_ALIGN - 1) & ~(SECTION_ALIGN - 1);
+}
+
+template <typename T>
+bool readSection(const MappedFile& file, const SectionEntry& entry, std::vector<T>& out) {
+	if (entry.offset > file.size() || entry.bytes > file.size() - entry.offset || entry.bytes % sizeof(T) != 0)
+		return false;
+
+	out.resize(entry.bytes / sizeof(T));
+	if (entry.bytes > 0)
+		std::memcpy((void*)out.data(), file.data() + entry.offset, entry.bytes);
+	return true;
+}
+
+// A corrupt tree would send traversal out of bounds, so check every link before handing it to the tracer
+// Builds always put children after their parent, so a link back (or to itself) can only be corruption. Forward
+// links also mean a node's depth is known before its children are reached, which bounds the traversal stacks
+bool validTree(const std::vector<BVHNode>& nodes, size_t numPrims) {
+	if (nodes.empty())
+		return numPrims == 0;
+
+	std::vector<int> depth(nodes.size(), 0);
+	size_t leafPrims = 0;
+	for (size_t i = 0; i < nodes.size(); i++) {
+		const BVHNode& node = nodes[i];
+		if (node.count < 0 || node.leftOrFirst < 0 || depth[i] > BVH::MAX_DEPTH)
+			return false;
+		if (node.isLeaf()) {
+			if ((size_t)node.leftOrFirst + (size_t)node.count > numPrims)
+				return false;
+			leafPrims += node.count;
+		} else if ((size_t)node.leftOrFirst <= i || (size_t)node.leftOrFirst + 1 >= nodes.size()) {
+			return false;
+		} else {
+			depth[node.leftOrFirst] = std::max(depth[node.leftOrFirst], depth[i] + 1);
+			depth[node.leftOrFirst + 1] = std::max(depth[node.leftOrFirst + 1], depth[i] + 1);
+		}
+	}
+	return leafPrims == numPrims;
+}
+
+} // namespace
+
+void SceneCacheKey::add(const void* data, size_t size) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+}
+
+void SceneCacheKey::add(const std::string& text) {
+	add((uint64_t)text.size());
+	add(text.data(), text.size());
+}
+
+void SceneCacheKey::addFile(const std::string& path) {
+	add(path);
+
+	std::error_code error;
+	uintmax_t size = std::filesystem::file_size(path, error);
+	if (error)
+		return;
+	auto modified = std::filesystem::last_write_time(path, error);
+	if (error)
+		return;
+
+	add((uint64_t)size);
+	add((int64_t)modified.time_since_epoch().count());
+}
+
+bool saveSceneCache(const std::string& path, const TraceScene& scene, uint64_t key) {
+	const BVH* trees[] = {&scene.sphereBVH, &scene.triangleBVH, &scene.quadBVH, &scene.boxBVH};
+	BVH::BuildStats stats[4];
+	for (int i = 0; i < 4; i++)
+		stats[i] = trees[i]->getBuildStats();
+
+	const void* data[NUM_SECTIONS] = {
+	    scene.spheres.data(),
+	    scene.triangles.data(),
+	    scene.positions.data(),
+	    scene.quads.data(),
+	    scene.boxes.data(),
+	    scene.planes.data(),
+	    scene.sphereBVH.getNodes().data(),
+	    scene.triangleBVH.getNodes().data(),
+	    scene.quadBVH.getNodes().data(),
+	    scene.boxBVH.getNodes().data(),
+	    stats,
+	};
+	const size_t bytes[NUM_SECTIONS] = {
+	    scene.spheres.size() * sizeof(SpherePrim),
+	    scene.triangles.size() * sizeof(TrianglePrim),
+	    scene.positions.size() * sizeof(float),
+	    scene.quads.size() * sizeof(QuadPrim),
+	    scene.boxes.size() * sizeof(BoxPrim),
+	    scene.planes.size() * sizeof(PlanePrim),
+	    scene.sphereBVH.getNodes().size() * sizeof(BVHNode),
+	    scene.triangleBVH.getNodes().size() * sizeof(BVHNode),
+	    scene.quadBVH.getNodes().size() * sizeof(BVHNode),
+	    scene.boxBVH.getNodes().size() * sizeof(BVHNode),
+	    sizeof(stats),
+	};
+
+	CacheHeader header{};
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = SCENE_CACHE_VERSION;
+	header.layout = layoutHash();
+	header.key = key;
+
+	size_t offset = alignUp(sizeof(CacheHeader));
+	for (int s = 0; s < NUM_SECTIONS; s++) {
+		header.sections[s] = SectionEntry{offset, bytes[s]};
+		offset = alignUp(offset + bytes[s]);
+	}
+
+	std::string tempPath = path + ".tmp";
+	{
+		std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+		if (!out) {
+			std::cerr << "Failed to write scene cache " << tempPath << std::endl;
+			return false;
+		}
+
+		const char padding[SECTION_ALIGN] = {};
+		size_t written = sizeof(CacheHeader);
+		out.write((const char*)&header, sizeof(CacheHeader));
+		for (int s = 0; s < NUM_SECTIONS; s++) {
+			out.write(padding, header.sections[s].offset - written);
+			out.write((const char*)data[s], bytes[s]);
+			written = header.sections[s].offset + bytes[s];
+		}
+
+		if (!out) {
+			std::cerr << "Failed to write scene cache " << tempPath << std::endl;
+			return false;
+		}
+	}
+
+	std::error_code error;
+	std::filesystem::rename(tempPath, path, error);
+	if (error) {
+		std::cerr << "Failed to move scene cache into " << path << ": " << error.message() << std::endl;
+		std::filesystem::remove(tempPath, error);
+		return false;
+	}
+	return true;
+}
+
+bool loadSceneCache(const std::string& path, TraceScene& scene, uint64_t key) {
+	scene.clear();
+
+	MappedFile file;
+	if (!file.open(path))
+		return false;
+
+	CacheHeader header;
+	if (file.size() < sizeof(CacheHeader))
+		return false;
+	std::memcpy(&header, file.data(), sizeof(CacheHeader));
+
+	if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != SCENE_CACHE_VERSION || header.layout != layoutHash()) {
+		std::cout << "Scene cache " << path << " is from another version, rebuilding" << std::endl;
+		return false;
+	}
+	if (header.key != key) {
+		std::cout << "Scene cache " << path << " is stale, rebuilding" << std::endl;
+		return false;
+	}
+
+	std::vector<BVHNode> nodes[4];
+	std::vector<BVH::BuildStats> stats;
+	const SectionEntry* sections = header.sections;
+	bool ok = readSection(file, sections[SPHERES], scene.spheres) && readSection(file, sections[TRIANGLES], scene.triangles) &&
+	          readSection(file, sections[POSITIONS], scene.positions) && readSection(file, sections[QUADS], scene.quads) &&
+	          readSection(file, sections[BOXES], scene.boxes) && readSection(file, sections[PLANES], scene.planes) &&
+	          readSection(file, sections[SPHERE_NODES], nodes[0]) && readSection(file, sections[TRIANGLE_NODES], nodes[1]) &&
+	          readSection(file, sections[QUAD_NODES], nodes[2]) && readSection(file, sections[BOX_NODES], nodes[3]) &&
+	          readSection(file, sections[BVH_STATS], stats) && stats.size() == 4;
+
+	ok = ok && validTree(nodes[0], scene.spheres.size()) && validTree(nodes[1], scene.triangles.size()) &&
+	     validTree(nodes[2], scene.quads.size()) && validTree(nodes[3], scene.boxes.size());
+
+	int numVertices = scene.numVertices();
+	for (size_t t = 0; ok && t < scene.triangles.size(); t++) {
+		const TrianglePrim& tri = scene.triangles[t];
+		ok = tri.v0 >= 0 && tri.v1 >= 0 && tri.v2 >= 0 && tri.v0 < numVertices && tri.v1 < numVertices && tri.v2 < numVertices;
+	}
+
+	if (!ok) {
+		std::cerr << "Scene cache " << path << " is malformed, rebuilding" << std::endl;
+		scene.clear();
+		return false;
+	}
+
+	scene.sphereBVH.assign(std::move(nodes[0]), stats[0]);
+	scene.triangleBVH.assign(std::move(nodes[1]), stats[1]);
+	scene.quadBVH.assign(std::move(nodes[2]), stats[2]);
+	scene.boxBVH.assign(std::move(nodes[3]), stats[3]);
+
+	for (const SpherePrim& sphere : scene.spheres)
+		scene.sphereSoA.push(sphere.center, sphere.radius);
+	return true;
+}
@@ -0,0 +1,43 @@
+#include "Scenes.h"
+#include "Material.h"
+#include "Plane.h"
+#include "Sphere.h"
+#include <cmath>
+#include <random>
+
+void buildDefaultScene(std::vector<Shape*>& worldObjects) {
+	Sphere* sphere;
+	sphere = new Sphere(0.4f, 4, glm::vec3(0.0f, 0.0f, -5.0f), Material::DIFFUSE);
+	worldObjects.push_back(sphere);
+	sphere = new Sphere(1.0f, 4, glm::vec3(0.0f, 1.0f, -10.0f), Material::DIFFUSE);
+	worldObjects.push_back(sphere);
+	sphere = new Sphere(4.0f, 4, glm::vec3(0.0f, 3.0f, -15.0f), Material::DIFFUSE);
+	worldObjects.push_back(sphere);
+
+	// Floor
+	worldObjects.push_back(new Plane(glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), Material::DIFFUSE));
+}
+
+void buildRandomSphereScene(std::vector<Shape*>& worldObjects, int count, unsigned seed) {
+	std::mt19937 rng(seed);
+
+	// Volume grows with count, ~1 sphere per unit^3
+	float extent = std::cbrt((float)count);
+	std::uniform_real_distribution<float> x(-extent, extent);
+	std::uniform_real_distribution<float> y(-1.0f, extent);
+	std::uniform_real_distribution<float> z(-5.0f - 2.0f * extent, -5.0f);
+	std::uniform_real_distribution<float> radius(0.1f, 0.4f);
+
+	worldObjects.reserve(worldObjects.size() + count);
+	for (int i = 0; i < count; i++) {
+		// No subdivisions, the tracer only needs center and radius
+		worldObjects.push_back(new Sphere(radius(rng), 0, glm::vec3(x(rng), y(rng), z(rng)), Material::DIFFUSE));
+	}
+}
+
+void destroyScene(std::vector<Shape*>& worldObjects) {
+	for (Shape* shape : worldObjects) {
+		delete shape;
+	}
+	worldObjects.clear();
+}
@@ -0,0 +1,140 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+// Lets a worker find its own queue (and tells us if we're being called from outside the pool)
+static thread_local const ThreadPool* tlsPool = nullptr;
+static thread_local int tlsWorkerIndex = -1;
+
+ThreadPool::ThreadPool(unsigned int numThreads) {
+	if (numThreads == 0)
+		numThreads = 1;
+
+	queues.reserve(numThreads);
+	for (unsigned int i = 0; i < numThreads; i++) {
+		queues.push_back(std::make_unique<WorkerQueue>());
+	}
+
+	workers.reserve(numThreads);
+	for (unsigned int i = 0; i < numThreads; i++) {
+		workers.emplace_back(&ThreadPool::workerLoop, this, (int)i);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for (auto& worker : workers)
+		worker.join();
+}
+
+int ThreadPool::currentWorkerIndex() const {
+	return tlsPool == this ? tlsWorkerIndex : -1;
+}
+
+void ThreadPool::submit(Task task) {
+	// Workers keep their own tasks local, everyone else spreads them round robin
+	int index = currentWorkerIndex();
+	if (index < 0)
+		index = (int)(nextQueue.fetch_add(1, std::memory_order_relaxed) % queues.size());
+
+	{
+		std::lock_guard<std::mutex> lock(queues[index]->mutex);
+		queues[index]->tasks.push_back(std::move(task));
+	}
+	pending.fetch_add(1);
+
+	// Lock so a worker can't miss the wakeup between checking `pending` and going to sleep
+	{ std::lock_guard<std::mutex> lock(sleepMutex); }
+	wake.notify_one();
+}
+
+bool ThreadPool::popLocal(int index, Task& task) {
+	WorkerQueue& queue = *queues[index];
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (queue.tasks.empty())
+		return false;
+
+	task = std::move(queue.tasks.front());
+	queue.tasks.pop_front();
+	return true;
+}
+
+bool ThreadPool::steal(int thief, Task& task) {
+	int numQueues = (int)queues.size();
+	int start = thief < 0 ? 0 : thief + 1;
+
+	for (int i = 0; i < numQueues; i++) {
+		int victim = (start + i) % numQueues;
+		if (victim == thief)
+			continue;
+
+		WorkerQueue& queue = *queues[victim];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tasks.empty())
+			continue;
+
+		task = std::move(queue.tasks.back());
+		queue.tasks.pop_back();
+		return true;
+	}
+	return false;
+}
+
+bool ThreadPool::tryRunTask(int index) {
+	Task task;
+	if ((index >= 0 && popLocal(index, task)) || steal(index, task)) {
+		pending.fetch_sub(1);
+		task();
+		return true;
+	}
+	return false;
+}
+
+void ThreadPool::workerLoop(int index) {
+	tlsPool = this;
+	tlsWorkerIndex = index;
+
+	while (true) {
+		if (tryRunTask(index))
+			continue;
+
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		wake.wait(lock, [this]() { return stopping || pending.load() > 0; });
+		if (stopping)
+			return;
+	}
+}
+
+void ThreadPool::parallelFor(int begin, int end, int grain, const std::function<void(int, int)>& func) {
+	if (end <= begin)
+		return;
+
+	grain = std::max(grain, 1);
+	int numTasks = (end - begin + grain - 1) / grain;
+
+	// Not worth a round trip through the queues
+	if (numTasks == 1) {
+		func(begin, end);
+		return;
+	}
+
+	std::atomic<int> remaining{numTasks};
+	for (int start = begin; start < end; start += grain) {
+		int stop = std::min(start + grain, end);
+		submit([&func, &remaining, start, stop]() {
+			func(start, stop);
+			remaining.fetch_sub(1, std::memory_order_release);
+		});
+	}
+
+	// Help out until our batch is done
+	int index = currentWorkerIndex();
+	while (remaining.load(std::memory_order_acquire) > 0) {
+		if (!tryRunTask(index))
+			std::this_thread::yield();
+	}
+}
@@ -0,0 +1,122 @@
+#include "TileGrid.h"
+#include <algorithm>
+#include <cstdint>
+
+namespace {
+
+// Spreads the low 16 bits of v out to the even bits
+uint32_t spreadBits(uint32_t v) {
+	v &= 0xFFFF;
+	v = (v | (v << 8)) & 0x00FF00FF;
+	v = (v | (v << 4)) & 0x0F0F0F0F;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+}
+
+uint32_t mortonCode(int x, int y) {
+	return spreadBits((uint32_t)x) | (spreadBits((uint32_t)y) << 1);
+}
+
+struct TileCoord {
+	int x;
+	int y;
+};
+
+// Square spiral around the center tile, coordinates outside the grid are skipped
+std::vector<TileCoord> spiralOrder(int tilesX, int tilesY) {
+	std::vector<TileCoord> coords;
+	int total = tilesX * tilesY;
+	int x = (tilesX - 1) / 2;
+	int y = (tilesY - 1) / 2;
+	const int dx[4] = {1, 0, -1, 0};
+	const int dy[4] = {0, 1, 0, -1};
+
+	auto visit = [&]() {
+		if (x >= 0 && y >= 0 && x < tilesX && y < tilesY)
+			coords.push_back({x, y});
+	};
+
+	visit();
+	for (int run = 1, dir = 0; (int)coords.size() < total; run++) {
+		// Right, down, then left, up with the run one longer each time
+		for (int leg = 0; leg < 2; leg++, dir = (dir + 1) % 4) {
+			for (int step = 0; step < run; step++) {
+				x += dx[dir];
+				y += dy[dir];
+				visit();
+			}
+		}
+	}
+	return coords;
+}
+
+} // namespace
+
+const char* tileOrderName(TileOrder order) {
+	switch (order) {
+	case TileOrder::Morton:
+		return "morton";
+	case TileOrder::Spiral:
+		return "spiral";
+	case TileOrder::Scanline:
+		return "scanline";
+	}
+	return "unknown";
+}
+
+bool parseTileOrder(const std::string& name, TileOrder& order) {
+	for (TileOrder o : {TileOrder::Morton, TileOrder::Spiral, TileOrder::Scanline}) {
+		if (name == tileOrderName(o)) {
+			order = o;
+			return true;
+		}
+	}
+	return false;
+}
+
+void TileGrid::build(int newWidth, int newHeight, int newTileSize, TileOrder newOrder) {
+	newTileSize = std::max(newTileSize, 1);
+	if (newWidth == width && newHeight == height && newTileSize == tileSize && newOrder == order)
+		return;
+
+	width = newWidth;
+	height = newHeight;
+	tileSize = newTileSize;
+	order = newOrder;
+
+	tilesX = (width + tileSize - 1) / tileSize;
+	int tilesY = (height + tileSize - 1) / tileSize;
+
+	std::vector<TileCoord> coords;
+	if (order == TileOrder::Spiral) {
+		coords = spiralOrder(tilesX, tilesY);
+	} else {
+		for (int y = 0; y < tilesY; y++)
+			for (int x = 0; x < tilesX; x++)
+				coords.push_back({x, y});
+		if (order == TileOrder::Morton)
+			std::stable_sort(coords.begin(), coords.end(), [](TileCoord a, TileCoord b) { return mortonCode(a.x, a.y) < mortonCode(b.x, b.y); });
+	}
+
+	tiles.clear();
+	slotStart.assign(1, 0);
+	gridTile.resize(coords.size());
+
+	for (TileCoord c : coords) {
+		Tile t{c.x * tileSize, c.y * tileSize, 0, 0};
+		t.width = std::min(tileSize, width - t.x);
+		t.height = std::min(tileSize, height - t.y);
+
+		gridTile[c.y * tilesX + c.x] = (int)tiles.size();
+		tiles.push_back(t);
+		slotStart.push_back(slotStart.back() + t.numPixels());
+	}
+}
+
+int TileGrid::pixelAt(int slot) const {
+	int index = (int)(std::upper_bound(slotStart.begin(), slotStart.end(), slot) - slotStart.begin()) - 1;
+	const Tile& t = tiles[index];
+	int offset = slot - slotStart[index];
+	return (t.y + offset / t.width) * width + t.x + offset % t.width;
+}
@@ -0,0 +1,227 @@
+#include "TraceScene.h"
+#include "Cube.h"
+#include "Mesh.h"
+#include "Plane.h"
+#include "Sphere.h"
+#include "Square.h"
+#include "Triangle.h"
+#include <iostream>
+
+static Eigen::Vector3f toEigen(const glm::vec3& v) {
+	return Eigen::Vector3f(v.x, v.y, v.z);
+}
+
+static QuadPrim makeQuad(const Eigen::Vector3f& corner, const Eigen::Vector3f& u, const Eigen::Vector3f& v, Material material) {
+	Eigen::Vector3f n = u.cross(v);
+	Eigen::Vector3f normal = n.normalized();
+	return QuadPrim{corner, u, v, n / n.squaredNorm(), normal, normal.dot(corner), material};
+}
+
+void TraceScene::clear() {
+	spheres.clear();
+	triangles.clear();
+	positions.clear();
+	quads.clear();
+	boxes.clear();
+	planes.clear();
+	sphereSoA.clear();
+	sphereBVH.clear();
+	triangleBVH.clear();
+	quadBVH.clear();
+	boxBVH.clear();
+}
+
+int TraceScene::addVertex(const Eigen::Vector3f& p) {
+	positions.push_back(p.x());
+	positions.push_back(p.y());
+	positions.push_back(p.z());
+	return numVertices() - 1;
+}
+
+AABB TraceScene::triangleBounds(const TrianglePrim& tri) const {
+	AABB b;
+	b.grow(Eigen::Vector3f::Map(&positions[3 * tri.v0]));
+	b.grow(Eigen::Vector3f::Map(&positions[3 * tri.v1]));
+	b.grow(Eigen::Vector3f::Map(&positions[3 * tri.v2]));
+	return b;
+}
+
+void TraceScene::build(const std::vector<Shape*>& worldObjects) {
+	clear();
+
+	// The only place we need to know concrete shape types
+	for (const Shape* object : worldObjects) {
+		Eigen::Vector3f offset = toEigen(object->position);
+		Material material = object->getMaterial();
+
+		if (const Sphere* sphere = dynamic_cast<const Sphere*>(object)) {
+			spheres.push_back(SpherePrim{offset, sphere->radius, material});
+		} else if (const Square* square = dynamic_cast<const Square*>(object)) {
+			Eigen::Vector3f corner = toEigen(square->p0) + offset;
+			quads.push_back(makeQuad(corner, toEigen(square->p1 - square->p0), toEigen(square->p2 - square->p0), material));
+		} else if (const Cube* cube = dynamic_cast<const Cube*>(object)) {
+			// A box flat on some axis has no well defined face to take the normal of
+			BoxPrim box{toEigen(cube->min) + offset, toEigen(cube->max) + offset, material};
+			if ((box.max - box.min).minCoeff() > 0.0f)
+				boxes.push_back(box);
+			else
+				std::cerr << "Skipping a box with no extent along some axis" << std::endl;
+		} else if (const Plane* plane = dynamic_cast<const Plane*>(object)) {
+			Eigen::Vector3f normal = toEigen(plane->normal);
+			planes.push_back(PlanePrim{normal, normal.dot(offset), material});
+		} else if (const Mesh* mesh = dynamic_cast<const Mesh*>(object)) {
+			// Vertices stay shared, indices are rebased onto the scene wide buffer
+			int base = numVertices();
+			const std::vector<float>& meshPositions = mesh->getPositions();
+			positions.reserve(positions.size() + meshPositions.size());
+			for (size_t i = 0; i + 2 < meshPositions.size(); i += 3)
+				addVertex(Eigen::Vector3f(meshPositions[i], meshPositions[i + 1], meshPositions[i + 2]) + offset);
+
+			triangles.reserve(triangles.size() + mesh->numTriangles());
+			for (size_t i = 0; i + 2 < mesh->indices.size(); i += 3)
+				triangles.push_back(TrianglePrim{base + (int)mesh->indices[i], base + (int)mesh->indices[i + 1], base + (int)mesh->indices[i + 2], material});
+		} else if (const Triangle* triangle = dynamic_cast<const Triangle*>(object)) {
+			int v0 = addVertex(toEigen(triangle->v0) + offset);
+			int v1 = addVertex(toEigen(triangle->v1) + offset);
+			int v2 = addVertex(toEigen(triangle->v2) + offset);
+			triangles.push_back(TrianglePrim{v0, v1, v2, material});
+		} else {
+			// Anything else gets traced as its triangle soup
+			std::vector<float> verts = object->getVertices();
+			for (size_t i = 0; i + 8 < verts.size(); i += 9) {
+				int v0 = addVertex(Eigen::Vector3f(verts[i + 0], verts[i + 1], verts[i + 2]) + offset);
+				int v1 = addVertex(Eigen::Vector3f(verts[i + 3], verts[i + 4], verts[i + 5]) + offset);
+				int v2 = addVertex(Eigen::Vector3f(verts[i + 6], verts[i + 7], verts[i + 8]) + offset);
+				triangles.push_back(TrianglePrim{v0, v1, v2, material});
+			}
+		}
+	}
+
+	buildBVHs();
+}
+
+template <typename T, typename BoundsFunc>
+static void buildTypeBVH(BVH& bvh, std::vector<T>& prims, BoundsFunc&& boundsFn) {
+	std::vector<AABB> bounds;
+	bounds.reserve(prims.size());
+	for (const T& prim : prims)
+		bounds.push_back(boundsFn(prim));
+
+	bvh.build(bounds);
+	bvh.reorder(prims);
+}
+
+void TraceScene::buildBVHs() {
+	auto bounds = [](const auto& prim) { return boundsOf(prim); };
+	buildTypeBVH(sphereBVH, spheres, bounds);
+	buildTypeBVH(triangleBVH, triangles, [this](const TrianglePrim& tri) { return triangleBounds(tri); });
+	buildTypeBVH(quadBVH, quads, bounds);
+	buildTypeBVH(boxBVH, boxes, bounds);
+
+	for (const SpherePrim& sphere : spheres)
+		sphereSoA.push(sphere.center, sphere.radius);
+}
+
+template <typename T>
+static int intersectType(const BVH& bvh, const std::vector<T>& prims, PrimType type, const Eigen::Vector3f& origin, const Eigen::Vector3f& dir, float& tClosest, PrimType& hitType, int& hitIndex) {
+	return bvh.traverse(origin, dir, tClosest, [&](int slot, float& tMax) {
+		float t = intersectPrim(prims[slot], origin, dir);
+		if (t < tMax) {
+			tMax = t;
+			hitType = type;
+			hitIndex = slot;
+		}
+	});
+}
+
+int TraceScene::intersect(const Eigen::Vector3f& origin, const Eigen::Vector3f& dir, float& tClosest, PrimType& hitType, int& hitIndex, bool includeSpheres) const {
+	int visited = 0;
+	if (includeSpheres)
+		visited += intersectType(sphereBVH, spheres, PrimType::Sphere, origin, dir, tClosest, hitType, hitIndex);
+
+	// Triangles go a leaf at a time through the wide watertight kernel
+	if (!triangles.empty()) {
+		WatertightRay ray = makeWatertightRay(origin, dir);
+		visited += triangleBVH.traverseLeaves(origin, dir, tClosest, [&](int first, int count, float& tMax) {
+			int hit = -1;
+			intersectTriangles(simdLevel, ray, positions.data(), triangles.data(), first, first + count, tMax, hit);
+			if (hit >= 0) {
+				hitType = PrimType::Triangle;
+				hitIndex = hit;
+			}
+		});
+	}
+
+	visited += intersectType(quadBVH, quads, PrimType::Quad, origin, dir, tClosest, hitType, hitIndex);
+	visited += intersectType(boxBVH, boxes, PrimType::Box, origin, dir, tClosest, hitType, hitIndex);
+
+	for (int p = 0; p < (int)planes.size(); p++) {
+		float t = intersectPrim(planes[p], origin, dir);
+		if (t < tClosest) {
+			tClosest = t;
+			hitType = PrimType::Plane;
+			hitIndex = p;
+		}
+	}
+	return visited;
+}
+
+float TraceScene::intersectTriangle(int index, const Eigen::Vector3f& origin, const Eigen::Vector3f& dir) const {
+	const TrianglePrim& tri = triangles[index];
+	return intersectWatertight(makeWatertightRay(origin, dir), &positions[3 * tri.v0], &positions[3 * tri.v1], &positions[3 * tri.v2]);
+}
+
+void TraceScene::surfaceAt(PrimType type, int index, const Eigen::Vector3f& point, const Eigen::Vector3f& dir, Eigen::Vector3f& normal, Material& material) const {
+	switch (type) {
+	case PrimType::Sphere:
+		normal = normalAt(spheres[index], point);
+		material = spheres[index].material;
+		break;
+	case PrimType::Triangle: {
+		const TrianglePrim& tri = triangles[index];
+		Eigen::Vector3f p0 = Eigen::Vector3f::Map(&positions[3 * tri.v0]);
+		Eigen::Vector3f p1 = Eigen::Vector3f::Map(&positions[3 * tri.v1]);
+		Eigen::Vector3f p2 = Eigen::Vector3f::Map(&positions[3 * tri.v2]);
+		normal = (p1 - p0).cross(p2 - p0).normalized();
+		material = tri.material;
+		break;
+	}
+	case PrimType::Quad:
+		normal = normalAt(quads[index], point);
+		material = quads[index].material;
+		break;
+	case PrimType::Plane:
+		normal = normalAt(planes[index], point);
+		material = planes[index].material;
+		break;
+	case PrimType::Box:
+		normal = normalAt(boxes[index], point);
+		material = boxes[index].material;
+		break;
+	}
+
+	// Flat geometry is two sided
+	bool solid = type == PrimType::Sphere || type == PrimType::Box;
+	if (!solid && normal.dot(dir) > 0.0f)
+		normal = -normal;
+}
+
+void TraceScene::printStats() const {
+	auto print = [](const char* name, size_t count, const BVH& bvh) {
+		if (count == 0)
+			return;
+		const BVH::BuildStats& stats = bvh.getBuildStats();
+		std::cout << "BVH (" << name << "): " << count << " prims, " << stats.nodeCount << " nodes, " << stats.leafCount << " leaves, depth " << stats.maxDepth
+		          << ", SAH cost " << stats.sahCost << ", built in " << stats.buildMs << " ms" << std::endl;
+	};
+
+	print("spheres", spheres.size(), sphereBVH);
+	print("triangles", triangles.size(), triangleBVH);
+	if (!triangles.empty())
+		std::cout << "Triangle vertices: " << numVertices() << " shared by " << triangles.size() << " triangles" << std::endl;
+	print("quads", quads.size(), quadBVH);
+	print("boxes", boxes.size(), boxBVH);
+
+	if (!planes.empty())
+		std::cout << "Planes (no BVH): " << planes.size() << std::endl;
+}
@@ -0,0 +1,482 @@
+// pbr-bench: per stage micro-benchmarks + end-to-end renders, results as JSON on stdout
+#include "Film.h"
+#include "Profiler.h"
+#include "RayTracer.h"
+#include "RenderView.h"
+#include "Scenes.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+struct Resolution {
+	int width;
+	int height;
+};
+
+struct BenchOptions {
+	std::vector<int> sphereCounts{10, 1000, 100000, 1000000};
+	std::vector<Resolution> resolutions{{320, 240}, {640, 480}, {1280, 720}};
+	std::vector<Resolution> filmResolutions{{3840, 2160}, {7680, 4320}}; // Film is cheap per pixel, so it's measured at display sizes
+	std::vector<Resolution> memoryResolutions{{3840, 2160}};
+	std::vector<int> rayBudgets{0, 1 << 21, 1 << 18}; // Memory renders, 0 means the whole image in flight at once
+	std::vector<SimdLevel> simdLevels{bestSimdLevel()};
+	int samples{1};
+	int bounces{8};
+	int reps{5};
+	int microSpheres{64}; // Spheres tested per ray in the intersectSphere stage
+	std::string output;   // Empty means stdout
+	std::string profile;  // Chrome trace of everything, empty means no profiling
+};
+
+struct StageResult {
+	std::string name;
+	int width;
+	int height;
+	int threads;
+	long long rays; // Per rep
+	double seconds; // Median over reps
+};
+
+struct RenderResult {
+	int spheres;
+	int width;
+	int height;
+	SimdLevel simd;
+	int threads;
+	RenderStats stats;
+};
+
+struct MemoryResult {
+	int width;
+	int height;
+	int rayBudget;
+	int raySlots;       // Pixels per window
+	size_t rayBytes;    // Ray buffers and queues
+	size_t filmBytes;   // Both accumulation buffers
+	long peakRssKB;     // Of the process that did just this render
+	double traceSeconds;
+};
+
+static long peakRssKB(int who) {
+	rusage usage{};
+	getrusage(who, &usage);
+	return usage.ru_maxrss; // KB on Linux
+}
+
+// 0 instead of inf/nan when a stage was too quick to time (or traced nothing), JSON has neither
+static double ratio(double numerator, double denominator) {
+	return denominator > 0.0 ? numerator / denominator : 0.0;
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// body() does its own untimed setup and returns the seconds it wants counted
+template <typename Body>
+static double medianSeconds(int reps, Body&& body) {
+	std::vector<double> times;
+	for (int r = 0; r < reps; r++)
+		times.push_back(body());
+
+	std::sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+static std::vector<StageResult> runStages(const BenchOptions& options, Resolution res) {
+	std::vector<StageResult> results;
+	RenderView view = RenderView::lookFrom(glm::vec3(0.0f), -90.0f, 0.0f, 45.0f, res.width, res.height);
+	int numPixels = view.numPixels();
+
+	// 2 samples so ray generation takes the jittered path like a real render. Budgeted for the whole image in one
+	// window, the stages below go over every pixel; sized by the first initializeRays(), after the budget is in
+	RayTracer tracer(0, options.bounces, 2);
+	tracer.setVerbose(false);
+	tracer.setRayBudget((int)std::min(2LL * numPixels, (long long)std::numeric_limits<int>::max()));
+	int threads = tracer.getNumThreads();
+
+	auto add = [&](const std::string& name, int stageThreads, double seconds) {
+		results.push_back({name, res.width, res.height, stageThreads, numPixels, seconds});
+		std::cerr << "  " << name << ": " << seconds * 1e3 << " ms" << std::endl;
+	};
+
+	std::cerr << "Stages @ " << res.width << "x" << res.height << std::endl;
+
+	// Camera ray generation (runs on the pool)
+	add("camera_rays", threads, medianSeconds(options.reps, [&]() {
+		    auto start = std::chrono::steady_clock::now();
+		    tracer.initializeRays(view, 0);
+		    return secondsSince(start);
+	    }));
+
+	// Brute force intersectSphere over every chunk, single thread
+	std::vector<Shape*> spheres;
+	buildRandomSphereScene(spheres, options.microSpheres);
+	tracer.buildAccelerationStructure(spheres);
+	add("intersect_sphere_x" + std::to_string(options.microSpheres), 1, medianSeconds(options.reps, [&]() {
+		    tracer.initializeRays(view, 0);
+		    tracer.resetActiveRays();
+		    for (int c = 0; c < tracer.getNumChunks(); c++)
+			    tracer.resetChunk(c);
+
+		    auto start = std::chrono::steady_clock::now();
+		    for (int s = 0; s < options.microSpheres; s++)
+			    for (int c = 0; c < tracer.getNumChunks(); c++)
+				    tracer.intersectSphere(s, c);
+		    return secondsSince(start);
+	    }));
+	destroyScene(spheres);
+
+	// Miss shading: empty scene so every ray takes the sky path, single thread
+	std::vector<Shape*> empty;
+	tracer.buildAccelerationStructure(empty);
+	add("miss_shading", 1, medianSeconds(options.reps, [&]() {
+		    tracer.initializeRays(view, 0);
+		    tracer.resetActiveRays();
+		    for (int c = 0; c < tracer.getNumChunks(); c++)
+			    tracer.resetChunk(c);
+
+		    auto start = std::chrono::steady_clock::now();
+		    for (int c = 0; c < tracer.getNumChunks(); c++)
+			    tracer.shadeChunk(c);
+		    return secondsSince(start);
+	    }));
+
+	// Accumulation into the double buffer, single thread
+	AccumulationBuffer dst, src;
+	dst.reset(numPixels);
+	src.reset(numPixels);
+	add("accumulate", 1, medianSeconds(options.reps, [&]() {
+		    auto start = std::chrono::steady_clock::now();
+		    tracer.accumulateRange(0, numPixels, dst, src);
+		    return secondsSince(start);
+	    }));
+
+	// Averaging needs a finished sample to read from
+	tracer.setSampleCount(1);
+	tracer.traceAll(empty, view);
+	Eigen::Matrix<int, 3, Eigen::Dynamic> colors;
+	add("averaged_colors", 1, medianSeconds(options.reps, [&]() {
+		    auto start = std::chrono::steady_clock::now();
+		    tracer.getAveragedColors(colors);
+		    return secondsSince(start);
+	    }));
+
+	// What the viewer gets after every pass: the average resolved straight to RGBA8 texels
+	add("resolve_display", threads, medianSeconds(options.reps, [&]() {
+		    auto start = std::chrono::steady_clock::now();
+		    tracer.resolveDisplay();
+		    return secondsSince(start);
+	    }));
+
+	return results;
+}
+
+// Developing a finished accumulation: the old serial average/scale/cast loop, then the film with every tonemap
+static std::vector<StageResult> runFilm(const BenchOptions& options) {
+	std::vector<StageResult> results;
+	ThreadPool pool;
+	int threads = (int)pool.size();
+
+	for (Resolution res : options.filmResolutions) {
+		int numPixels = res.width * res.height;
+		std::cerr << "Film @ " << res.width << "x" << res.height << std::endl;
+
+		// HDR-ish sums over 64 samples, a few pixels past 1 so the tonemaps have something to compress
+		AccumulationBuffer buffer;
+		buffer.reset(numPixels);
+		buffer.color = (Eigen::Matrix<float, 3, Eigen::Dynamic>::Random(3, numPixels).array() + 1.0f) * 64.0f;
+		buffer.samples.setConstant(64);
+		std::vector<uint32_t> texels(numPixels);
+		Eigen::Matrix<int, 3, Eigen::Dynamic> colors(3, numPixels);
+
+		auto add = [&](const std::string& name, int stageThreads, double seconds) {
+			results.push_back({name, res.width, res.height, stageThreads, numPixels, seconds});
+			std::cerr << "  " << name << ": " << seconds * 1e3 << " ms" << std::endl;
+		};
+
+		add("film_serial_reference", 1, medianSeconds(options.reps, [&]() {
+			    auto start = std::chrono::steady_clock::now();
+			    for (int i = 0; i < numPixels; i++)
+				    colors.col(i) = ((buffer.color.col(i) / (float)buffer.samples(i)) * 255.0f).cast<int>();
+			    return secondsSince(start);
+		    }));
+
+		for (Tonemap tonemap : {Tonemap::Clamp, Tonemap::Reinhard, Tonemap::ACES}) {
+			FilmSettings settings;
+			settings.tonemap = tonemap;
+			add(std::string("film_") + tonemapName(tonemap), threads, medianSeconds(options.reps, [&]() {
+				    auto start = std::chrono::steady_clock::now();
+				    pool.parallelFor(0, numPixels, FILM_TILE,
+				                     [&](int begin, int end) { developRGBA8(buffer.color, buffer.samples, begin, end, settings, texels.data()); });
+				    return secondsSince(start);
+			    }));
+		}
+	}
+
+	return results;
+}
+
+static std::vector<RenderResult> runRenders(const BenchOptions& options) {
+	std::vector<RenderResult> results;
+
+	for (int count : options.sphereCounts) {
+		std::vector<Shape*> worldObjects;
+		buildRandomSphereScene(worldObjects, count);
+
+		for (Resolution res : options.resolutions) {
+			RenderView view = RenderView::lookFrom(glm::vec3(0.0f), -90.0f, 0.0f, 45.0f, res.width, res.height);
+
+			for (SimdLevel level : options.simdLevels) {
+				RayTracer tracer(view.numPixels(), options.bounces, options.samples);
+				tracer.setVerbose(false);
+				tracer.setSimdLevel(level);
+				tracer.traceAll(worldObjects, view);
+
+				const RenderStats& stats = tracer.getLastRenderStats();
+				results.push_back({count, res.width, res.height, level, tracer.getNumThreads(), stats});
+
+				std::cerr << "Render " << count << " spheres @ " << res.width << "x" << res.height << " (" << simdLevelName(level) << "): "
+				          << ratio((double)stats.raySegments, stats.traceSeconds) / 1e6 << " Mrays/s, build " << stats.buildSeconds * 1e3 << " ms" << std::endl;
+			}
+		}
+
+		destroyScene(worldObjects);
+	}
+
+	return results;
+}
+
+// Same render at different ray budgets, each in its own child process so its peak RSS is its own
+static std::vector<MemoryResult> runMemory(const BenchOptions& options) {
+	std::vector<MemoryResult> results;
+
+	for (Resolution res : options.memoryResolutions) {
+		for (int budget : options.rayBudgets) {
+			int numPixels = res.width * res.height;
+			MemoryResult result{res.width, res.height, budget > 0 ? budget : numPixels, 0, 0, 0, 0, 0.0};
+
+			int fds[2];
+			if (pipe(fds) != 0) {
+				std::cerr << "pipe failed, skipping memory renders" << std::endl;
+				return results;
+			}
+
+			pid_t child = fork();
+			if (child == 0) {
+				close(fds[0]);
+				std::vector<Shape*> worldObjects;
+				buildRandomSphereScene(worldObjects, 1000);
+				RenderView view = RenderView::lookFrom(glm::vec3(0.0f), -90.0f, 0.0f, 45.0f, res.width, res.height);
+
+				RayTracer tracer(numPixels, options.bounces, options.samples);
+				tracer.setVerbose(false);
+				tracer.setRayBudget(result.rayBudget);
+				tracer.traceAll(worldObjects, view);
+
+				result.raySlots = tracer.getRaySlots();
+				result.rayBytes = tracer.getRayStateBytes();
+				result.traceSeconds = tracer.getLastRenderStats().traceSeconds;
+				bool written = write(fds[1], &result, sizeof(result)) == (ssize_t)sizeof(result);
+				_exit(written ? 0 : 1);
+			}
+
+			close(fds[1]);
+			bool received = child > 0 && read(fds[0], &result, sizeof(result)) == (ssize_t)sizeof(result);
+			close(fds[0]);
+
+			int status = 0;
+			rusage usage{};
+			if (child > 0)
+				wait4(child, &status, 0, &usage);
+			if (!received || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+				std::cerr << "Memory render @ " << res.width << "x" << res.height << " failed" << std::endl;
+				continue;
+			}
+
+			result.filmBytes = (size_t)numPixels * 2 * (3 * sizeof(float) + sizeof(int));
+			result.peakRssKB = usage.ru_maxrss;
+			results.push_back(result);
+
+			std::cerr << "Memory @ " << res.width << "x" << res.height << ", budget " << result.rayBudget << " rays: peak RSS " << result.peakRssKB / 1024
+			          << " MB (rays " << result.rayBytes / (1 << 20) << " MB, film " << result.filmBytes / (1 << 20) << " MB), " << result.traceSeconds
+			          << " s" << std::endl;
+		}
+	}
+
+	return results;
+}
+
+static void writeJson(std::ostream& out, const BenchOptions& options, const std::vector<StageResult>& stages, const std::vector<RenderResult>& renders,
+                      const std::vector<MemoryResult>& memory) {
+	out << "{\n";
+	out << "  \"simd\": \"" << simdLevelName(bestSimdLevel()) << "\",\n";
+	out << "  \"samples\": " << options.samples << ",\n";
+	out << "  \"bounces\": " << options.bounces << ",\n";
+	out << "  \"reps\": " << options.reps << ",\n";
+	out << "  \"peak_rss_mb\": " << (double)peakRssKB(RUSAGE_SELF) / 1024.0 << ",\n"; // Whole run, memory renders excluded
+
+	out << "  \"stages\": [\n";
+	for (size_t i = 0; i < stages.size(); i++) {
+		const StageResult& s = stages[i];
+		out << "    {\"name\": \"" << s.name << "\", \"width\": " << s.width << ", \"height\": " << s.height << ", \"threads\": " << s.threads
+		    << ", \"rays\": " << s.rays << ", \"seconds\": " << s.seconds << ", \"rays_per_second\": " << ratio((double)s.rays, s.seconds)
+		    << ", \"ns_per_ray\": " << ratio(s.seconds * 1e9, (double)s.rays) << "}" << (i + 1 < stages.size() ? "," : "") << "\n";
+	}
+	out << "  ],\n";
+
+	out << "  \"renders\": [\n";
+	for (size_t i = 0; i < renders.size(); i++) {
+		const RenderResult& r = renders[i];
+		double rays = (double)r.stats.raySegments;
+		out << "    {\"spheres\": " << r.spheres << ", \"width\": " << r.width << ", \"height\": " << r.height << ", \"simd\": \"" << simdLevelName(r.simd)
+		    << "\", \"threads\": " << r.threads << ", \"build_seconds\": " << r.stats.buildSeconds << ", \"trace_seconds\": " << r.stats.traceSeconds
+		    << ", \"rays\": " << r.stats.raySegments << ", \"rays_per_second\": " << ratio(rays, r.stats.traceSeconds)
+		    << ", \"ns_per_ray\": " << ratio(r.stats.traceSeconds * 1e9, rays) << "}" << (i + 1 < renders.size() ? "," : "") << "\n";
+	}
+	out << "  ],\n";
+
+	out << "  \"memory\": [\n";
+	for (size_t i = 0; i < memory.size(); i++) {
+		const MemoryResult& m = memory[i];
+		out << "    {\"width\": " << m.width << ", \"height\": " << m.height << ", \"ray_budget\": " << m.rayBudget << ", \"window_pixels\": " << m.raySlots
+		    << ", \"ray_state_mb\": " << (double)m.rayBytes / (1 << 20) << ", \"film_mb\": " << (double)m.filmBytes / (1 << 20)
+		    << ", \"peak_rss_mb\": " << (double)m.peakRssKB / 1024.0 << ", \"trace_seconds\": " << m.traceSeconds << "}"
+		    << (i + 1 < memory.size() ? "," : "") << "\n";
+	}
+	out << "  ]\n";
+	out << "}\n";
+}
+
+static void printUsage(const char* program) {
+	std::cout << "Usage: " << program << " [options]\n"
+	          << "  --spheres <n,n,...>     Scene sizes for the end-to-end renders (default 10,1000,100000,1000000)\n"
+	          << "  --res <WxH,WxH,...>     Resolutions (default 320x240,640x480,1280x720), stages use the first\n"
+	          << "  --film-res <WxH,...>    Resolutions for the film stages (default 3840x2160,7680x4320)\n"
+	          << "  --mem-res <WxH,...>     Resolutions for the peak RSS renders (default 3840x2160)\n"
+	          << "  --mem-budgets <n,...>   Ray budgets for them, 0 is the whole image at once (default 0,2097152,262144)\n"
+	          << "  --simd <best|all|name>  Kernels to render with (default best)\n"
+	          << "  --spp <n>               Samples per pixel for renders (default 1)\n"
+	          << "  --bounces <n>           Max bounces (default 8)\n"
+	          << "  --reps <n>              Repetitions per stage, median is reported (default 5)\n"
+	          << "  --quick                 Small sizes only, for a smoke test\n"
+	          << "  --out <file.json>       Write JSON here instead of stdout\n"
+	          << "  --profile <file.json>   Also write a Chrome trace_event JSON (zones add a little overhead)\n";
+}
+
+static bool parseOptions(int argc, char** argv, BenchOptions& options) {
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "--help" || arg == "-h") {
+			printUsage(argv[0]);
+			std::exit(0);
+		} else if (arg == "--spheres" && hasValue) {
+			options.sphereCounts.clear();
+			std::stringstream list(argv[++i]);
+			for (std::string item; std::getline(list, item, ',');)
+				options.sphereCounts.push_back(std::atoi(item.c_str()));
+		} else if (arg == "--mem-budgets" && hasValue) {
+			options.rayBudgets.clear();
+			std::stringstream list(argv[++i]);
+			for (std::string item; std::getline(list, item, ',');)
+				options.rayBudgets.push_back(std::max(std::atoi(item.c_str()), 0));
+		} else if ((arg == "--res" || arg == "--film-res" || arg == "--mem-res") && hasValue) {
+			std::vector<Resolution>& resolutions = arg == "--res" ? options.resolutions : arg == "--film-res" ? options.filmResolutions : options.memoryResolutions;
+			resolutions.clear();
+			std::stringstream list(argv[++i]);
+			for (std::string item; std::getline(list, item, ',');) {
+				Resolution res{0, 0};
+				if (std::sscanf(item.c_str(), "%dx%d", &res.width, &res.height) != 2 || res.width <= 0 || res.height <= 0) {
+					std::cerr << "Bad resolution: " << item << std::endl;
+					return false;
+				}
+				resolutions.push_back(res);
+			}
+		} else if (arg == "--simd" && hasValue) {
+			std::string level = argv[++i];
+			options.simdLevels.clear();
+			for (SimdLevel l : {SimdLevel::Scalar, SimdLevel::SSE, SimdLevel::AVX2}) {
+				if (isSimdLevelSupported(l) && (level == "all" || level == simdLevelName(l)))
+					options.simdLevels.push_back(l);
+			}
+			if (level == "best")
+				options.simdLevels.push_back(bestSimdLevel());
+			if (options.simdLevels.empty()) {
+				std::cerr << "Unsupported SIMD level: " << level << std::endl;
+				return false;
+			}
+		} else if (arg == "--spp" && hasValue) {
+			options.samples = std::atoi(argv[++i]);
+		} else if (arg == "--bounces" && hasValue) {
+			options.bounces = std::atoi(argv[++i]);
+		} else if (arg == "--reps" && hasValue) {
+			options.reps = std::atoi(argv[++i]);
+		} else if (arg == "--quick") {
+			options.sphereCounts = {10, 1000};
+			options.resolutions = {{160, 120}};
+			options.filmResolutions = {{640, 480}};
+			options.memoryResolutions = {{640, 480}};
+			options.rayBudgets = {0, 1 << 16};
+		} else if (arg == "--out" && hasValue) {
+			options.output = argv[++i];
+		} else if (arg == "--profile" && hasValue) {
+			options.profile = argv[++i];
+		} else {
+			std::cerr << "Unknown or incomplete option: " << arg << std::endl;
+			return false;
+		}
+	}
+
+	if (options.resolutions.empty() || options.samples <= 0 || options.bounces <= 0 || options.reps <= 0) {
+		std::cerr << "Need a resolution, and spp, bounces and reps must be positive" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	BenchOptions options;
+	if (!parseOptions(argc, argv, options)) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	Profiler::setEnabled(!options.profile.empty());
+
+	std::vector<StageResult> stages = runStages(options, options.resolutions.front());
+	std::vector<StageResult> film = runFilm(options);
+	stages.insert(stages.end(), film.begin(), film.end());
+	std::vector<RenderResult> renders = runRenders(options);
+	std::vector<MemoryResult> memory = runMemory(options);
+
+	if (!options.profile.empty() && !Profiler::writeChromeTrace(options.profile)) {
+		std::cerr << "Failed to write " << options.profile << std::endl;
+		return 1;
+	}
+
+	if (options.output.empty()) {
+		writeJson(std::cout, options, stages, renders, memory);
+		return 0;
+	}
+
+	std::ofstream file(options.output);
+	writeJson(file, options, stages, renders, memory);
+	if (!file) {
+		std::cerr << "Failed to write " << options.output << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -1,8 +1,13 @@
 #include "Cube.h"
+#include "Film.h"
 #include "Material.h"
+#include "MeshLoader.h"
+#include "Profiler.h"
 #include "Ray.h"
 #include "RayTracer.h"
+#include "RenderView.h"
 #include "Renderer.h"
+#include "Scenes.h"
 #include "Shape.h"
 #include "Sphere.h"
 #include "Square.h"
@@ -16,7 +21,6 @@
 #include <thread>
 #include <vector>
 
-#define MEASURE_LOGS false
 bool renderToImagePlane = false;
 
 // TODO: Remove magic numbers
@@ -32,42 +36,32 @@ std::vector<Shape*> worldObjects;
 // For performance/debugging
 static int rayStep = 16;
 
+// Adaptive sampling error threshold, 0 traces every pixel every sample
+static float noiseThreshold = 0.02f;
+
+// Moving the camera abandons the running render and starts one from the new view
+static bool restartOnMove = true;
+
+// How the accumulation is developed for display, changes apply without restarting the render
+static FilmSettings filmSettings;
+static RenderView lastRenderView;
+
 // Delta time
 static float deltaTime = 0.0f;
 static float lastFrame = 0.0f;
 
-// FOR DEBUGGING / BENCHMARKS
-// TODO: Move to own file/class
-void measure(const std::string& name, auto func) {
-	auto start = std::chrono::high_resolution_clock::now();
-	func();
-	auto end = std::chrono::high_resolution_clock::now();
-
-	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
-	if (MEASURE_LOGS)
-		std::cout << name << " took " << duration.count() << " ms\n";
-}
-
 void cleanupScene() {
-	for (Shape* shape : worldObjects) {
-		delete shape;
-	}
-	worldObjects.clear();
+	destroyScene(worldObjects);
 }
 
-void setupScene() {
-	Sphere* sphere;
-	sphere = new Sphere(0.4f, 4, glm::vec3(0.0f, 0.0f, -5.0f), Material::DIFFUSE);
-	worldObjects.push_back(sphere);
-	sphere = new Sphere(1.0f, 4, glm::vec3(0.0f, 1.0f, -10.0f), Material::DIFFUSE);
-	worldObjects.push_back(sphere);
-	sphere = new Sphere(4.0f, 4, glm::vec3(0.0f, 3.0f, -15.0f), Material::DIFFUSE);
-	worldObjects.push_back(sphere);
-
-	// "Floor"
-	float radius = (float)(2 << 12);
-	sphere = new Sphere(radius, 6, glm::vec3(0.0f, -radius - 1.0f, -5.0f), Material::DIFFUSE);
-	worldObjects.push_back(sphere);
+// Meshes given on the command line go on top of the default scene
+void setupScene(const std::vector<std::string>& meshPaths) {
+	buildDefaultScene(worldObjects);
+
+	for (const std::string& path : meshPaths) {
+		if (Mesh* mesh = loadMesh(path))
+			worldObjects.push_back(mesh);
+	}
 }
 
 void renderUI(Renderer& renderer) {
@@ -88,6 +82,7 @@ void renderUI(Renderer& renderer) {
 
 	// ImGui::SliderInt("Thread Count", &threadCount, 1, 16);
 	ImGui::SliderInt("RayStep", &rayStep, 1, 128);
+	ImGui::SliderFloat("Noise Threshold", &noiseThreshold, 0.0f, 0.2f, "%.3f");
 
 	if (ImGui::Button("Step")) {
 		tracer.traceStep();
@@ -95,17 +90,53 @@ void renderUI(Renderer& renderer) {
 	if (ImGui::Button("Render")) {
 		Camera& cam = renderer.getCamera();
 		cam.updateImagePlane((float)renderer.getWidth(), (float)renderer.getHeight());
+		RenderView view = RenderView::fromCamera(cam, renderer.getWidth(), renderer.getHeight());
 
+		// Rays get reinitialized below, a running render has to be stopped first
+		tracer.cancel();
 		renderer.cleanupRays();
 
-		tracer.initializeRays(renderer, 0);
+		tracer.initializeRays(view, 0);
 		renderer.setupRayBuffers(tracer);
 
 		// Start tracing
-		tracer.traceAllAsync(worldObjects, renderer);
+		tracer.setAdaptiveThreshold(noiseThreshold);
+		tracer.restartAsync(worldObjects, view);
+		lastRenderView = view;
 		renderToImagePlane = true;
 	}
 
+	ImGui::SameLine();
+	if (ImGui::Button("Stop")) {
+		tracer.cancel();
+	}
+
+	ImGui::Checkbox("Restart on Move", &restartOnMove);
+
+	const char* tonemaps[] = {"Clamp", "Reinhard", "ACES"};
+	int tonemap = (int)filmSettings.tonemap;
+	bool filmChanged = ImGui::SliderFloat("Exposure", &filmSettings.exposure, -5.0f, 5.0f, "%.1f stops");
+	if (ImGui::Combo("Tonemap", &tonemap, tonemaps, 3)) {
+		filmSettings.tonemap = (Tonemap)tonemap;
+		filmChanged = true;
+	}
+	filmChanged |= ImGui::Checkbox("sRGB", &filmSettings.srgb);
+	if (filmChanged)
+		tracer.setFilm(filmSettings);
+
+	// Tracer zones, open the dump in chrome://tracing or ui.perfetto.dev
+	bool profiling = Profiler::isEnabled();
+	if (ImGui::Checkbox("Profile", &profiling))
+		Profiler::setEnabled(profiling);
+
+	ImGui::SameLine();
+	if (ImGui::Button("Save Trace")) {
+		if (Profiler::writeChromeTrace("trace.json"))
+			std::cout << "Wrote trace.json" << std::endl;
+		else
+			std::cerr << "Failed to write trace.json" << std::endl;
+	}
+
 	ImGui::End();
 
 	ImGui::Begin("Camera");
@@ -117,7 +148,24 @@ void renderUI(Renderer& renderer) {
 	ImGui::End();
 }
 
-int main() {
+static bool sameView(const RenderView& a, const RenderView& b) {
+	return a.eye.position == b.eye.position && a.eye.yaw == b.eye.yaw && a.eye.pitch == b.eye.pitch && a.width == b.width && a.height == b.height;
+}
+
+// Restarts the render from the current camera if it moved, reusing the scene the tracer already built
+void restartIfMoved(Renderer& renderer) {
+	if (!restartOnMove || !renderToImagePlane)
+		return;
+
+	RenderView view = RenderView::fromCamera(renderer.getCamera(), renderer.getWidth(), renderer.getHeight());
+	if (sameView(view, lastRenderView))
+		return;
+
+	tracer.restartAsync(view);
+	lastRenderView = view;
+}
+
+int main(int argc, char** argv) {
 	std::cout << "Initializing ImGui..." << std::endl;
 	IMGUI_CHECKVERSION();
 	ImGui::CreateContext();
@@ -131,6 +179,9 @@ int main() {
 	// We need this for resize callback
 	renderer.setTracer(&tracer);
 
+	// Finished passes get resolved to RGBA8 on the render thread, the frame loop only uploads
+	tracer.setResolveDisplay(true);
+
 	std::cout << "Initializing ImGui backends..." << std::endl;
 	if (!ImGui_ImplGlfw_InitForOpenGL(renderer.getWindow(), true)) {
 		std::cerr << "Failed to initialize ImGui GLFW backend!" << std::endl;
@@ -146,7 +197,7 @@ int main() {
 	renderer.setupCallbacks(renderer.getWindow());
 
 	// Setup scene
-	setupScene();
+	setupScene(std::vector<std::string>(argv + 1, argv + argc));
 	renderer.setupShapeBuffers(worldObjects);
 
 	std::cout << renderer.getWidth() << std::endl;
@@ -164,7 +215,7 @@ int main() {
 		ImGui::NewFrame();
 		renderer.beginFrame();
 
-		renderer.updateTexture(tracer.getAveragedColors());
+		renderer.updateTexture(tracer);
 		renderer.renderRays(tracer, rayStep);
 		renderer.renderShapes(worldObjects);
 		renderer.renderFrustrum();
@@ -181,9 +232,12 @@ int main() {
 
 		// Process input
 		renderer.processInput(deltaTime);
+		restartIfMoved(renderer);
 		renderer.endFrame();
 	}
 
+	// The render thread reads the scene
+	tracer.cancel();
 	cleanupScene();
 
 	ImGui_ImplOpenGL3_Shutdown();
@@ -2,10 +2,12 @@
 #include <glm/glm.hpp>
 #include <vector>
 
-Cube::Cube(float size, glm::vec3 center) {
+Cube::Cube(float size, glm::vec3 center, Material mat) {
+    this->material = mat;
+
     float halfSize = size / 2.0f;
-    glm::vec3 min = center - glm::vec3(halfSize);
-    glm::vec3 max = center + glm::vec3(halfSize);
+    min = center - glm::vec3(halfSize);
+    max = center + glm::vec3(halfSize);
 
     // Front face
     vertices.push_back(min.x); vertices.push_back(min.y); vertices.push_back(max.z);
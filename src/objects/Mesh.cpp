@@ -0,0 +1,12 @@
+#include "Mesh.h"
+#include <utility>
+
+Mesh::Mesh(std::vector<float> positions, std::vector<uint32_t> indices, Material mat)
+    : indices(std::move(indices)) {
+    this->material = mat;
+    this->vertices = std::move(positions);
+}
+
+std::vector<float> Mesh::getVertices() const {
+    return vertices;
+}
@@ -0,0 +1,32 @@
+#include "Plane.h"
+#include <cmath>
+
+Plane::Plane(glm::vec3 point, glm::vec3 normal, Material mat, float displaySize)
+    : normal(glm::normalize(normal)) {
+    this->material = mat;
+    this->position = point;
+
+    // Any two directions in the plane
+    glm::vec3 helper = std::abs(this->normal.y) < 0.99f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+    glm::vec3 u = glm::normalize(glm::cross(helper, this->normal)) * (displaySize / 2.0f);
+    glm::vec3 v = glm::cross(this->normal, u);
+
+    glm::vec3 p0 = -u - v;
+    glm::vec3 p1 = u - v;
+    glm::vec3 p2 = -u + v;
+    glm::vec3 p3 = u + v;
+
+    // First triangle
+    vertices.push_back(p0.x); vertices.push_back(p0.y); vertices.push_back(p0.z);
+    vertices.push_back(p1.x); vertices.push_back(p1.y); vertices.push_back(p1.z);
+    vertices.push_back(p2.x); vertices.push_back(p2.y); vertices.push_back(p2.z);
+
+    // Second triangle
+    vertices.push_back(p1.x); vertices.push_back(p1.y); vertices.push_back(p1.z);
+    vertices.push_back(p3.x); vertices.push_back(p3.y); vertices.push_back(p3.z);
+    vertices.push_back(p2.x); vertices.push_back(p2.y); vertices.push_back(p2.z);
+}
+
+std::vector<float> Plane::getVertices() const {
+    return vertices;
+}
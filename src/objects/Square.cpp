@@ -1,6 +1,7 @@
 #include "Square.h"
 
-Square::Square(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2) {
+Square::Square(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2)
+    : p0(p0), p1(p1), p2(p2) {
     glm::vec3 p3 = p1 + (p2 - p0);
 
     // First triangle
@@ -0,0 +1,407 @@
+// pbr-render: headless offline render of a scene, no window or GL context needed
+#include "Distributed.h"
+#include "Film.h"
+#include "ImageWriter.h"
+#include "MeshLoader.h"
+#include "Profiler.h"
+#include "RayTracer.h"
+#include "RenderView.h"
+#include "SceneCache.h"
+#include "Scenes.h"
+#include "TileGrid.h"
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+struct RenderOptions {
+	int width{800};
+	int height{600};
+	int samples{64};
+	int samplesPerPass{4}; // Samples of every pixel traced together
+	int rayBudget{1 << 21}; // Caps the rays (and ray buffers) of one pass
+	int bounces{64};
+	int rouletteDepth{3}; // Bounces before Russian roulette may end a path
+	float fov{45.0f};
+	unsigned seed{0};
+	float adaptive{0.0f}; // Adaptive sampling error threshold, 0 is off
+	int minSamples{32};
+	int tileSize{32};
+	TileOrder tileOrder{TileOrder::Morton};
+	FilmSettings film; // Exposure, tonemap and sRGB encode of the output
+	std::string output{"render.ppm"};
+	std::string filmScratch; // Accumulate in this memory mapped file instead of RAM, empty means RAM
+	bool streamTiles{false}; // Write every tile to the output as it finishes a pass
+	std::vector<std::string> meshes; // OBJ/PLY files added to the scene
+	std::string profile; // Chrome trace of the render, empty means no profiling
+	std::string sceneCache; // Binary scene + BVH snapshot, empty means always build from scratch
+	int listenPort{-1};       // Coordinate workers on this port instead of rendering, -1 renders locally
+	int localWorkers{0};      // Worker processes to start on this machine, implies coordinating
+	bool remoteWorkers{false}; // --listen was given, so workers may connect from other machines
+	double tileTimeout{600.0}; // Seconds a worker may go silent before its tile is handed out again
+	std::string worker;       // host:port of a coordinator, empty means not a worker
+	std::string checkpoint;   // Film saved here as the render goes, empty means no checkpoints
+	double checkpointEvery{60.0}; // Seconds between checkpoints (the last pass is always saved)
+	bool resume{false};       // Continue from the checkpoint if there is one
+	int moreSamples{0};       // With resume, the target is the checkpoint's samples plus this many instead of --spp
+};
+
+static void printUsage(const char* program) {
+	std::cout << "Usage: " << program << " [options]\n"
+	          << "  --width <px>       Image width (default 800)\n"
+	          << "  --height <px>      Image height (default 600)\n"
+	          << "  --spp <n>          Samples per pixel (default 64)\n"
+	          << "  --spp-per-pass <n> Samples traced together in one pass (default 4)\n"
+	          << "  --ray-budget <n>   Max rays in flight, bigger images go a window of tiles at a time (default 2097152)\n"
+	          << "  --bounces <n>      Max bounces per path (default 64)\n"
+	          << "  --rr-depth <n>     Bounces before Russian roulette may end a path, >= bounces is off (default 3)\n"
+	          << "  --fov <degrees>    Vertical field of view (default 45)\n"
+	          << "  --seed <n>         Sampler seed, same seed same image (default 0)\n"
+	          << "  --adaptive <err>   Stop sampling a pixel once its error is below err (default 0, off)\n"
+	          << "  --min-spp <n>      Samples every pixel gets before adaptive sampling may stop it (default 32)\n"
+	          << "  --tile-size <px>   Side of the square tiles work is scheduled by (default 32)\n"
+	          << "  --tile-order <o>   morton, spiral or scanline (default morton)\n"
+	          << "  --exposure <stops> Brighten (or darken, negative) the image by 2^stops (default 0)\n"
+	          << "  --tonemap <op>     clamp, reinhard or aces (default clamp)\n"
+	          << "  --linear           Write linear values instead of sRGB encoding them\n"
+	          << "  --out <file>       Output image, .pfm for linear float RGB, else PPM (default render.ppm)\n"
+	          << "  --film-scratch <f> Accumulate in a memory mapped file instead of RAM, for images that don't fit (removed once mapped)\n"
+	          << "  --stream-tiles     Write tiles to the output as they finish, the file is always the latest pass\n"
+	          << "  --mesh <file>      Add an .obj or binary .ply mesh to the scene (repeatable)\n"
+	          << "  --scene-cache <f>  Load the built scene from f if it matches, else build it and write f\n"
+	          << "  --profile <file>   Write a Chrome trace_event JSON of the render\n"
+	          << "  --listen <port>    Hand tiles out to workers connecting on port (0 picks one) of any interface instead of rendering\n"
+	          << "  --local-workers <n> Start n workers on this machine for the coordinator, listening on 127.0.0.1 only without --listen (default 0)\n"
+	          << "  --tile-timeout <s> Seconds before a silent worker's tile is handed out again (default 600)\n"
+	          << "  --worker <h:port>  Render tiles for the coordinator at h:port, every other option comes from it\n"
+	          << "  --checkpoint <f>   Save the film to f as the render goes (atomically, a crash leaves the last one whole)\n"
+	          << "  --checkpoint-every <s> Seconds between checkpoints, the last pass is always saved (default 60)\n"
+	          << "  --resume           Continue from the --checkpoint file if it exists, up to --spp\n"
+	          << "  --more-spp <n>     With --resume, take n samples more than the checkpoint has instead of going to --spp\n";
+}
+
+static bool parseOptions(int argc, char** argv, RenderOptions& options) {
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "--help" || arg == "-h") {
+			printUsage(argv[0]);
+			std::exit(0);
+		} else if (arg == "--width" && hasValue) {
+			options.width = std::atoi(argv[++i]);
+		} else if (arg == "--height" && hasValue) {
+			options.height = std::atoi(argv[++i]);
+		} else if (arg == "--spp" && hasValue) {
+			options.samples = std::atoi(argv[++i]);
+		} else if (arg == "--spp-per-pass" && hasValue) {
+			options.samplesPerPass = std::atoi(argv[++i]);
+		} else if (arg == "--ray-budget" && hasValue) {
+			options.rayBudget = std::atoi(argv[++i]);
+		} else if (arg == "--bounces" && hasValue) {
+			options.bounces = std::atoi(argv[++i]);
+		} else if (arg == "--rr-depth" && hasValue) {
+			options.rouletteDepth = std::atoi(argv[++i]);
+		} else if (arg == "--fov" && hasValue) {
+			options.fov = (float)std::atof(argv[++i]);
+		} else if (arg == "--seed" && hasValue) {
+			options.seed = (unsigned)std::strtoul(argv[++i], nullptr, 10);
+		} else if (arg == "--adaptive" && hasValue) {
+			options.adaptive = (float)std::atof(argv[++i]);
+		} else if (arg == "--min-spp" && hasValue) {
+			options.minSamples = std::atoi(argv[++i]);
+		} else if (arg == "--tile-size" && hasValue) {
+			options.tileSize = std::atoi(argv[++i]);
+		} else if (arg == "--tile-order" && hasValue) {
+			if (!parseTileOrder(argv[++i], options.tileOrder)) {
+				std::cerr << "Unknown tile order: " << argv[i] << std::endl;
+				return false;
+			}
+		} else if (arg == "--exposure" && hasValue) {
+			options.film.exposure = (float)std::atof(argv[++i]);
+		} else if (arg == "--tonemap" && hasValue) {
+			if (!parseTonemap(argv[++i], options.film.tonemap)) {
+				std::cerr << "Unknown tonemap: " << argv[i] << std::endl;
+				return false;
+			}
+		} else if (arg == "--linear") {
+			options.film.srgb = false;
+		} else if (arg == "--out" && hasValue) {
+			options.output = argv[++i];
+		} else if (arg == "--film-scratch" && hasValue) {
+			options.filmScratch = argv[++i];
+		} else if (arg == "--stream-tiles") {
+			options.streamTiles = true;
+		} else if (arg == "--mesh" && hasValue) {
+			options.meshes.push_back(argv[++i]);
+		} else if (arg == "--scene-cache" && hasValue) {
+			options.sceneCache = argv[++i];
+		} else if (arg == "--profile" && hasValue) {
+			options.profile = argv[++i];
+		} else if (arg == "--listen" && hasValue) {
+			options.listenPort = std::atoi(argv[++i]);
+			options.remoteWorkers = true;
+		} else if (arg == "--local-workers" && hasValue) {
+			options.localWorkers = std::atoi(argv[++i]);
+		} else if (arg == "--tile-timeout" && hasValue) {
+			options.tileTimeout = std::atof(argv[++i]);
+		} else if (arg == "--worker" && hasValue) {
+			options.worker = argv[++i];
+		} else if (arg == "--checkpoint" && hasValue) {
+			options.checkpoint = argv[++i];
+		} else if (arg == "--checkpoint-every" && hasValue) {
+			options.checkpointEvery = std::atof(argv[++i]);
+		} else if (arg == "--resume") {
+			options.resume = true;
+		} else if (arg == "--more-spp" && hasValue) {
+			options.moreSamples = std::atoi(argv[++i]);
+		} else {
+			std::cerr << "Unknown or incomplete option: " << arg << std::endl;
+			return false;
+		}
+	}
+
+	if (options.width <= 0 || options.height <= 0 || options.samples <= 0 || options.bounces <= 0 || options.samplesPerPass <= 0 || options.rayBudget <= 0 ||
+	    options.tileSize <= 0) {
+		std::cerr << "Width, height, spp, spp per pass, ray budget, bounces and tile size must be positive" << std::endl;
+		return false;
+	}
+	// Local workers alone get a free port on the loopback interface
+	if (options.localWorkers > 0 && options.listenPort < 0)
+		options.listenPort = 0;
+	if (options.listenPort > 65535 || options.localWorkers < 0 || options.tileTimeout <= 0.0) {
+		std::cerr << "Port must be at most 65535, local workers non negative and the tile timeout positive" << std::endl;
+		return false;
+	}
+	if ((options.resume || options.moreSamples != 0) && options.checkpoint.empty()) {
+		std::cerr << "--resume and --more-spp need a --checkpoint to resume from" << std::endl;
+		return false;
+	}
+	if (!options.checkpoint.empty() && options.listenPort >= 0) {
+		std::cerr << "Checkpoints are for local renders, workers' tiles aren't checkpointed" << std::endl;
+		return false;
+	}
+	if (options.moreSamples < 0 || options.checkpointEvery < 0.0) {
+		std::cerr << "More spp and the checkpoint interval can't be negative" << std::endl;
+		return false;
+	}
+	if (options.moreSamples > 0)
+		options.resume = true;
+	return true;
+}
+
+// Same binary as a worker of the coordinator on port, the listening socket isn't theirs to keep
+static std::vector<pid_t> startLocalWorkers(int count, int port, int listenFd) {
+	std::string address = "127.0.0.1:" + std::to_string(port);
+	std::cout.flush();
+
+	std::vector<pid_t> children;
+	for (int i = 0; i < count; i++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(listenFd);
+			execl("/proc/self/exe", "pbr-render", "--worker", address.c_str(), (char*)nullptr);
+			std::cerr << "Failed to start a local worker: " << std::strerror(errno) << std::endl;
+			_exit(127);
+		}
+		if (pid < 0)
+			std::cerr << "Failed to fork a local worker: " << std::strerror(errno) << std::endl;
+		else
+			children.push_back(pid);
+	}
+	return children;
+}
+
+static int runWorkerMode(const std::string& address) {
+	size_t colon = address.rfind(':');
+	if (colon == std::string::npos || colon == 0) {
+		std::cerr << "Worker address must be host:port, got " << address << std::endl;
+		return 1;
+	}
+	return runWorker(address.substr(0, colon), std::atoi(address.c_str() + colon + 1)) ? 0 : 1;
+}
+
+// Everything the scene below is built from
+static uint64_t sceneKey(const RenderOptions& options) {
+	SceneCacheKey key;
+	key.add(std::string("default"));
+	key.add(SCENE_REVISION);
+	for (const std::string& path : options.meshes) {
+		key.addFile(path);
+		key.add(Material::DIFFUSE);
+	}
+	return key.value();
+}
+
+static bool buildScene(const RenderOptions& options, std::vector<Shape*>& worldObjects) {
+	buildDefaultScene(worldObjects);
+
+	for (const std::string& path : options.meshes) {
+		Mesh* mesh = loadMesh(path, Material::DIFFUSE);
+		if (!mesh) {
+			destroyScene(worldObjects);
+			return false;
+		}
+		worldObjects.push_back(mesh);
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	RenderOptions options;
+	if (!parseOptions(argc, argv, options)) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	// Scene, camera and settings all come from the coordinator
+	if (!options.worker.empty())
+		return runWorkerMode(options.worker);
+
+	// Same starting view as the interactive camera
+	RenderView view = RenderView::lookFrom(glm::vec3(0.0f), -90.0f, 0.0f, options.fov, options.width, options.height);
+
+	// Sized by traceAll, so a film going to a scratch file never gets allocated in RAM first
+	RayTracer tracer(0, options.bounces, options.samples);
+	tracer.setSeed(options.seed);
+	tracer.setSamplesPerPass(options.samplesPerPass);
+	tracer.setRayBudget(options.rayBudget);
+	tracer.setRouletteDepth(options.rouletteDepth);
+	tracer.setAdaptiveThreshold(options.adaptive);
+	tracer.setMinAdaptiveSamples(options.minSamples);
+	tracer.setFilm(options.film);
+	tracer.setTileSize(options.tileSize);
+	tracer.setTileOrder(options.tileOrder);
+	Profiler::setEnabled(!options.profile.empty());
+
+	// The film still fits in RAM more often than not, worth a try before giving up
+	if (!options.filmScratch.empty() && !tracer.setFilmScratch(options.filmScratch))
+		std::cerr << "Rendering with the film in RAM" << std::endl;
+
+	uint64_t key = sceneKey(options);
+	bool cached = !options.sceneCache.empty() && tracer.loadScene(options.sceneCache, key);
+	if (!cached) {
+		std::vector<Shape*> worldObjects;
+		if (!buildScene(options, worldObjects))
+			return 1;
+
+		// The tracer keeps its own flattened copy, the shapes aren't needed past this
+		tracer.buildAccelerationStructure(worldObjects);
+		destroyScene(worldObjects);
+
+		if (!options.sceneCache.empty() && tracer.saveScene(options.sceneCache, key))
+			std::cout << "Wrote scene cache " << options.sceneCache << std::endl;
+	}
+
+	bool resumed = false;
+	if (!options.checkpoint.empty()) {
+		tracer.setCheckpoint(options.checkpoint, options.checkpointEvery);
+
+		// No checkpoint yet is a fresh start, one of another render is a mistake not worth overwriting it for
+		if (options.resume && std::filesystem::exists(options.checkpoint)) {
+			if (!tracer.resumeFrom(options.checkpoint, view))
+				return 1;
+			resumed = true;
+			if (options.moreSamples > 0) {
+				options.samples = tracer.getResumeSamples() + options.moreSamples;
+				tracer.setSampleCount(options.samples);
+			}
+		}
+	}
+
+	int port = options.listenPort;
+	int listenFd = -1;
+	if (options.listenPort >= 0) {
+		listenFd = listenOn(port, !options.remoteWorkers);
+		if (listenFd < 0) {
+			std::cerr << "Failed to listen on port " << options.listenPort << std::endl;
+			return 1;
+		}
+	}
+
+	// Opening truncates the output, so only once every check above passed and an old image is lost to a render only
+	// Streamed a span at a time, the image never has to be in memory whole
+	ImageStream image;
+	if (!image.open(options.output, options.width, options.height)) {
+		std::cerr << "Failed to create " << options.output << std::endl;
+		return 1;
+	}
+	if (options.streamTiles)
+		tracer.setTileCallback([&](const Tile& tile, int) { tracer.writeTile(image, tile); });
+
+	auto start = std::chrono::steady_clock::now();
+	if (listenFd >= 0) {
+		std::cout << "Coordinating workers on port " << port << std::endl;
+		std::vector<pid_t> children = startLocalWorkers(options.localWorkers, port, listenFd);
+
+		DistributedJob job;
+		job.view = view;
+		job.samples = options.samples;
+		job.bounces = options.bounces;
+		job.rouletteDepth = options.rouletteDepth;
+		job.seed = options.seed;
+		job.adaptiveThreshold = options.adaptive;
+		job.minAdaptiveSamples = options.minSamples;
+		job.tileSize = options.tileSize;
+		job.tileOrder = options.tileOrder;
+		job.sceneKey = key;
+
+		CoordinatorStats coordinator;
+		std::function<void(const Tile&)> onTileMerged;
+		if (options.streamTiles)
+			onTileMerged = [&](const Tile& tile) { tracer.writeTile(image, tile); };
+		bool rendered = runCoordinator(listenFd, job, tracer, options.tileTimeout, coordinator, onTileMerged);
+		close(listenFd);
+
+		// Done workers exit on their own, stuck ones don't get to hold up the output
+		for (pid_t child : children) {
+			if (!rendered)
+				kill(child, SIGTERM);
+			waitpid(child, nullptr, 0);
+		}
+		if (!rendered)
+			return 1;
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "Rendered " << options.width << "x" << options.height << " @ " << options.samples << " spp in " << seconds << " s on " << coordinator.workers
+		          << " workers (" << coordinator.tiles << " tiles, " << coordinator.redispatched << " handed out again)" << std::endl;
+	} else {
+		tracer.traceAll(view);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		const RenderStats& stats = tracer.getLastRenderStats();
+		std::cout << "Rendered " << options.width << "x" << options.height << " @ " << options.samples << " spp in " << seconds << " s (" << stats.passes
+		          << " passes of up to " << tracer.getBatchSize() << " spp)" << std::endl;
+		if (options.adaptive > 0.0f)
+			std::cout << "Adaptive sampling: " << stats.convergedPixels << "/" << view.numPixels() << " pixels converged early, " << stats.raySegments
+			          << " ray segments" << std::endl;
+	}
+
+	// Streamed tiles already hold the last pass each of them got, writeTile() failures show up at close(). A resumed
+	// render only streams the tiles it traced, the ones done before the checkpoint still need writing
+	bool streamedAll = options.streamTiles && !resumed;
+	bool written = (streamedAll || tracer.writeImage(image)) && image.close();
+
+	if (!written) {
+		std::cerr << "Failed to write " << options.output << std::endl;
+		return 1;
+	}
+
+	std::cout << "Wrote " << options.output << std::endl;
+
+	if (!options.profile.empty()) {
+		if (!Profiler::writeChromeTrace(options.profile)) {
+			std::cerr << "Failed to write " << options.profile << std::endl;
+			return 1;
+		}
+		std::cout << "Wrote " << options.profile << std::endl;
+	}
+	return 0;
+}